@@ -0,0 +1,102 @@
+// Throughput and queueing delay of DynamicBatcher on single-frame requests,
+// with one batch in flight and with two.
+//
+//   tpuv7_batcher_bench yolov5s.bmodel [producers] [requests] [interval_us]
+//
+// Every producer thread submits its share of the requests open loop, one
+// every `interval_us`, and drops the results that are ready. With one
+// batch in flight each batch is uploaded, run and read back before the next
+// is launched; with two the next one is uploaded and launched meanwhile.
+
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "dynamic_batcher.h"
+
+namespace {
+
+double run(std::shared_ptr<BMNNContext> context, int producers, int requests,
+           int interval_us, int inflight) {
+  auto network = context->network();
+  const tpuRtNetInfo_t& info = network->getNetInfo();
+  std::vector<std::vector<char>> inputs(info.input.num);
+  std::vector<const void*> input_data;
+  for (int i = 0; i < info.input.num; ++i) {
+    tpuRtTensor_t tensor = *network->inputTpuRtTensor(i);
+    // one frame of stage 0
+    tensor.shape.dims[0] = 1;
+    inputs[i].assign(getTensorBytes(tensor), 1);
+    input_data.push_back(inputs[i].data());
+  }
+
+  DynamicBatcherConfig config;
+  config.inflight = inflight;
+  DynamicBatcher batcher(context, network, config);
+  std::vector<int> errors(producers, 0);
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int p = 0; p < producers; ++p) {
+    threads.emplace_back([&, p] {
+      // results hold the batch outputs, they are dropped once ready
+      std::deque<std::future<BatchedFrameResult>> pending;
+      auto next = std::chrono::steady_clock::now();
+      for (int r = p; r < requests; r += producers) {
+        std::this_thread::sleep_until(next);
+        next += std::chrono::microseconds(interval_us);
+        pending.push_back(batcher.submit(input_data));
+        while (!pending.empty() &&
+               pending.front().wait_for(std::chrono::seconds(0)) ==
+                   std::future_status::ready) {
+          errors[p] += pending.front().get().status != tpuRtSuccess;
+          pending.pop_front();
+        }
+      }
+      for (auto& result : pending) {
+        errors[p] += result.get().status != tpuRtSuccess;
+      }
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  int error_num = 0;
+  for (int producer_errors : errors) error_num += producer_errors;
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+  DynamicBatcherMetrics metrics = batcher.metrics();
+  std::cout << "inflight " << inflight << ": " << requests / seconds
+            << " frames/s, " << error_num << " errors, " << metrics.batches
+            << " batches, fill " << metrics.mean_fill << ", queue us p50 "
+            << metrics.p50_queue_us << " p99 " << metrics.p99_queue_us
+            << " max " << metrics.max_queue_us << std::endl;
+  std::cout << "  batches per stage:";
+  for (auto batches : metrics.stage_batches) std::cout << " " << batches;
+  std::cout << std::endl;
+  return error_num ? 0 : requests / seconds;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0]
+              << " MODEL [PRODUCERS] [REQUESTS] [INTERVAL_US]" << std::endl;
+    return 1;
+  }
+  int producers = argc > 2 ? atoi(argv[2]) : 8;
+  int requests = argc > 3 ? atoi(argv[3]) : 800;
+  int interval_us = argc > 4 ? atoi(argv[4]) : 2000;
+  tpuRtInit();
+  tpuRtSetDevice(0);
+  auto context = std::make_shared<BMNNContext>(argv[1]);
+  if (!context->loaded()) return 1;
+  double serial = run(context, producers, requests, interval_us, 1);
+  double overlapped = run(context, producers, requests, interval_us, 2);
+  if (serial > 0 && overlapped > 0) {
+    std::cout << "speedup " << overlapped / serial << "x" << std::endl;
+  }
+  return serial > 0 && overlapped > 0 ? 0 : 1;
+}
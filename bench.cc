@@ -0,0 +1,541 @@
+// Latency / throughput benchmark of a bmodel, broken down per stage.
+//
+//   tpuv7_bench --model yolov5s.bmodel [--iterations 1000] [--warmup 50]
+//               [--batch 1] [--streams 1] [--async] [--input frames.bin]
+//               [--json result.json] [--trace trace.json]
+//               [--decode-threads 0] [--pipeline [--inflight 2]]
+//
+// Every stream runs `iterations` batches on its own network instance after
+// `warmup` unrecorded ones. In sync mode each stage is timed around its
+// blocking call; in async mode the whole batch is queued on the stream with
+// an event after H2D, launch and D2H, and a stage is the time between the
+// completion of the previous event and its own. The JSON report goes to
+// --json, or stdout. --trace writes the spans of a TPUV7_ENABLE_TRACE build.
+// --decode-threads N gives every stream a pool of N threads that decodes
+// each frame in tiles. --pipeline feeds every stream through an
+// InferencePipeline with N frames in flight, upload, launch, read back and
+// post process each on their own thread; only total, decode and nms are
+// timed there, total from submit() to the end of the callback. With a
+// batch above 1, one batch is first post processed with postProcessBatch and
+// frame by frame with postProcessFrame, and the bench fails if they differ.
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include "dataset_reader.h"
+#include "pipeline.h"
+#include "post_process.cc"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchOptions {
+  std::string model;
+  std::string input;
+  std::string json;
+  std::string trace;
+  int iterations = 1000;
+  int warmup = 50;
+  int batch = 1;
+  int streams = 1;
+  int decode_threads = 0;
+  int inflight = 2;
+  bool async = false;
+  bool pipeline = false;
+};
+
+enum BenchStage { kH2D, kLaunch, kD2H, kDecode, kNMS, kTotal, kStageNum };
+const char* kStageNames[kStageNum] = {"h2d",    "launch", "d2h",
+                                      "decode", "nms",    "total"};
+
+// latencies of one stream, in microseconds
+struct StageSamples {
+  std::vector<double> us[kStageNum];
+  unsigned long long errors = 0;
+};
+
+double usSince(Clock::time_point begin, Clock::time_point end) {
+  return std::chrono::duration<double, std::micro>(end - begin).count();
+}
+
+void usage(const char* prog) {
+  std::cerr << "usage: " << prog
+            << " --model FILE [--iterations N] [--warmup N] [--batch N]"
+               " [--streams N] [--async] [--input FILE] [--json FILE]"
+               " [--trace FILE] [--decode-threads N] [--pipeline]"
+               " [--inflight N]"
+            << std::endl;
+}
+
+bool parseArgs(int argc, char** argv, BenchOptions& opt) {
+  static const option long_options[] = {
+      {"model", required_argument, nullptr, 'm'},
+      {"iterations", required_argument, nullptr, 'n'},
+      {"warmup", required_argument, nullptr, 'w'},
+      {"batch", required_argument, nullptr, 'b'},
+      {"streams", required_argument, nullptr, 's'},
+      {"async", no_argument, nullptr, 'a'},
+      {"input", required_argument, nullptr, 'i'},
+      {"json", required_argument, nullptr, 'j'},
+      {"trace", required_argument, nullptr, 't'},
+      {"decode-threads", required_argument, nullptr, 'd'},
+      {"pipeline", no_argument, nullptr, 'p'},
+      {"inflight", required_argument, nullptr, 'f'},
+      {nullptr, 0, nullptr, 0}};
+  int c;
+  while ((c = getopt_long(argc, argv, "m:n:w:b:s:ai:j:t:d:pf:", long_options,
+                          nullptr)) != -1) {
+    switch (c) {
+      case 'm': opt.model = optarg; break;
+      case 'n': opt.iterations = atoi(optarg); break;
+      case 'w': opt.warmup = atoi(optarg); break;
+      case 'b': opt.batch = atoi(optarg); break;
+      case 's': opt.streams = atoi(optarg); break;
+      case 'a': opt.async = true; break;
+      case 'i': opt.input = optarg; break;
+      case 'j': opt.json = optarg; break;
+      case 't': opt.trace = optarg; break;
+      case 'd': opt.decode_threads = atoi(optarg); break;
+      case 'p': opt.pipeline = true; break;
+      case 'f': opt.inflight = atoi(optarg); break;
+      default: return false;
+    }
+  }
+  return !opt.model.empty() && opt.iterations > 0 && opt.warmup >= 0 &&
+         opt.batch > 0 && opt.streams > 0 && opt.decode_threads >= 0 &&
+         opt.inflight > 0;
+}
+
+int findStage(const tpuRtNetInfo_t& info, int batch) {
+  for (int s = 0; s < info.stage_num; ++s) {
+    if (info.stages[s].input_shapes[0].dims[0] == batch) return s;
+  }
+  return -1;
+}
+
+/*
+ * Start gate of the streams: everyone waits until all warmups are done, so
+ * the measured window has every stream running.
+ */
+class StartGate {
+ public:
+  explicit StartGate(int count) : m_count(count) {}
+  void arriveAndWait() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (--m_count == 0) {
+      m_start = Clock::now();
+      m_cv.notify_all();
+    }
+    m_cv.wait(lock, [this] { return m_count == 0; });
+  }
+  Clock::time_point start() const { return m_start; }
+
+ private:
+  int m_count;
+  Clock::time_point m_start;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+};
+
+void runStream(const BenchOptions& opt, BMNNNetworkPool& networks,
+               int stage_idx, const std::vector<std::vector<char>>& inputs,
+               StartGate& gate, StageSamples& samples) {
+  BMNNNetworkPool::Lease network = networks.acquire();
+  const BMNNIOBinding& io = network->binding(stage_idx);
+  tpuRtStream_t stream = *network->getStream();
+
+  std::vector<std::vector<char>> outputs(io.outputNum());
+  std::vector<const tpuRtShape_t*> shapes;
+  std::vector<YoloV5Head> heads(io.outputNum());
+  const tpuRtNetInfo_t& info = network->getNetInfo();
+  for (int i = 0; i < io.outputNum(); ++i) {
+    outputs[i].resize(getTensorBytes(*io.output(i)));
+    shapes.push_back(&io.output(i)->shape);
+    heads[i].dtype = io.output(i)->dtype;
+    heads[i].scale = info.output.scales[i];
+    heads[i].zero_point = info.output.zero_points[i];
+  }
+  const tpuRtShape_t& input_shape = io.input(0)->shape;
+  int net_h = input_shape.dims[2], net_w = input_shape.dims[3];
+  bool decodable = allHeadsDecodable(shapes, heads, net_w, net_h);
+
+  tpuRtEvent_t events[3];
+  for (auto& event : events) tpuRtEventCreate(&event);
+
+  std::vector<YoloV5BoxVec> boxes(opt.batch);
+  NMSEngine nms;
+  std::unique_ptr<ThreadPool> decode_pool;
+  if (opt.decode_threads > 0) {
+    decode_pool.reset(new ThreadPool(opt.decode_threads));
+  }
+  for (int it = 0; it < opt.warmup + opt.iterations; ++it) {
+    if (it == opt.warmup) gate.arriveAndWait();
+    double us[kStageNum] = {0};
+    tpuRtStatus_t status = tpuRtSuccess;
+    Clock::time_point t0 = Clock::now(), t1, t2, t3;
+
+    if (!opt.async) {
+      for (int i = 0; i < io.inputNum(); ++i) {
+        tpuRtStatus_t ret = tpuRtMemcpyS2D(io.input(i)->data, inputs[i].data(),
+                                           inputs[i].size());
+        if (ret != tpuRtSuccess) status = ret;
+      }
+      t1 = Clock::now();
+      if (status == tpuRtSuccess) status = network->forward(io);
+      t2 = Clock::now();
+      for (int i = 0; i < io.outputNum(); ++i) {
+        tpuRtStatus_t ret = tpuRtMemcpyD2S(outputs[i].data(),
+                                           io.output(i)->data,
+                                           outputs[i].size());
+        if (ret != tpuRtSuccess) status = ret;
+      }
+      t3 = Clock::now();
+    } else {
+      for (int i = 0; i < io.inputNum(); ++i) {
+        tpuRtStatus_t ret = tpuRtMemcpyS2DAsync(
+            io.input(i)->data, inputs[i].data(), inputs[i].size(), stream);
+        if (ret != tpuRtSuccess) status = ret;
+      }
+      tpuRtEventRecord(events[0], stream);
+      if (status == tpuRtSuccess) status = network->forwardAsync(io);
+      tpuRtEventRecord(events[1], stream);
+      for (int i = 0; i < io.outputNum(); ++i) {
+        tpuRtStatus_t ret = tpuRtMemcpyD2SAsync(
+            outputs[i].data(), io.output(i)->data, outputs[i].size(), stream);
+        if (ret != tpuRtSuccess) status = ret;
+      }
+      tpuRtEventRecord(events[2], stream);
+      tpuRtEventSynchronize(events[0]);
+      t1 = Clock::now();
+      tpuRtEventSynchronize(events[1]);
+      t2 = Clock::now();
+      tpuRtEventSynchronize(events[2]);
+      t3 = Clock::now();
+      tpuRtStatus_t ret = tpuRtStreamSynchronize(stream);
+      if (status == tpuRtSuccess) status = ret;
+    }
+    us[kH2D] = usSince(t0, t1);
+    us[kLaunch] = usSince(t1, t2);
+    us[kD2H] = usSince(t2, t3);
+
+    Clock::time_point t4 = t3, t5 = t3;
+    if (decodable && status == tpuRtSuccess) {
+      YoloV5Decoder& decoder = threadDecoder(net_w, net_h);
+      for (int f = 0; f < opt.batch; ++f) {
+        for (int i = 0; i < io.outputNum(); ++i) {
+          heads[i].data = outputs[i].data() + f * outputs[i].size() / opt.batch;
+        }
+        boxes[f].clear();
+        if (decode_pool) {
+          decodeParallel(decoder, heads, shapes, *decode_pool, boxes[f]);
+        } else {
+          decoder.decode(heads, shapes, boxes[f]);
+        }
+      }
+      t4 = Clock::now();
+      for (int f = 0; f < opt.batch; ++f) nms.run(boxes[f]);
+      t5 = Clock::now();
+    }
+    us[kDecode] = usSince(t3, t4);
+    us[kNMS] = usSince(t4, t5);
+    us[kTotal] = usSince(t0, t5);
+
+    if (it < opt.warmup) continue;
+    if (status != tpuRtSuccess) samples.errors++;
+    for (int s = 0; s < kStageNum; ++s) samples.us[s].push_back(us[s]);
+  }
+  for (auto& event : events) tpuRtEventFree(event, stream);
+}
+
+// The frames of runStream through an InferencePipeline: this thread only
+// submits, decode and nms run in the callback on the post process thread
+// while the next frames are uploaded and launched.
+void runPipeline(const BenchOptions& opt,
+                 std::shared_ptr<BMNNContext> context,
+                 BMNNNetworkPool& networks, int stage_idx,
+                 const std::vector<std::vector<char>>& inputs,
+                 StartGate& gate, StageSamples& samples) {
+  BMNNNetworkPool::Lease network = networks.acquire();
+  const tpuRtNetInfo_t& info = network->getNetInfo();
+  const tpuRtStageInfo_t& stage = info.stages[stage_idx];
+
+  std::vector<tensorSizeType> output_bytes;
+  std::vector<const tpuRtShape_t*> shapes;
+  std::vector<YoloV5Head> heads(info.output.num);
+  for (int i = 0; i < info.output.num; ++i) {
+    tpuRtTensor_t tensor = *network->outputTpuRtTensor(i, stage_idx);
+    output_bytes.push_back(getTensorBytes(tensor));
+    shapes.push_back(&stage.output_shapes[i]);
+    heads[i].dtype = info.output.dtypes[i];
+    heads[i].scale = info.output.scales[i];
+    heads[i].zero_point = info.output.zero_points[i];
+  }
+  int net_h = stage.input_shapes[0].dims[2];
+  int net_w = stage.input_shapes[0].dims[3];
+  bool decodable = allHeadsDecodable(shapes, heads, net_w, net_h);
+
+  std::vector<YoloV5BoxVec> boxes(opt.batch);
+  NMSEngine nms;
+  std::unique_ptr<ThreadPool> decode_pool;
+  if (opt.decode_threads > 0) {
+    decode_pool.reset(new ThreadPool(opt.decode_threads));
+  }
+  std::vector<Clock::time_point> submitted(opt.warmup + opt.iterations);
+  auto callback = [&](uint64_t id, tpuRtStatus_t status,
+                      std::vector<std::shared_ptr<BMNNTensor>>& outputs) {
+    std::vector<const char*> data;
+    if (status == tpuRtSuccess) {
+      for (auto& output : outputs) data.push_back(output->get_host_data());
+    }
+    Clock::time_point t3 = Clock::now(), t4 = t3, t5 = t3;
+    if (decodable && status == tpuRtSuccess) {
+      YoloV5Decoder& decoder = threadDecoder(net_w, net_h);
+      for (int f = 0; f < opt.batch; ++f) {
+        for (int i = 0; i < info.output.num; ++i) {
+          heads[i].data = data[i] + f * output_bytes[i] / opt.batch;
+        }
+        boxes[f].clear();
+        if (decode_pool) {
+          decodeParallel(decoder, heads, shapes, *decode_pool, boxes[f]);
+        } else {
+          decoder.decode(heads, shapes, boxes[f]);
+        }
+      }
+      t4 = Clock::now();
+      for (int f = 0; f < opt.batch; ++f) nms.run(boxes[f]);
+      t5 = Clock::now();
+    }
+    if ((int)id < opt.warmup) return;
+    double us[kStageNum] = {0};
+    us[kDecode] = usSince(t3, t4);
+    us[kNMS] = usSince(t4, t5);
+    us[kTotal] = usSince(submitted[id], t5);
+    if (status != tpuRtSuccess) samples.errors++;
+    for (int s = 0; s < kStageNum; ++s) samples.us[s].push_back(us[s]);
+  };
+
+  PipelineConfig config;
+  config.inflight = opt.inflight;
+  config.stage_idx = stage_idx;
+  InferencePipeline pipeline(context, network.get(), callback, config);
+  std::vector<const void*> input_data;
+  for (auto& input : inputs) input_data.push_back(input.data());
+  for (int it = 0; it < opt.warmup + opt.iterations; ++it) {
+    if (it == opt.warmup) {
+      pipeline.flush();
+      gate.arriveAndWait();
+    }
+    submitted[it] = Clock::now();
+    pipeline.submit(input_data);
+  }
+  pipeline.flush();
+}
+
+double percentile(std::vector<double>& sorted, double q) {
+  if (sorted.empty()) return 0;
+  size_t rank = std::min(sorted.size() - 1, (size_t)(q * sorted.size()));
+  return sorted[rank];
+}
+
+std::string report(const BenchOptions& opt, int stage_idx,
+                   const char* decoder, double wall_s,
+                   std::vector<StageSamples>& streams) {
+  unsigned long long batches = 0, errors = 0;
+  for (auto& stream : streams) {
+    batches += stream.us[kTotal].size();
+    errors += stream.errors;
+  }
+  std::ostringstream os;
+  os << std::fixed << std::setprecision(3);
+  os << "{\n";
+  os << "  \"model\": \"" << opt.model << "\",\n";
+  const char* mode = opt.pipeline ? "pipeline" : opt.async ? "async" : "sync";
+  os << "  \"mode\": \"" << mode << "\",\n";
+  if (opt.pipeline) os << "  \"inflight\": " << opt.inflight << ",\n";
+  os << "  \"batch\": " << opt.batch << ",\n";
+  os << "  \"stage_idx\": " << stage_idx << ",\n";
+  os << "  \"streams\": " << opt.streams << ",\n";
+  os << "  \"decoder\": \"" << decoder << "\",\n";
+  os << "  \"decode_threads\": " << opt.decode_threads << ",\n";
+  os << "  \"warmup\": " << opt.warmup << ",\n";
+  os << "  \"iterations\": " << opt.iterations << ",\n";
+  os << "  \"errors\": " << errors << ",\n";
+  os << "  \"wall_s\": " << wall_s << ",\n";
+  double fps = wall_s > 0 ? batches * opt.batch / wall_s : 0;
+  os << "  \"throughput_fps\": " << fps << ",\n";
+  os << "  \"latency_us\": {\n";
+  for (int s = 0; s < kStageNum; ++s) {
+    std::vector<double> all;
+    for (auto& stream : streams) {
+      all.insert(all.end(), stream.us[s].begin(), stream.us[s].end());
+    }
+    std::sort(all.begin(), all.end());
+    double sum = 0;
+    for (double v : all) sum += v;
+    os << "    \"" << kStageNames[s] << "\": {"
+       << "\"mean\": " << (all.empty() ? 0 : sum / all.size())
+       << ", \"p50\": " << percentile(all, 0.5)
+       << ", \"p90\": " << percentile(all, 0.9)
+       << ", \"p99\": " << percentile(all, 0.99)
+       << ", \"max\": " << (all.empty() ? 0 : all.back()) << "}"
+       << (s + 1 < kStageNum ? "," : "") << "\n";
+  }
+  os << "  }\n";
+  os << "}\n";
+  return os.str();
+}
+
+bool sameDetections(const DetectionBatch& a, const DetectionBatch& b) {
+  if (a.size() != b.size()) return false;
+  for (size_t i = 0; i < a.size(); ++i) {
+    Detection x = a[i], y = b[i];
+    if (x.x != y.x || x.y != y.y || x.width != y.width ||
+        x.height != y.height || x.score != y.score ||
+        x.class_id != y.class_id) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// One launch of stage `stage_idx` post processed with postProcessBatch,
+// which finds the stage from the output shapes, against postProcessFrame on
+// each of its frames. Returns whether all frames match.
+bool checkBatchPostProcess(BMNNNetwork& network, int stage_idx,
+                           const std::vector<std::vector<char>>& inputs) {
+  const BMNNIOBinding& io = network.binding(stage_idx);
+  for (int i = 0; i < io.inputNum(); ++i) {
+    if (tpuRtMemcpyS2D(io.input(i)->data, inputs[i].data(),
+                       inputs[i].size()) != tpuRtSuccess) {
+      return false;
+    }
+  }
+  if (network.forward(io) != tpuRtSuccess) return false;
+  std::vector<std::shared_ptr<BMNNTensor>> tensors;
+  std::vector<const char*> buffers;
+  std::vector<const tpuRtShape_t*> shapes;
+  for (int i = 0; i < io.outputNum(); ++i) {
+    tensors.push_back(network.outputTensor(i, stage_idx));
+    tensors.back()->start_host_copy();
+  }
+  for (auto& tensor : tensors) {
+    buffers.push_back(tensor->get_host_data());
+    shapes.push_back(tensor->get_shape());
+  }
+  int batch = shapes[0]->dims[0];
+  const tpuRtShape_t& input_shape = io.input(0)->shape;
+  int net_h = input_shape.dims[2], net_w = input_shape.dims[3];
+  std::vector<FrameGeometry> frames(
+      batch, letterboxGeometry(1920, 1080, net_w, net_h));
+  std::vector<DetectionBatch> results;
+  postProcessBatch(network, buffers.data(), tensors, frames, results);
+
+  std::vector<YoloV5Head> heads(tensors.size());
+  DetectionBatch expected;
+  int distinct = 1;
+  bool same = (int)results.size() == batch;
+  for (int f = 0; same && f < batch; ++f) {
+    for (size_t i = 0; i < tensors.size(); ++i) {
+      tensorSizeType frame_bytes =
+          getTensorBytes(*tensors[i]->getTensor()) / batch;
+      heads[i] = tensorHead(*tensors[i], buffers[i] + f * frame_bytes);
+    }
+    postProcessFrame(heads, shapes, net_w, net_h, frames[f], expected);
+    same = sameDetections(results[f], expected);
+    if (f > 0 && !sameDetections(results[f], results[f - 1])) distinct++;
+  }
+  std::cerr << "postProcessBatch of " << batch << " frames ("
+            << distinct << " distinct) "
+            << (same ? "matches" : "DIFFERS FROM") << " postProcessFrame"
+            << std::endl;
+  return same;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  BenchOptions opt;
+  if (!parseArgs(argc, argv, opt)) {
+    usage(argv[0]);
+    return 1;
+  }
+  tpuRtInit();
+  tpuRtSetDevice(0);
+  auto context = std::make_shared<BMNNContext>(opt.model.c_str());
+  auto networks = context->networkPool(opt.streams);
+  BMNNNetworkPool::Lease probe = networks->acquire();
+  const tpuRtNetInfo_t& info = probe->getNetInfo();
+  int stage_idx = findStage(info, opt.batch);
+  if (stage_idx < 0) {
+    std::cerr << "no stage of batch " << opt.batch << ", compiled batches:";
+    for (int s = 0; s < info.stage_num; ++s) {
+      std::cerr << " " << info.stages[s].input_shapes[0].dims[0];
+    }
+    std::cerr << std::endl;
+    return 1;
+  }
+  const char* decoder = YoloV5Decoder::predecoded(info, stage_idx) ? "rows"
+                        : YoloV5Decoder::specialized(info, stage_idx)
+                            ? "specialized"
+                            : "generic";
+
+  // host inputs of one batch, frames of --input in turn or a fixed pattern
+  std::vector<std::vector<char>> inputs(info.input.num);
+  std::vector<size_t> frame_bytes;
+  for (int i = 0; i < info.input.num; ++i) {
+    tpuRtTensor_t tensor = *probe->inputTpuRtTensor(i, stage_idx);
+    inputs[i].resize(getTensorBytes(tensor));
+    frame_bytes.push_back(inputs[i].size() / opt.batch);
+    for (size_t b = 0; b < inputs[i].size(); ++b) inputs[i][b] = b * 131 % 251;
+  }
+  if (!opt.input.empty()) {
+    DatasetReader dataset(opt.input, frame_bytes);
+    for (int f = 0; dataset.size() > 0 && f < opt.batch; ++f) {
+      DatasetFrame frame = dataset.frame(f % dataset.size());
+      for (int i = 0; i < info.input.num; ++i) {
+        memcpy(inputs[i].data() + f * frame_bytes[i], frame.inputs[i],
+               frame_bytes[i]);
+      }
+    }
+  }
+  if (opt.batch > 1 && !checkBatchPostProcess(*probe, stage_idx, inputs)) {
+    return 1;
+  }
+  probe.release();
+
+  StartGate gate(opt.streams);
+  std::vector<StageSamples> samples(opt.streams);
+  std::vector<std::thread> threads;
+  for (int s = 0; s < opt.streams; ++s) {
+    threads.emplace_back([&, s] {
+      if (opt.pipeline) {
+        runPipeline(opt, context, *networks, stage_idx, inputs, gate,
+                    samples[s]);
+      } else {
+        runStream(opt, *networks, stage_idx, inputs, gate, samples[s]);
+      }
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  double wall_s =
+      std::chrono::duration<double>(Clock::now() - gate.start()).count();
+
+  std::string json = report(opt, stage_idx, decoder, wall_s, samples);
+  if (opt.json.empty()) {
+    std::cout << json;
+  } else {
+    std::ofstream(opt.json) << json;
+  }
+  if (!opt.trace.empty() && !TPUV7_TRACE_EXPORT(opt.trace)) {
+    std::cerr << "no trace written, build with TPUV7_ENABLE_TRACE" << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,197 @@
+#ifndef CASCADE_H_
+#define CASCADE_H_
+
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "tpu_utils.h"
+
+// Input `input` of a cascade net, fed by output `output` of the earlier net
+// `net` of the cascade.
+struct CascadeLink {
+  int input;
+  int net;
+  int output;
+};
+
+/*
+ * Nets launched back to back on one stream, outputs of a net feeding inputs
+ * of the later ones in device memory: a linked input is bound to the device
+ * buffer of the output it comes from, so nothing goes through the host
+ * between two nets. Inputs not linked are the inputs of the cascade, uploaded
+ * from the host; the outputs of the last net are read back. The nets may come
+ * from one bmodel (BMNNContext::networks()) or several on the same device,
+ * and may be shared by several cascades.
+ */
+class BMNNCascade : public NoCopyable {
+ public:
+  explicit BMNNCascade(std::shared_ptr<DeviceMemoryPool> pool)
+      : m_pool(pool) {
+    tpuRtStreamCreate(&m_stream);
+  }
+
+  // Read backs still queued on the stream write into the staging and the
+  // launches into the node buffers, so they are drained first.
+  ~BMNNCascade() {
+    tpuRtStreamSynchronize(m_stream);
+    m_staging.reset();
+    m_nodes.clear();
+    tpuRtStreamDestroy(m_stream);
+  }
+
+  // Append `network` run at stage `stage_idx`, return its index in the
+  // cascade, or -1 when a link does not fit: a linked output must have the
+  // dtype, bytes and quantization of the input it feeds.
+  int add(std::shared_ptr<BMNNNetwork> network,
+          const std::vector<CascadeLink>& links = {}, int stage_idx = 0) {
+    const tpuRtNetInfo_t& info = network->getNetInfo();
+    if (stage_idx < 0 || stage_idx >= info.stage_num) return -1;
+    std::vector<const CascadeLink*> linked(info.input.num, nullptr);
+    for (const CascadeLink& link : links) {
+      if (!linkFits(link, info, stage_idx) || linked[link.input]) {
+        std::cerr << "cascade: input " << link.input << " of "
+                  << info.name << " cannot take output " << link.output
+                  << " of net " << link.net << std::endl;
+        return -1;
+      }
+      linked[link.input] = &link;
+    }
+
+    Node node;
+    node.network = network;
+    std::vector<void*> input_data, output_data;
+    for (int i = 0; i < info.input.num; ++i) {
+      if (linked[i]) {
+        const BMNNIOBinding& from = *m_nodes[linked[i]->net].binding;
+        input_data.push_back(from.output(linked[i]->output)->data);
+        continue;
+      }
+      tpuRtTensor_t tensor;
+      tensor.dtype = info.input.dtypes[i];
+      tensor.shape = info.stages[stage_idx].input_shapes[i];
+      node.buffers.push_back(m_pool->acquire(getTensorBytes(tensor)));
+      ASSERT(node.buffers.back());
+      input_data.push_back(node.buffers.back().data());
+      m_inputs.push_back(std::make_pair((int)m_nodes.size(), i));
+    }
+    for (int i = 0; i < info.output.num; ++i) {
+      tpuRtTensor_t tensor;
+      tensor.dtype = info.output.dtypes[i];
+      tensor.shape = info.stages[stage_idx].output_shapes[i];
+      node.buffers.push_back(m_pool->acquire(getTensorBytes(tensor)));
+      ASSERT(node.buffers.back());
+      output_data.push_back(node.buffers.back().data());
+    }
+    node.binding.reset(new BMNNIOBinding(
+        network->createBinding(input_data, output_data, stage_idx)));
+    m_nodes.push_back(std::move(node));
+    // the outputs of the former last net may still be read back
+    tpuRtStreamSynchronize(m_stream);
+    m_staging.reset();
+    return m_nodes.size() - 1;
+  }
+
+  int size() const { return m_nodes.size(); }
+
+  const BMNNIOBinding& binding(int net) const { return *m_nodes[net].binding; }
+
+  // Inputs not linked to an output, in the order of the nets then of their
+  // inputs.
+  int inputNum() const { return m_inputs.size(); }
+  const tpuRtTensor_t& input(int index) const {
+    return *binding(m_inputs[index].first).input(m_inputs[index].second);
+  }
+
+  // Queue every net on the stream of the cascade, inputs already in device
+  // memory.
+  tpuRtStatus_t launch() {
+    TPUV7_TRACE_SCOPE("cascade");
+    for (auto& node : m_nodes) {
+      tpuRtStatus_t ret = node.network->forwardAsync(*node.binding, m_stream);
+      if (ret != tpuRtSuccess) return ret;
+    }
+    return tpuRtSuccess;
+  }
+
+  // Upload one host buffer per cascade input, launch every net and queue the
+  // read back of the outputs of the last net into `outputs`. get_host_data()
+  // on an output waits for that output only; host data stays valid until the
+  // next forward(), which first waits for the previous one to drain.
+  tpuRtStatus_t forward(const std::vector<const void*>& hostInputs,
+                        std::vector<std::shared_ptr<BMNNTensor>>& outputs) {
+    if (m_nodes.empty() || (int)hostInputs.size() != inputNum()) {
+      return tpuRtErrParam;
+    }
+    // the uploads do not queue behind the launches of the previous forward,
+    // which may not have read the inputs yet
+    tpuRtStatus_t ret = tpuRtStreamSynchronize(m_stream);
+    if (ret != tpuRtSuccess) return ret;
+    for (int i = 0; i < inputNum(); ++i) {
+      TPUV7_TRACE_SCOPE("tpuRtMemcpyS2D");
+      ret = tpuRtMemcpyS2D(input(i).data, hostInputs[i],
+                           getTensorBytes(input(i)));
+      if (ret != tpuRtSuccess) return ret;
+    }
+    ret = launch();
+    if (ret != tpuRtSuccess) return ret;
+
+    const Node& last = m_nodes.back();
+    const tpuRtNetInfo_t& info = last.network->getNetInfo();
+    if (!m_staging) {
+      std::vector<tensorSizeType> sizes;
+      for (int i = 0; i < info.output.num; ++i) {
+        sizes.push_back(getTensorBytes(*last.binding->output(i)));
+      }
+      m_staging.reset(new HostStagingArena(sizes, m_stream));
+    }
+    outputs.clear();
+    for (int i = 0; i < info.output.num; ++i) {
+      outputs.push_back(std::make_shared<BMNNTensor>(
+          info.output.names[i], info.output.scales[i], last.binding->output(i),
+          &m_stream, m_staging->slot(i), info.output.zero_points[i]));
+      outputs.back()->start_host_copy();
+    }
+    return tpuRtSuccess;
+  }
+
+  tpuRtStream_t stream() const { return m_stream; }
+
+ private:
+  struct Node {
+    std::shared_ptr<BMNNNetwork> network;
+    std::unique_ptr<BMNNIOBinding> binding;
+    std::vector<DeviceBuffer> buffers;
+  };
+
+  bool linkFits(const CascadeLink& link, const tpuRtNetInfo_t& info,
+                int stage_idx) const {
+    if (link.net < 0 || link.net >= (int)m_nodes.size()) return false;
+    if (link.input < 0 || link.input >= info.input.num) return false;
+    const tpuRtNetInfo_t& from = m_nodes[link.net].network->getNetInfo();
+    if (link.output < 0 || link.output >= from.output.num) return false;
+    const tpuRtTensor_t& src = *m_nodes[link.net].binding->output(link.output);
+    tpuRtTensor_t dst;
+    dst.dtype = info.input.dtypes[link.input];
+    dst.shape = info.stages[stage_idx].input_shapes[link.input];
+    if (src.dtype != dst.dtype || getTensorBytes(src) != getTensorBytes(dst)) {
+      return false;
+    }
+    // float tensors carry no scale
+    bool quantized = dst.dtype != TPU_FLOAT32 && dst.dtype != TPU_FLOAT16 &&
+                     dst.dtype != TPU_BFLOAT16;
+    return !quantized ||
+           (from.output.scales[link.output] == info.input.scales[link.input] &&
+            from.output.zero_points[link.output] ==
+                info.input.zero_points[link.input]);
+  }
+
+  std::shared_ptr<DeviceMemoryPool> m_pool;
+  tpuRtStream_t m_stream;
+  std::vector<Node> m_nodes;
+  // (net, input) of every cascade input
+  std::vector<std::pair<int, int>> m_inputs;
+  std::unique_ptr<HostStagingArena> m_staging;
+};
+
+#endif
@@ -0,0 +1,195 @@
+// BMNNCascade on a two-net bmodel, backbone feeding head in device memory,
+// against the same two nets with the backbone outputs read back to the host
+// and uploaded again.
+//
+//   tpuv7_cascade_bench [cascade.bmodel] [iterations]
+//
+// The bmodel needs a net "backbone" whose outputs match the inputs of a net
+// "head". Without one, the description below is written to a temporary file
+// and loaded by the stand-in runtime. Before timing, a link that does not
+// fit must be refused, the head inputs must alias the backbone outputs, two
+// forward() calls must run back to back, and a cascade must be extended and
+// destroyed with read backs still queued.
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "cascade.h"
+
+namespace {
+
+const char* kStubCascade =
+    "# tpuv7-stub\n"
+    "net backbone\n"
+    "stages 1\n"
+    "input images i8 3 640 640 scale 0.0078125\n"
+    "output feat i8 256 20 20 scale 0.05\n"
+    "output feat2 f16 128 40 40\n"
+    "net head\n"
+    "stages 1\n"
+    "input feat i8 256 20 20 scale 0.05\n"
+    "input feat2 f16 128 40 40\n"
+    "output output0 f32 3 80 80 85\n"
+    "output output1 f32 3 40 40 85\n"
+    "output output2 f32 3 20 20 85\n";
+
+double usSince(std::chrono::steady_clock::time_point begin) {
+  return std::chrono::duration<double, std::micro>(
+             std::chrono::steady_clock::now() - begin)
+      .count();
+}
+
+std::vector<std::vector<char>> makeInputs(const BMNNNetwork& network) {
+  const tpuRtNetInfo_t& info = network.getNetInfo();
+  std::vector<std::vector<char>> inputs;
+  for (int i = 0; i < info.input.num; ++i) {
+    tpuRtTensor_t tensor;
+    tensor.dtype = info.input.dtypes[i];
+    tensor.shape = info.stages[0].input_shapes[i];
+    inputs.emplace_back(getTensorBytes(tensor), 1);
+  }
+  return inputs;
+}
+
+// Link every head input to the backbone output of the same name.
+std::vector<CascadeLink> nameLinks(const BMNNNetwork& backbone,
+                                   const BMNNNetwork& head) {
+  const tpuRtNetInfo_t& from = backbone.getNetInfo();
+  const tpuRtNetInfo_t& to = head.getNetInfo();
+  std::vector<CascadeLink> links;
+  for (int i = 0; i < to.input.num; ++i) {
+    for (int o = 0; o < from.output.num; ++o) {
+      if (std::string(to.input.names[i]) == from.output.names[o]) {
+        links.push_back({i, 0, o});
+      }
+    }
+  }
+  return links;
+}
+
+bool check(bool ok, const char* what) {
+  std::cout << what << ": " << (ok ? "ok" : "FAILED") << std::endl;
+  return ok;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::string path = argc > 1 ? argv[1] : "";
+  int iterations = argc > 2 ? atoi(argv[2]) : 50;
+  bool temporary = path.empty();
+  if (temporary) {
+    char name[] = "/tmp/tpuv7_cascade_XXXXXX";
+    int fd = mkstemp(name);
+    if (fd < 0) return 1;
+    close(fd);
+    path = name;
+    std::ofstream(path) << kStubCascade;
+  }
+  tpuRtInit();
+  tpuRtSetDevice(0);
+  auto context = std::make_shared<BMNNContext>(path.c_str());
+  if (temporary) unlink(path.c_str());
+  if (!context->loaded()) return 1;
+  int backbone_idx = context->networkIndex("backbone");
+  int head_idx = context->networkIndex("head");
+  if (backbone_idx < 0 || head_idx < 0) {
+    std::cerr << "no backbone and head nets in " << path << std::endl;
+    return 1;
+  }
+  auto backbone = context->networkAt(backbone_idx);
+  auto head = context->networkAt(head_idx);
+  std::vector<CascadeLink> links = nameLinks(*backbone, *head);
+  std::vector<std::vector<char>> images = makeInputs(*backbone);
+  std::vector<const void*> image_data;
+  for (auto& image : images) image_data.push_back(image.data());
+
+  bool ok = true;
+  std::vector<std::shared_ptr<BMNNTensor>> outputs;
+  {
+    // extended and destroyed while read backs are queued
+    BMNNCascade cascade(context->memoryPool());
+    cascade.add(backbone);
+    ok &= check(cascade.forward(image_data, outputs) == tpuRtSuccess,
+                "backbone forward");
+    ok &= check(cascade.add(head, links) == 1, "add head after forward");
+    ok &= check(cascade.forward(image_data, outputs) == tpuRtSuccess,
+                "cascade forward");
+  }
+  outputs.clear();
+
+  BMNNCascade cascade(context->memoryPool());
+  cascade.add(backbone);
+  std::vector<CascadeLink> bad = links;
+  bad.front().output = (bad.front().output + 1) % backbone->outputTensorNum();
+  ok &= check(cascade.add(head, bad) < 0, "mismatched link refused");
+  ok &= check(cascade.add(head, {{0, 1, 0}}) < 0,
+              "link to a later net refused");
+  ok &= check(cascade.add(head, links) == 1, "links accepted");
+  bool alias = cascade.inputNum() == backbone->inputTensorNum();
+  for (const CascadeLink& link : links) {
+    alias = alias && cascade.binding(1).input(link.input)->data ==
+                         cascade.binding(0).output(link.output)->data;
+  }
+  ok &= check(alias, "head inputs alias backbone outputs");
+
+  // back to back, the second upload waits for the first launches
+  std::vector<std::vector<char>> others = makeInputs(*backbone);
+  std::vector<const void*> other_data;
+  for (auto& other : others) {
+    std::fill(other.begin(), other.end(), 2);
+    other_data.push_back(other.data());
+  }
+  bool back_to_back = cascade.forward(image_data, outputs) == tpuRtSuccess &&
+                      cascade.forward(other_data, outputs) == tpuRtSuccess;
+  for (auto& output : outputs) output->get_host_data();
+  for (int i = 0; i < cascade.inputNum() && back_to_back; ++i) {
+    std::vector<char> uploaded(others[i].size());
+    tpuRtMemcpyD2S(uploaded.data(), cascade.input(i).data, uploaded.size());
+    back_to_back = uploaded == others[i];
+  }
+  ok &= check(back_to_back, "forward back to back");
+  if (!ok) return 1;
+
+  auto begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    if (cascade.forward(image_data, outputs) != tpuRtSuccess) return 1;
+    for (auto& output : outputs) output->get_host_data();
+  }
+  double cascade_us = usSince(begin) / iterations;
+
+  const tpuRtNetInfo_t& backbone_info = backbone->getNetInfo();
+  const tpuRtNetInfo_t& head_info = head->getNetInfo();
+  std::vector<tpuRtShape_t> backbone_shapes(
+      backbone_info.stages[0].input_shapes,
+      backbone_info.stages[0].input_shapes + backbone_info.input.num);
+  std::vector<tpuRtShape_t> head_shapes(
+      head_info.stages[0].input_shapes,
+      head_info.stages[0].input_shapes + head_info.input.num);
+  begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    if (backbone->forward(image_data, backbone_shapes) != tpuRtSuccess) {
+      return 1;
+    }
+    auto features = backbone->startOutputCopies();
+    std::vector<const void*> feature_data(head_info.input.num);
+    for (const CascadeLink& link : links) {
+      feature_data[link.input] = features[link.output]->get_host_data();
+    }
+    if (head->forward(feature_data, head_shapes) != tpuRtSuccess) return 1;
+    for (auto& output : head->startOutputCopies()) output->get_host_data();
+  }
+  double round_trip_us = usSince(begin) / iterations;
+
+  std::cout << "cascade " << cascade_us << " us, host round trip "
+            << round_trip_us << " us, speedup " << round_trip_us / cascade_us
+            << "x" << std::endl;
+  return 0;
+}
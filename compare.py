@@ -6,6 +6,7 @@ import math
 
 bmrt_filename = "./output_ref_data.dat.bmrt"
 tpurt_filename = "./output.tpuRt"
+tolerance = 1e-3
 
 bmrt_array = np.fromfile(bmrt_filename, dtype=np.float32)
 tpurt_array = np.fromfile(tpurt_filename, dtype=np.float32)
@@ -15,4 +16,15 @@ diff = abs(bmrt_array - tpurt_array)
 sum = diff.sum()
 
 print(sum)
-print(sum/len(bmrt_array))
\ No newline at end of file
+print(sum/len(bmrt_array))
+
+# same metrics as TensorComparator in tensor_compare.h
+a = bmrt_array.astype(np.float64)
+b = tpurt_array.astype(np.float64)
+max_index = int(diff.argmax())
+rmse = math.sqrt(((a - b) ** 2).mean())
+norm = np.linalg.norm(a) * np.linalg.norm(b)
+cosine = (a * b).sum() / norm if norm > 0 else 1.0
+over = int((diff > tolerance).sum())
+print("max %g @%d rmse %g cosine %g over_tol %d/%d" %
+      (diff[max_index], max_index, rmse, cosine, over, len(bmrt_array)))
@@ -0,0 +1,244 @@
+#ifndef DATASET_READER_H_
+#define DATASET_READER_H_
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+ * Read only mmap of a whole file, unmapped on destruction.
+ */
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string& path) : m_path(path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      std::cerr << "cannot open " << path << std::endl;
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        m_data = static_cast<const char*>(data);
+        m_size = st.st_size;
+        madvise(data, m_size, MADV_SEQUENTIAL);
+      } else {
+        std::cerr << "cannot mmap " << path << std::endl;
+      }
+    }
+    close(fd);
+  }
+
+  ~MappedFile() {
+    if (m_data) munmap(const_cast<char*>(m_data), m_size);
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* data() const { return m_data; }
+  size_t size() const { return m_size; }
+  const std::string& path() const { return m_path; }
+  explicit operator bool() const { return m_data != nullptr; }
+
+  // Ask the kernel to start reading [offset, offset + bytes) in.
+  void prefetch(size_t offset, size_t bytes) const {
+    advise(offset, bytes, MADV_WILLNEED);
+  }
+
+  // Drop the pages of [offset, offset + bytes) from this mapping, they are
+  // read back from the file if touched again.
+  void evict(size_t offset, size_t bytes) const {
+    advise(offset, bytes, MADV_DONTNEED);
+  }
+
+ private:
+  void advise(size_t offset, size_t bytes, int advice) const {
+    if (!m_data || offset >= m_size) return;
+    static const size_t page = sysconf(_SC_PAGESIZE);
+    size_t begin = offset / page * page;
+    size_t end = std::min(offset + bytes, m_size);
+    madvise(const_cast<char*>(m_data) + begin, end - begin, advice);
+  }
+
+  std::string m_path;
+  const char* m_data = nullptr;
+  size_t m_size = 0;
+};
+
+/*
+ * One frame of a dataset. Every pointer points into the mapped files, one per
+ * network input and one per golden output (none without a golden set).
+ */
+struct DatasetFrame {
+  int index = -1;
+  std::vector<const char*> inputs;
+  std::vector<const char*> outputs;
+};
+
+/*
+ * Zero-copy reader of input / golden output frames. A source is either
+ *
+ *   - a packed file, frames stored back to back and every frame holding all
+ *     tensors back to back, i.e. the input_int81b / output_int81b layout
+ *     repeated N times, or
+ *   - a directory, each regular file (in name order) holding one frame in
+ *     that layout.
+ *
+ * Frame views stay valid as long as the reader; they can be passed straight
+ * to tpuRtMemcpyS2D. frame(i) prefetches the next `prefetch` frames and, for
+ * packed files, evicts the frames behind the window so a large set does not
+ * stay resident.
+ */
+class DatasetReader {
+ public:
+  DatasetReader(const std::string& input_path,
+                const std::vector<size_t>& input_bytes,
+                const std::string& output_path = std::string(),
+                const std::vector<size_t>& output_bytes = std::vector<size_t>(),
+                int prefetch = 4)
+      : m_prefetch(prefetch) {
+    m_input.tensor_bytes = input_bytes;
+    m_output.tensor_bytes = output_bytes;
+    openSource(m_input, input_path);
+    m_frame_num = m_input.frames;
+    if (!output_path.empty()) {
+      openSource(m_output, output_path);
+      if (m_output.frames != m_input.frames) {
+        std::cerr << input_path << " has " << m_input.frames << " frames but "
+                  << output_path << " has " << m_output.frames << std::endl;
+        m_frame_num = std::min(m_input.frames, m_output.frames);
+      }
+    }
+  }
+
+  DatasetReader(const DatasetReader&) = delete;
+  DatasetReader& operator=(const DatasetReader&) = delete;
+
+  int size() const { return m_frame_num; }
+  bool hasGolden() const { return !m_output.files.empty(); }
+
+  DatasetFrame frame(int index) {
+    DatasetFrame ret;
+    if (index < 0 || index >= m_frame_num) return ret;
+    ret.index = index;
+    view(m_input, index, ret.inputs);
+    if (hasGolden()) view(m_output, index, ret.outputs);
+
+    for (int i = index + 1; i <= index + m_prefetch && i < m_frame_num; ++i) {
+      if (i <= m_prefetched) continue;
+      prefetch(m_input, i);
+      if (hasGolden()) prefetch(m_output, i);
+      m_prefetched = i;
+    }
+    int behind = index - m_prefetch - 1;
+    if (behind >= 0) {
+      evict(m_input, behind);
+      if (hasGolden()) evict(m_output, behind);
+    }
+    return ret;
+  }
+
+ private:
+  struct Source {
+    std::vector<size_t> tensor_bytes;
+    size_t frame_bytes = 0;
+    bool packed = true;
+    std::vector<std::string> paths;  // one per file
+    std::vector<std::unique_ptr<MappedFile>> files;  // mapped on first use
+    int frames = 0;
+  };
+
+  void openSource(Source& source, const std::string& path) {
+    for (size_t bytes : source.tensor_bytes) source.frame_bytes += bytes;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+      std::cerr << "cannot open " << path << std::endl;
+      return;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      source.packed = false;
+      DIR* dir = opendir(path.c_str());
+      if (!dir) return;
+      while (struct dirent* entry = readdir(dir)) {
+        std::string file = path + "/" + entry->d_name;
+        struct stat fst;
+        if (stat(file.c_str(), &fst) == 0 && S_ISREG(fst.st_mode)) {
+          source.paths.push_back(file);
+        }
+      }
+      closedir(dir);
+      std::sort(source.paths.begin(), source.paths.end());
+      source.files.resize(source.paths.size());
+      source.frames = source.paths.size();
+    } else {
+      source.paths.push_back(path);
+      source.files.emplace_back(new MappedFile(path));
+      const MappedFile& file = *source.files[0];
+      if (!file || !source.frame_bytes) return;
+      source.frames = file.size() / source.frame_bytes;
+      if (file.size() % source.frame_bytes) {
+        std::cerr << path << " is not a multiple of " << source.frame_bytes
+                  << " bytes, the trailing partial frame is ignored"
+                  << std::endl;
+      }
+    }
+  }
+
+  // File holding frame `index` and the offset of the frame in it.
+  const MappedFile* locate(Source& source, int index, size_t* offset) {
+    if (source.packed) {
+      *offset = (size_t)index * source.frame_bytes;
+      return source.files[0].get();
+    }
+    *offset = 0;
+    auto& file = source.files[index];
+    if (!file) file.reset(new MappedFile(source.paths[index]));
+    return file.get();
+  }
+
+  void view(Source& source, int index, std::vector<const char*>& tensors) {
+    size_t offset;
+    const MappedFile* file = locate(source, index, &offset);
+    if (!file->data() || offset + source.frame_bytes > file->size()) {
+      std::cerr << file->path() << " is too small for frame " << index
+                << std::endl;
+      tensors.assign(source.tensor_bytes.size(), nullptr);
+      return;
+    }
+    for (size_t bytes : source.tensor_bytes) {
+      tensors.push_back(file->data() + offset);
+      offset += bytes;
+    }
+  }
+
+  void prefetch(Source& source, int index) {
+    size_t offset;
+    const MappedFile* file = locate(source, index, &offset);
+    file->prefetch(offset, source.frame_bytes);
+  }
+
+  void evict(Source& source, int index) {
+    // per-frame files are small and left to the page cache
+    if (!source.packed) return;
+    source.files[0]->evict((size_t)index * source.frame_bytes,
+                           source.frame_bytes);
+  }
+
+  int m_prefetch;
+  int m_frame_num = 0;
+  int m_prefetched = -1;
+  Source m_input;
+  Source m_output;
+};
+
+#endif
@@ -0,0 +1,332 @@
+#include <stdint.h>
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "yolov5_decoder.h"
+
+/*
+ * Microbenchmark of YoloV5Decoder against the decode loop it replaced in
+ * postProcessCPU. Both run on the same synthetic heads and must produce the
+ * same boxes in the same order. The heads are then stored as fp16, bf16,
+ * int8 and uint8, and decoding them natively must give the boxes of decoding
+ * their dequantized fp32 values. Every dtype is timed on the generic decoder
+ * and on the YoloV5Coco80 instantiation, which must agree. Last, a
+ * pre-decoded [1, 25200, 85] output is decoded in every dtype and checked
+ * against a plain loop over its rows.
+ */
+
+static void legacyDecode(const std::vector<const float*>& heads,
+                         const std::vector<const tpuRtShape_t*>& shapes,
+                         bool agnostic, YoloV5BoxVec& yolobox_vec) {
+  const std::vector<std::vector<std::vector<int>>> anchors{
+      {{10, 13}, {16, 30}, {33, 23}},
+      {{30, 61}, {62, 45}, {59, 119}},
+      {{116, 90}, {156, 198}, {373, 326}}};
+  const int anchor_num = anchors[0].size();
+  int nout = shapes[0]->dims[4];
+  int max_wh = 7680;
+  int out_nout = 7;
+  int box_num = 0;
+  for (auto shape : shapes) box_num += shape->dims[1] * shape->dims[2] * shape->dims[3];
+  std::vector<float> decoded_data(box_num * out_nout);
+  float* dst = decoded_data.data();
+
+  for (int tidx = 0; tidx < 3; ++tidx) {
+    int feat_h = shapes[tidx]->dims[2];
+    int feat_w = shapes[tidx]->dims[3];
+    int area = feat_h * feat_w;
+    int feature_size = feat_h * feat_w * nout;
+    const float* tensor_data = heads[tidx];
+
+    for (int anchor_idx = 0; anchor_idx < anchor_num; anchor_idx++) {
+      const float* ptr = tensor_data + anchor_idx * feature_size;
+      for (int i = 0; i < area; i++) {
+        if (ptr[4] > 0.5) {
+          dst[0] = (sigmoid(ptr[0]) * 2 - 0.5 + i % feat_w) / feat_w * 640;
+          dst[1] = (sigmoid(ptr[1]) * 2 - 0.5 + i / feat_w) / feat_h * 640;
+          dst[2] = std::pow((sigmoid(ptr[2]) * 2), 2) *
+                   anchors[tidx][anchor_idx][0];
+          dst[3] = std::pow((sigmoid(ptr[3]) * 2), 2) *
+                   anchors[tidx][anchor_idx][1];
+          dst[4] = sigmoid(ptr[4]);
+
+          dst[5] = ptr[5];
+          dst[6] = 5;
+          for (int d = 6; d < nout; d++) {
+            if (ptr[d] > dst[5]) {
+              dst[5] = ptr[d];
+              dst[6] = d;
+            }
+          }
+          dst[6] -= 5;
+          float score = dst[4];
+
+          int class_id = dst[6];
+          float confidence = dst[5];
+          float cur_class_thresh = 0.5;
+          float box_transformed_m_conf_threshold =
+              -std::log(score / cur_class_thresh - 1);
+          if (confidence > box_transformed_m_conf_threshold) {
+            float centerX = dst[0];
+            float centerY = dst[1];
+            float width = dst[2];
+            float height = dst[3];
+
+            YoloV5Box box;
+            if (!agnostic)
+              box.x = centerX - width / 2 + class_id * max_wh;
+            else
+              box.x = centerX - width / 2;
+            if (box.x < 0) box.x = 0;
+            if (!agnostic)
+              box.y = centerY - height / 2 + class_id * max_wh;
+            else
+              box.y = centerY - height / 2;
+            if (box.y < 0) box.y = 0;
+            box.width = width;
+            box.height = height;
+            box.class_id = class_id;
+            confidence = sigmoid(confidence);
+            box.score = confidence * score;
+            yolobox_vec.push_back(box);
+          }
+        }
+        dst += out_nout;
+        ptr += nout;
+      }
+    }
+  }
+}
+
+// The row loop of a single output yolov5 export, on dequantized values.
+static void legacyDecodeRows(const float* data, int rows, int nout,
+                             YoloV5BoxVec& yolobox_vec) {
+  const float obj_thresh = sigmoid(0.5f);
+  const float conf_thresh = 0.5f;
+  for (int i = 0; i < rows; ++i) {
+    const float* ptr = data + (long)i * nout;
+    if (!(ptr[4] > obj_thresh) || !(ptr[4] > conf_thresh)) continue;
+    int class_id = 0;
+    for (int d = 1; d < nout - 5; ++d) {
+      if (ptr[5 + d] > ptr[5 + class_id]) class_id = d;
+    }
+    float score = ptr[4] * ptr[5 + class_id];
+    if (!(score > conf_thresh)) continue;
+    YoloV5Box box;
+    box.x = ptr[0] - ptr[2] / 2;
+    if (box.x < 0) box.x = 0;
+    box.y = ptr[1] - ptr[3] / 2;
+    if (box.y < 0) box.y = 0;
+    box.width = ptr[2];
+    box.height = ptr[3];
+    box.class_id = class_id;
+    box.score = score;
+    yolobox_vec.push_back(box);
+  }
+}
+
+static bool sameBoxes(const YoloV5BoxVec& a, const YoloV5BoxVec& b) {
+  if (a.size() != b.size()) return false;
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (a[i].x != b[i].x || a[i].y != b[i].y || a[i].width != b[i].width ||
+        a[i].height != b[i].height || a[i].score != b[i].score ||
+        a[i].class_id != b[i].class_id)
+      return false;
+  }
+  return true;
+}
+
+template <class F>
+static double timeUs(int iters, F&& f) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iters; ++i) f();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::micro>(end - start).count() /
+         iters;
+}
+
+int main(int argc, char** argv) {
+  int iters = argc > 1 ? atoi(argv[1]) : 200;
+  int class_num = 80;
+  const int feats[3] = {80, 40, 20};
+
+  // logits quantized to 1/16 like an int8 model, so threshold ties happen
+  std::mt19937 rng(1234);
+  std::normal_distribution<float> dist(-4.0f, 2.0f);
+  std::vector<std::vector<float>> data(3);
+  std::vector<tpuRtShape_t> shape_storage(3);
+  std::vector<const float*> heads;
+  std::vector<const tpuRtShape_t*> shapes;
+  for (int h = 0; h < 3; ++h) {
+    tpuRtShape_t& shape = shape_storage[h];
+    shape.num_dims = 5;
+    shape.dims[0] = 1;
+    shape.dims[1] = 3;
+    shape.dims[2] = feats[h];
+    shape.dims[3] = feats[h];
+    shape.dims[4] = 5 + class_num;
+    data[h].resize(3 * feats[h] * feats[h] * (5 + class_num));
+    for (auto& v : data[h]) v = std::round(dist(rng) * 16) / 16;
+    heads.push_back(data[h].data());
+    shapes.push_back(&shape);
+  }
+
+  // NMSEngine buckets by class, so the decoder no longer applies the
+  // class_id * max_wh offset the old loop used when not agnostic
+  YoloV5Decoder decoder;
+  YoloV5DecodeParams generic_params;
+  generic_params.specialize = false;
+  YoloV5Decoder generic(generic_params);
+  YoloV5BoxVec ref, out;
+  legacyDecode(heads, shapes, true, ref);
+  generic.decode(heads, shapes, out);
+  bool ok = sameBoxes(ref, out);
+
+  double legacy_us = timeUs(iters, [&] {
+    ref.clear();
+    legacyDecode(heads, shapes, true, ref);
+  });
+  double decoder_us = timeUs(iters, [&] {
+    out.clear();
+    generic.decode(heads, shapes, out);
+  });
+  std::cout << "boxes=" << out.size() << " identical=" << (ok ? "yes" : "NO")
+            << " legacy=" << legacy_us << "us decoder=" << decoder_us
+            << "us speedup=" << legacy_us / decoder_us << "x" << std::endl;
+
+  const tpuRtDataType_t dtypes[] = {TPU_FLOAT32, TPU_FLOAT16, TPU_BFLOAT16,
+                                    TPU_INT8, TPU_UINT8};
+  const char* names[] = {"fp32", "fp16", "bf16", "int8", "uint8"};
+  for (int t = 0; t < 5; ++t) {
+    std::vector<std::vector<char>> raw(3);
+    std::vector<std::vector<float>> real(3);
+    std::vector<YoloV5Head> native(3);
+    std::vector<const float*> dequantized;
+    for (int h = 0; h < 3; ++h) {
+      YoloV5Head& head = native[h];
+      head.dtype = dtypes[t];
+      head.scale = 1.f / 16;
+      head.zero_point = dtypes[t] == TPU_UINT8 ? 128 : 0;
+      size_t count = data[h].size();
+      raw[h].resize(count * 4);
+      real[h].resize(count);
+      for (size_t i = 0; i < count; ++i) {
+        float v = data[h][i];
+        if (dtypes[t] == TPU_FLOAT32) {
+          reinterpret_cast<float*>(raw[h].data())[i] = v;
+          real[h][i] = v;
+        } else if (dtypes[t] == TPU_FLOAT16) {
+          uint16_t q = floatToHalf(v);
+          reinterpret_cast<uint16_t*>(raw[h].data())[i] = q;
+          real[h][i] = halfToFloat(q);
+        } else if (dtypes[t] == TPU_BFLOAT16) {
+          uint16_t q = floatToBf16(v);
+          reinterpret_cast<uint16_t*>(raw[h].data())[i] = q;
+          real[h][i] = bf16ToFloat(q);
+        } else {
+          int lo = dtypes[t] == TPU_INT8 ? -128 : 0;
+          int q = std::min(std::max((int)std::lround(v / head.scale) +
+                                        head.zero_point, lo), lo + 255);
+          raw[h][i] = (char)q;
+          real[h][i] = (q - head.zero_point) * head.scale;
+        }
+      }
+      head.data = raw[h].data();
+      dequantized.push_back(real[h].data());
+    }
+    YoloV5BoxVec expect, got, fixed;
+    generic.decode(dequantized, shapes, expect);
+    generic.decode(native, shapes, got);
+    decoder.decode(native, shapes, fixed);
+    bool same = sameBoxes(expect, got) && sameBoxes(expect, fixed);
+    ok = ok && same;
+    double native_us = timeUs(iters, [&] {
+      got.clear();
+      generic.decode(native, shapes, got);
+    });
+    double fixed_us = timeUs(iters, [&] {
+      fixed.clear();
+      decoder.decode(native, shapes, fixed);
+    });
+    std::cout << names[t] << " boxes=" << got.size()
+              << " identical=" << (same ? "yes" : "NO")
+              << " generic=" << native_us << "us specialized=" << fixed_us
+              << "us" << std::endl;
+  }
+
+  // pre-decoded rows: pixel boxes, then probabilities on a 1/128 grid so
+  // int8 stores them exactly, with every 50th row a confident detection
+  const int rows = 25200, nout = 5 + class_num;
+  std::uniform_real_distribution<float> coord(0.f, 640.f);
+  std::uniform_real_distribution<float> prob(0.f, 0.6f);
+  std::vector<float> row_data((size_t)rows * nout);
+  for (int i = 0; i < rows; ++i) {
+    float* ptr = row_data.data() + (size_t)i * nout;
+    for (int d = 0; d < 4; ++d) ptr[d] = std::round(coord(rng) / 4) * 4;
+    for (int d = 4; d < nout; ++d) ptr[d] = std::round(prob(rng) * 128) / 128;
+    if (i % 50 == 0) {
+      ptr[4] = 0.875f;
+      ptr[5 + i % class_num] = 0.75f;
+    }
+  }
+  tpuRtShape_t row_shape;
+  row_shape.num_dims = 3;
+  row_shape.dims[0] = 1;
+  row_shape.dims[1] = rows;
+  row_shape.dims[2] = nout;
+  std::vector<const tpuRtShape_t*> row_shapes{&row_shape};
+  for (int t = 0; t < 5; ++t) {
+    // one scale for the whole output, the integer types saturate the boxes
+    bool integer = dtypes[t] == TPU_INT8 || dtypes[t] == TPU_UINT8;
+    std::vector<char> raw(row_data.size() * 4);
+    std::vector<float> real(row_data.size());
+    YoloV5Head head;
+    head.data = raw.data();
+    head.dtype = dtypes[t];
+    head.scale = integer ? 1.f / 128 : 1.f;
+    head.zero_point = dtypes[t] == TPU_UINT8 ? 128 : 0;
+    for (size_t i = 0; i < row_data.size(); ++i) {
+      float v = row_data[i];
+      if (dtypes[t] == TPU_FLOAT32) {
+        reinterpret_cast<float*>(raw.data())[i] = v;
+        real[i] = v;
+      } else if (dtypes[t] == TPU_FLOAT16) {
+        uint16_t q = floatToHalf(v);
+        reinterpret_cast<uint16_t*>(raw.data())[i] = q;
+        real[i] = halfToFloat(q);
+      } else if (dtypes[t] == TPU_BFLOAT16) {
+        uint16_t q = floatToBf16(v);
+        reinterpret_cast<uint16_t*>(raw.data())[i] = q;
+        real[i] = bf16ToFloat(q);
+      } else {
+        int lo = dtypes[t] == TPU_INT8 ? -128 : 0;
+        int q = std::min(std::max((int)std::lround(v / head.scale) +
+                                      head.zero_point, lo), lo + 255);
+        raw[i] = (char)q;
+        real[i] = (q - head.zero_point) * head.scale;
+      }
+    }
+    std::vector<YoloV5Head> row_heads{head};
+    YoloV5BoxVec expect, got;
+    legacyDecodeRows(real.data(), rows, nout, expect);
+    decoder.decode(row_heads, row_shapes, got);
+    bool same = sameBoxes(expect, got) && !got.empty();
+    ok = ok && same;
+    double legacy_rows_us = timeUs(iters, [&] {
+      expect.clear();
+      legacyDecodeRows(real.data(), rows, nout, expect);
+    });
+    double rows_us = timeUs(iters, [&] {
+      got.clear();
+      decoder.decode(row_heads, row_shapes, got);
+    });
+    std::cout << names[t] << " rows boxes=" << got.size()
+              << " identical=" << (same ? "yes" : "NO")
+              << " legacy=" << legacy_rows_us << "us decoder=" << rows_us
+              << "us" << std::endl;
+  }
+  return ok ? 0 : 1;
+}
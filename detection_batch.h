@@ -0,0 +1,164 @@
+#ifndef DETECTION_BATCH_H_
+#define DETECTION_BATCH_H_
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <new>
+
+struct Detection {
+  int x, y, width, height;
+  float score;
+  int class_id;
+};
+
+/*
+ * Read-only view of the detections of a DetectionBatch, valid until the
+ * batch is next pushed to or reset. Cheap to copy.
+ */
+class DetectionView {
+ public:
+  DetectionView() = default;
+  DetectionView(size_t size, int keypoint_num, const int* x, const int* y,
+                const int* width, const int* height, const float* score,
+                const int* class_id, const float* keypoints)
+      : m_size(size), m_keypoint_num(keypoint_num), m_x(x), m_y(y),
+        m_width(width), m_height(height), m_score(score),
+        m_class_id(class_id), m_keypoints(keypoints) {}
+
+  size_t size() const { return m_size; }
+  bool empty() const { return m_size == 0; }
+
+  Detection operator[](size_t i) const {
+    return Detection{m_x[i],     m_y[i],     m_width[i],
+                     m_height[i], m_score[i], m_class_id[i]};
+  }
+
+  // columns, size() elements each
+  const int* x() const { return m_x; }
+  const int* y() const { return m_y; }
+  const int* width() const { return m_width; }
+  const int* height() const { return m_height; }
+  const float* score() const { return m_score; }
+  const int* classId() const { return m_class_id; }
+
+  int keypointNum() const { return m_keypoint_num; }
+  // x, y, score of each keypoint of detection i
+  const float* keypoints(size_t i) const {
+    return m_keypoints + i * m_keypoint_num * 3;
+  }
+
+ private:
+  size_t m_size = 0;
+  int m_keypoint_num = 0;
+  const int* m_x = nullptr;
+  const int* m_y = nullptr;
+  const int* m_width = nullptr;
+  const int* m_height = nullptr;
+  const float* m_score = nullptr;
+  const int* m_class_id = nullptr;
+  const float* m_keypoints = nullptr;
+};
+
+/*
+ * Detections of one frame as columns (structure of arrays) in a single
+ * 64-byte aligned block. reset() only drops the count, so a batch reused
+ * frame after frame stops allocating once it has held its largest frame.
+ * keypoint_num keypoints of (x, y, score) are kept per detection.
+ */
+class DetectionBatch {
+ public:
+  explicit DetectionBatch(int keypoint_num = 0)
+      : m_keypoint_num(keypoint_num) {}
+  // The source is left empty, with no capacity, and can be reused.
+  DetectionBatch(DetectionBatch&& other) noexcept { *this = std::move(other); }
+  DetectionBatch& operator=(DetectionBatch&& other) noexcept {
+    if (this != &other) {
+      m_keypoint_num = other.m_keypoint_num;
+      m_size = other.m_size;
+      m_capacity = other.m_capacity;
+      m_block = std::move(other.m_block);
+      other.m_size = other.m_capacity = 0;
+    }
+    return *this;
+  }
+  DetectionBatch(const DetectionBatch&) = delete;
+  DetectionBatch& operator=(const DetectionBatch&) = delete;
+
+  void reset() { m_size = 0; }
+
+  size_t size() const { return m_size; }
+  size_t capacity() const { return m_capacity; }
+  int keypointNum() const { return m_keypoint_num; }
+
+  // Throw std::bad_alloc, as a std::vector would, if the block cannot grow.
+  void reserve(size_t capacity) {
+    if (capacity <= m_capacity) return;
+    capacity = (capacity + 15) & ~(size_t)15;
+    Block block(static_cast<char*>(
+        aligned_alloc(64, columnBytes(capacity) * kColumnNum +
+                              keypointBytes(capacity))));
+    if (!block) throw std::bad_alloc();
+    if (m_size) {
+      for (int c = 0; c < kColumnNum; ++c) {
+        memcpy(block.get() + c * columnBytes(capacity), column<char>(c),
+               columnBytes(m_size));
+      }
+      memcpy(block.get() + kColumnNum * columnBytes(capacity),
+             column<char>(kColumnNum), keypointBytes(m_size));
+    }
+    m_block = std::move(block);
+    m_capacity = capacity;
+  }
+
+  // Return the keypoints of the new detection to fill in, if any.
+  float* push(const Detection& det) {
+    if (m_size == m_capacity) reserve(std::max<size_t>(64, m_capacity * 2));
+    size_t i = m_size++;
+    column<int>(kX)[i] = det.x;
+    column<int>(kY)[i] = det.y;
+    column<int>(kWidth)[i] = det.width;
+    column<int>(kHeight)[i] = det.height;
+    column<float>(kScore)[i] = det.score;
+    column<int>(kClassId)[i] = det.class_id;
+    return column<float>(kColumnNum) + i * m_keypoint_num * 3;
+  }
+
+  DetectionView view() const {
+    return DetectionView(m_size, m_keypoint_num, column<int>(kX),
+                         column<int>(kY), column<int>(kWidth),
+                         column<int>(kHeight), column<float>(kScore),
+                         column<int>(kClassId), column<float>(kColumnNum));
+  }
+
+  Detection operator[](size_t i) const { return view()[i]; }
+
+ private:
+  enum { kX, kY, kWidth, kHeight, kScore, kClassId, kColumnNum };
+
+  struct Free {
+    void operator()(char* p) const { free(p); }
+  };
+  using Block = std::unique_ptr<char[], Free>;
+
+  // 4 byte elements, padded to whole cache lines by the capacity rounding
+  static size_t columnBytes(size_t capacity) { return capacity * 4; }
+  size_t keypointBytes(size_t count) const {
+    return count * m_keypoint_num * 3 * sizeof(float);
+  }
+
+  // the keypoints follow the columns, as column kColumnNum
+  template <class T>
+  T* column(int c) const {
+    return reinterpret_cast<T*>(m_block.get() + c * columnBytes(m_capacity));
+  }
+
+  int m_keypoint_num;
+  size_t m_size = 0;
+  size_t m_capacity = 0;
+  Block m_block;
+};
+
+#endif
@@ -0,0 +1,284 @@
+#ifndef DEVICE_MANAGER_H_
+#define DEVICE_MANAGER_H_
+
+#include <string.h>
+
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tpu_utils.h"
+
+struct DeviceManagerConfig {
+  // devices to use, 0 for every device tpuRtGetDeviceCount reports
+  int devices = 0;
+  // network instances per device, each run by its own worker thread
+  int workers_per_device = 2;
+  // launches per stage and instance at startup
+  int warmup = 1;
+  // a device with an empty queue takes the oldest request of the longest one
+  bool work_stealing = true;
+};
+
+/*
+ * Outputs of one request, copied out of the device staging. The pointers
+ * stay valid as long as the result.
+ */
+struct DeviceFrameResult {
+  tpuRtStatus_t status = tpuRtSuccess;
+  int device = -1;         // device that ran it
+  int queued_device = -1;  // device it was queued on
+  int stage_idx = -1;
+  std::vector<const char*> outputs;
+  std::vector<tensorSizeType> output_bytes;
+  std::shared_ptr<std::vector<char>> holder;
+};
+
+struct DeviceMetrics {
+  int device = -1;
+  unsigned long long executed = 0;
+  // executed here after being queued on another device
+  unsigned long long stolen = 0;
+  int queued = 0;
+};
+
+/*
+ * One bmodel served by every device of the machine. Each device loads its
+ * own BMNNContext, so weights, device buffers and network streams stay on
+ * it, and runs `workers_per_device` workers on network instances of that
+ * context. A request goes to the queue of the device asked for, or of the
+ * least loaded one; a worker serves its own queue first and, when it is
+ * empty, steals from the device with the most queued requests, so an
+ * overloaded device sheds work to idle ones. Requests last milliseconds, so
+ * all queues share one lock.
+ */
+class DeviceManager : public NoCopyable {
+ public:
+  DeviceManager(const std::string& bmodel_file,
+                const DeviceManagerConfig& config = DeviceManagerConfig())
+      : m_config(config) {
+    int count = 0;
+    if (tpuRtGetDeviceCount(&count) != tpuRtSuccess) count = 0;
+    if (m_config.devices <= 0 || m_config.devices > count) {
+      m_config.devices = count;
+    }
+    if (m_config.workers_per_device < 1) m_config.workers_per_device = 1;
+
+    // devices load side by side, a failing one is left out
+    std::vector<std::unique_ptr<Device>> devices(m_config.devices);
+    std::vector<std::thread> loaders;
+    for (int d = 0; d < m_config.devices; ++d) {
+      loaders.emplace_back([&, d] { devices[d] = loadDevice(bmodel_file, d); });
+    }
+    for (auto& loader : loaders) loader.join();
+    for (auto& device : devices) {
+      if (device) m_devices.push_back(std::move(device));
+    }
+
+    for (int d = 0; d < deviceNum(); ++d) {
+      for (int w = 0; w < m_config.workers_per_device; ++w) {
+        m_workers.emplace_back([this, d, w] { workerLoop(d, w); });
+      }
+    }
+  }
+
+  // Requests already queued are run before the workers stop.
+  ~DeviceManager() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_cv.notify_all();
+    for (auto& worker : m_workers) worker.join();
+  }
+
+  // Devices serving requests.
+  int deviceNum() const { return m_devices.size(); }
+
+  // Device id of the `index`th serving device.
+  int deviceId(int index) const { return m_devices[index]->id; }
+
+  std::shared_ptr<BMNNContext> context(int index) {
+    return m_devices[index]->context;
+  }
+
+  // Queue one request, a host pointer per network input, on the queue of
+  // serving device `device`, or of the least loaded one when -1. Without
+  // `shapes` the inputs have the shapes of stage 0, otherwise they run on
+  // the smallest stage holding them. The input memory must stay valid until
+  // the future is ready.
+  std::future<DeviceFrameResult> submit(
+      const std::vector<const void*>& inputs,
+      const std::vector<tpuRtShape_t>& shapes = {}, int device = -1) {
+    Request request;
+    request.inputs = inputs;
+    request.shapes = shapes;
+    std::future<DeviceFrameResult> ret = request.promise.get_future();
+    if (m_devices.empty() || device >= deviceNum()) {
+      DeviceFrameResult result;
+      result.status = tpuRtErrParam;
+      request.promise.set_value(std::move(result));
+      return ret;
+    }
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (device < 0) device = leastLoaded();
+      request.queued_device = device;
+      m_devices[device]->queue.push_back(std::move(request));
+    }
+    m_cv.notify_all();
+    return ret;
+  }
+
+  std::vector<DeviceMetrics> metrics() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<DeviceMetrics> ret;
+    for (auto& device : m_devices) {
+      DeviceMetrics metrics;
+      metrics.device = device->id;
+      metrics.executed = device->executed;
+      metrics.stolen = device->stolen;
+      metrics.queued = device->queue.size();
+      ret.push_back(metrics);
+    }
+    return ret;
+  }
+
+ private:
+  struct Request {
+    std::vector<const void*> inputs;
+    std::vector<tpuRtShape_t> shapes;
+    int queued_device = -1;
+    std::promise<DeviceFrameResult> promise;
+  };
+
+  struct Device {
+    int id = -1;
+    std::shared_ptr<BMNNContext> context;
+    std::vector<std::shared_ptr<BMNNNetwork>> networks;  // one per worker
+    std::deque<Request> queue;
+    int running = 0;
+    unsigned long long executed = 0;
+    unsigned long long stolen = 0;
+  };
+
+  std::unique_ptr<Device> loadDevice(const std::string& bmodel_file, int id) {
+    std::unique_ptr<Device> device(new Device());
+    device->id = id;
+    device->context = std::make_shared<BMNNContext>(bmodel_file.c_str(), id);
+    if (!device->context->loaded()) return nullptr;
+    for (int w = 0; w < m_config.workers_per_device; ++w) {
+      device->networks.push_back(device->context->network());
+      tpuRtStatus_t ret = device->networks.back()->warmup(m_config.warmup);
+      if (ret != tpuRtSuccess) {
+        std::cerr << "device " << id << ": warmup failed (" << ret << ")"
+                  << std::endl;
+        return nullptr;
+      }
+    }
+    return device;
+  }
+
+  int leastLoaded() const {
+    int best = 0;
+    size_t best_load = (size_t)-1;
+    for (int d = 0; d < deviceNum(); ++d) {
+      size_t load = m_devices[d]->queue.size() + m_devices[d]->running;
+      if (load < best_load) {
+        best = d;
+        best_load = load;
+      }
+    }
+    return best;
+  }
+
+  // Queue device `d` takes its next request from, -1 when none.
+  int victim(int d) const {
+    if (!m_devices[d]->queue.empty()) return d;
+    if (!m_config.work_stealing) return -1;
+    int best = -1;
+    for (int v = 0; v < deviceNum(); ++v) {
+      if (m_devices[v]->queue.empty()) continue;
+      if (best < 0 ||
+          m_devices[v]->queue.size() > m_devices[best]->queue.size()) {
+        best = v;
+      }
+    }
+    return best;
+  }
+
+  void workerLoop(int d, int w) {
+    TPUV7_TRACE_THREAD_NAME("device worker");
+    Device& device = *m_devices[d];
+    tpuRtSetDevice(device.id);
+    BMNNNetwork& network = *device.networks[w];
+    while (true) {
+      Request request;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        int from = -1;
+        m_cv.wait(lock, [&] { return (from = victim(d)) >= 0 || m_stop; });
+        if (from < 0) return;
+        request = std::move(m_devices[from]->queue.front());
+        m_devices[from]->queue.pop_front();
+        device.running++;
+      }
+      DeviceFrameResult result = run(network, request);
+      result.device = device.id;
+      result.queued_device = m_devices[request.queued_device]->id;
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        device.running--;
+        device.executed++;
+        if (request.queued_device != d) device.stolen++;
+      }
+      request.promise.set_value(std::move(result));
+    }
+  }
+
+  DeviceFrameResult run(BMNNNetwork& network, const Request& request) {
+    TPUV7_TRACE_SCOPE("device request");
+    DeviceFrameResult result;
+    const tpuRtNetInfo_t& info = network.getNetInfo();
+    std::vector<tpuRtShape_t> shapes = request.shapes;
+    for (int i = (int)shapes.size(); i < info.input.num; ++i) {
+      shapes.push_back(info.stages[0].input_shapes[i]);
+    }
+    const BMNNIOBinding* used = nullptr;
+    result.status = network.forward(request.inputs, shapes, &used);
+    if (result.status != tpuRtSuccess) return result;
+    result.stage_idx = used->stageIdx();
+
+    std::vector<std::shared_ptr<BMNNTensor>> outputs;
+    tensorSizeType total = 0;
+    for (int i = 0; i < info.output.num; ++i) {
+      outputs.push_back(network.outputTensor(i, result.stage_idx));
+      outputs.back()->start_host_copy();
+      result.output_bytes.push_back(getTensorBytes(*used->output(i)));
+      total += result.output_bytes.back();
+    }
+    result.holder = std::make_shared<std::vector<char>>(total);
+    char* dst = result.holder->data();
+    for (int i = 0; i < info.output.num; ++i) {
+      memcpy(dst, outputs[i]->get_host_data(), result.output_bytes[i]);
+      result.outputs.push_back(dst);
+      dst += result.output_bytes[i];
+    }
+    return result;
+  }
+
+  DeviceManagerConfig m_config;
+  std::vector<std::unique_ptr<Device>> m_devices;
+  std::vector<std::thread> m_workers;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  bool m_stop = false;
+};
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef DEVICE_MEMORY_POOL_H_
+#define DEVICE_MEMORY_POOL_H_
+
+#include "memory_pool.h"
+#include "tpuv7_rt.h"
+
+/*
+ * Make `device` the current device of the calling thread for the scope, the
+ * previous one is restored on exit. A negative device changes nothing.
+ */
+class ScopedDevice {
+ public:
+  explicit ScopedDevice(int device) {
+    if (device < 0 || tpuRtGetDevice(&m_previous) != tpuRtSuccess) return;
+    m_switched = device != m_previous && tpuRtSetDevice(device) == tpuRtSuccess;
+  }
+  ~ScopedDevice() {
+    if (m_switched) tpuRtSetDevice(m_previous);
+  }
+  ScopedDevice(const ScopedDevice&) = delete;
+  ScopedDevice& operator=(const ScopedDevice&) = delete;
+
+ private:
+  int m_previous = 0;
+  bool m_switched = false;
+};
+
+/*
+ * tpuRtMalloc / tpuRtFree, on `device` whatever the current device of the
+ * calling thread, or on the current device when negative.
+ */
+struct DeviceAllocator {
+  using Pointer = void*;
+
+  int device = -1;
+
+  void* allocate(unsigned long long bytes) const {
+    ScopedDevice scope(device);
+    void* data = nullptr;
+    return tpuRtMalloc(&data, bytes, 0) == tpuRtSuccess ? data : nullptr;
+  }
+  void deallocate(void* data, unsigned long long) const {
+    ScopedDevice scope(device);
+    tpuRtFree(&data, 0);
+  }
+};
+
+// Device buffer taken from a DeviceMemoryPool, given back to it on
+// destruction.
+using DeviceBuffer = PooledBuffer<DeviceAllocator>;
+
+/*
+ * Cache of device buffers behind tpuRtMalloc, see SizeClassPool. A pool
+ * bound to a device allocates and frees there whatever the current device of
+ * the calling thread, otherwise on the current device.
+ */
+class DeviceMemoryPool : public SizeClassPool<DeviceAllocator> {
+ public:
+  explicit DeviceMemoryPool(int device = -1)
+      : SizeClassPool<DeviceAllocator>(DeviceAllocator{device}) {}
+
+  // -1 when not bound to a device.
+  int device() const { return allocator().device; }
+};
+
+#endif
@@ -0,0 +1,388 @@
+#ifndef DYNAMIC_BATCHER_H_
+#define DYNAMIC_BATCHER_H_
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "bounded_queue.h"
+#include "host_memory_pool.h"
+#include "tpu_utils.h"
+
+struct DynamicBatcherConfig {
+  // largest batch to form, 0 for the largest compiled stage
+  int max_batch = 0;
+  // a batch is launched at the latest this long after its first frame arrived
+  int max_delay_us = 2000;
+  // batches in flight, each on its own stream and device buffers, so the
+  // next batch is uploaded and launched while the last one is read back
+  int inflight = 2;
+};
+
+/*
+ * Outputs of one frame of a batch. The pointers are this frame's slice of
+ * each output and stay valid as long as the result; the host buffer of the
+ * batch goes back to the batcher's pool with its last result.
+ */
+struct BatchedFrameResult {
+  tpuRtStatus_t status = tpuRtSuccess;
+  int stage_idx = -1;
+  int batch_size = 0;  // frames in the batch, not counting padding
+  std::vector<const char*> outputs;
+  std::vector<tensorSizeType> output_bytes;
+  std::shared_ptr<HostBuffer> holder;
+};
+
+struct DynamicBatcherMetrics {
+  unsigned long long batches = 0;
+  unsigned long long frames = 0;
+  // frames / compiled batch of the stage they ran on, 1 means no padding
+  double mean_fill = 0;
+  double mean_queue_us = 0;
+  // from a uniform sample of at most 4096 queueing delays
+  double p50_queue_us = 0;
+  double p99_queue_us = 0;
+  double max_queue_us = 0;
+  // batches run on each stage
+  std::vector<unsigned long long> stage_batches;
+};
+
+/*
+ * Collects single-frame requests from any number of producers into batches.
+ * A batch is launched when it reaches the largest usable stage or when its
+ * oldest frame has waited max_delay_us, on the smallest compiled stage whose
+ * batch fits it; unused slots are left as padding. Results are scattered back
+ * through the future returned by submit().
+ *
+ * The batching thread uploads and launches each batch on one of `inflight`
+ * I/O sets, with its own stream and device buffers, and a completion thread
+ * waits for it and fulfills the futures, so batches overlap on the device.
+ * The network is only used for its net info and to launch, on those
+ * streams, so it can be shared with other users.
+ */
+class DynamicBatcher : public NoCopyable {
+ public:
+  DynamicBatcher(std::shared_ptr<BMNNContext> context,
+                 std::shared_ptr<BMNNNetwork> network,
+                 const DynamicBatcherConfig& config = DynamicBatcherConfig())
+      : m_network(network),
+        m_pool(context->memoryPool()),
+        m_host_pool(std::make_shared<HostMemoryPool>()),
+        m_config(config),
+        m_free(std::max(config.inflight, 1)),
+        m_done(std::max(config.inflight, 1)) {
+    const tpuRtNetInfo_t& info = network->getNetInfo();
+    for (int s = 0; s < info.stage_num; ++s) {
+      m_stages.push_back(
+          std::make_pair(info.stages[s].input_shapes[0].dims[0], s));
+    }
+    std::sort(m_stages.begin(), m_stages.end());
+    if (m_config.max_batch <= 0 || m_config.max_batch > m_stages.back().first) {
+      m_config.max_batch = m_stages.back().first;
+    }
+    m_stage_batches.resize(info.stage_num, 0);
+    for (int s = 0; s < std::max(m_config.inflight, 1); ++s) {
+      std::unique_ptr<IOSet> set(new IOSet());
+      tpuRtStreamCreate(&set->stream);
+      set->stage_io.resize(info.stage_num);
+      m_free.push(set.get());
+      m_sets.push_back(std::move(set));
+    }
+    m_worker = std::thread([this] { batchLoop(); });
+    m_completer = std::thread([this] { completeLoop(); });
+  }
+
+  ~DynamicBatcher() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_cv.notify_all();
+    m_worker.join();
+    m_completer.join();
+    for (auto& set : m_sets) {
+      set->stage_io.clear();
+      tpuRtStreamDestroy(set->stream);
+    }
+  }
+
+  // Queue one frame, a host pointer per network input holding a single
+  // frame. The input memory must stay valid until the future is ready.
+  std::future<BatchedFrameResult> submit(
+      const std::vector<const void*>& inputs) {
+    Request request;
+    request.inputs = inputs;
+    request.arrival = Clock::now();
+    std::future<BatchedFrameResult> ret = request.promise.get_future();
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_requests.push_back(std::move(request));
+    }
+    m_cv.notify_one();
+    return ret;
+  }
+
+  DynamicBatcherMetrics metrics() {
+    std::lock_guard<std::mutex> lock(m_metrics_mutex);
+    DynamicBatcherMetrics ret;
+    ret.batches = m_batches;
+    ret.frames = m_frames;
+    ret.mean_fill = m_stage_slots ? (double)m_frames / m_stage_slots : 0;
+    ret.mean_queue_us = m_frames ? m_queue_us_sum / m_frames : 0;
+    std::vector<double> sorted = m_queue_samples;
+    std::sort(sorted.begin(), sorted.end());
+    ret.p50_queue_us = percentile(sorted, 0.5);
+    ret.p99_queue_us = percentile(sorted, 0.99);
+    ret.max_queue_us = m_queue_us_max;
+    ret.stage_batches = m_stage_batches;
+    return ret;
+  }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+  // queueing delays kept for the percentiles, by reservoir sampling
+  static const size_t kQueueSamples = 4096;
+
+  struct Request {
+    std::vector<const void*> inputs;
+    Clock::time_point arrival;
+    std::promise<BatchedFrameResult> promise;
+  };
+
+  struct StageIO {
+    std::vector<DeviceBuffer> buffers;
+    std::unique_ptr<BMNNIOBinding> binding;
+    // per input, all but one frame of the zero point, uploaded to the slots
+    // a partial batch leaves empty
+    std::vector<std::vector<char>> padding;
+  };
+
+  struct IOSet {
+    tpuRtStream_t stream;
+    std::vector<StageIO> stage_io;  // per stage, bound on first use
+  };
+
+  // A launched batch, on its way to the completion thread.
+  struct Batch {
+    std::vector<Request> requests;
+    IOSet* set = nullptr;
+    int stage_idx = -1;
+    int stage_batch = 0;
+    Clock::time_point launch_time;
+    tpuRtStatus_t status = tpuRtSuccess;
+    std::shared_ptr<HostBuffer> holder;
+    std::vector<tensorSizeType> offsets;
+    std::vector<tensorSizeType> frame_bytes;
+  };
+
+  void batchLoop() {
+    TPUV7_TRACE_THREAD_NAME("dynamic batcher");
+    while (true) {
+      Batch batch;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [this] { return m_stop || !m_requests.empty(); });
+        if (m_stop && m_requests.empty()) break;
+        auto deadline = m_requests.front().arrival +
+                        std::chrono::microseconds(m_config.max_delay_us);
+        m_cv.wait_until(lock, deadline, [this] {
+          return m_stop || (int)m_requests.size() >= m_config.max_batch;
+        });
+        int n = std::min<int>(m_requests.size(), m_config.max_batch);
+        for (int i = 0; i < n; ++i) {
+          batch.requests.push_back(std::move(m_requests.front()));
+          m_requests.pop_front();
+        }
+      }
+      launchBatch(batch);
+      m_done.push(std::move(batch));
+    }
+    m_done.close();
+  }
+
+  void completeLoop() {
+    TPUV7_TRACE_THREAD_NAME("dynamic batcher completion");
+    Batch batch;
+    while (m_done.pop(batch)) {
+      tpuRtStatus_t sync;
+      {
+        TPUV7_TRACE_SCOPE("tpuRtStreamSynchronize");
+        sync = tpuRtStreamSynchronize(batch.set->stream);
+      }
+      if (batch.status == tpuRtSuccess) batch.status = sync;
+      m_free.push(batch.set);
+
+      // metrics first, so they cover a batch once any of its futures is ready
+      recordBatch(batch);
+      int frames = batch.requests.size();
+      for (int f = 0; f < frames; ++f) {
+        BatchedFrameResult result;
+        result.status = batch.status;
+        result.stage_idx = batch.stage_idx;
+        result.batch_size = frames;
+        result.holder = batch.holder;
+        for (size_t i = 0; i < batch.offsets.size(); ++i) {
+          result.outputs.push_back(batch.holder->data() + batch.offsets[i] +
+                                   f * batch.frame_bytes[i]);
+          result.output_bytes.push_back(batch.frame_bytes[i]);
+        }
+        batch.requests[f].promise.set_value(std::move(result));
+      }
+    }
+  }
+
+  int selectStage(int frames) {
+    for (auto& stage : m_stages) {
+      if (stage.first >= frames) return stage.second;
+    }
+    return m_stages.back().second;
+  }
+
+  StageIO& stageIO(IOSet& set, int stage_idx) {
+    StageIO& io = set.stage_io[stage_idx];
+    if (io.binding) return io;
+    const tpuRtNetInfo_t& info = m_network->getNetInfo();
+    std::vector<void*> input_data, output_data;
+    for (int i = 0; i < info.input.num; ++i) {
+      tpuRtTensor_t tensor = *m_network->inputTpuRtTensor(i, stage_idx);
+      tensorSizeType bytes = getTensorBytes(tensor);
+      io.buffers.push_back(m_pool->acquire(bytes));
+      ASSERT(io.buffers.back());
+      input_data.push_back(io.buffers.back().data());
+      int stage_batch = tensor.shape.dims[0];
+      io.padding.emplace_back(bytes / stage_batch * (stage_batch - 1));
+      fillZeroPoint(io.padding.back().data(), io.padding.back().size(),
+                    tensor.dtype, info.input.zero_points[i]);
+    }
+    for (int i = 0; i < info.output.num; ++i) {
+      tpuRtTensor_t tensor = *m_network->outputTpuRtTensor(i, stage_idx);
+      io.buffers.push_back(m_pool->acquire(getTensorBytes(tensor)));
+      ASSERT(io.buffers.back());
+      output_data.push_back(io.buffers.back().data());
+    }
+    io.binding.reset(new BMNNIOBinding(
+        m_network->createBinding(input_data, output_data, stage_idx)));
+    return io;
+  }
+
+  // Queue the upload, launch and read back of a batch on a free I/O set.
+  void launchBatch(Batch& batch) {
+    batch.launch_time = Clock::now();
+    int frames = batch.requests.size();
+    batch.stage_idx = selectStage(frames);
+    batch.stage_batch = m_network->getNetInfo()
+                            .stages[batch.stage_idx]
+                            .input_shapes[0]
+                            .dims[0];
+    m_free.pop(batch.set);
+    StageIO& stage_io = stageIO(*batch.set, batch.stage_idx);
+    const BMNNIOBinding& io = *stage_io.binding;
+    tpuRtStream_t stream = batch.set->stream;
+
+    tpuRtStatus_t& status = batch.status;
+    for (int i = 0; i < io.inputNum(); ++i) {
+      const tpuRtTensor_t* input = io.input(i);
+      tensorSizeType frame_bytes = getTensorBytes(*input) / batch.stage_batch;
+      for (int f = 0; f < frames && status == tpuRtSuccess; ++f) {
+        TPUV7_TRACE_SCOPE("tpuRtMemcpyS2DAsync");
+        status = tpuRtMemcpyS2DAsync(
+            static_cast<char*>(input->data) + f * frame_bytes,
+            batch.requests[f].inputs[i], frame_bytes, stream);
+      }
+      // trailing slots never keep the frames of an earlier batch
+      if (frames < batch.stage_batch && status == tpuRtSuccess) {
+        TPUV7_TRACE_SCOPE("tpuRtMemcpyS2DAsync");
+        status = tpuRtMemcpyS2DAsync(
+            static_cast<char*>(input->data) + frames * frame_bytes,
+            stage_io.padding[i].data(),
+            (batch.stage_batch - frames) * frame_bytes, stream);
+      }
+    }
+    if (status == tpuRtSuccess) {
+      status = m_network->forwardAsync(io, stream);
+    }
+
+    tensorSizeType total = 0;
+    for (int i = 0; i < io.outputNum(); ++i) {
+      batch.offsets.push_back(total);
+      batch.frame_bytes.push_back(getTensorBytes(*io.output(i)) /
+                                  batch.stage_batch);
+      total += batch.frame_bytes.back() * frames;
+    }
+    // recycled, batches of a size seen before allocate nothing
+    batch.holder = std::make_shared<HostBuffer>(m_host_pool->acquire(total));
+    if (!*batch.holder && status == tpuRtSuccess) status = tpuRtErrNomem;
+    if (status == tpuRtSuccess) {
+      // only the slots of real frames are read back
+      for (int i = 0; i < io.outputNum(); ++i) {
+        TPUV7_TRACE_SCOPE("tpuRtMemcpyD2SAsync");
+        tpuRtMemcpyD2SAsync(batch.holder->data() + batch.offsets[i],
+                            io.output(i)->data,
+                            batch.frame_bytes[i] * frames, stream);
+      }
+    }
+  }
+
+  void recordBatch(const Batch& batch) {
+    std::lock_guard<std::mutex> lock(m_metrics_mutex);
+    m_batches++;
+    m_stage_slots += batch.stage_batch;
+    m_stage_batches[batch.stage_idx]++;
+    for (auto& request : batch.requests) {
+      double us = std::chrono::duration<double, std::micro>(
+                      batch.launch_time - request.arrival)
+                      .count();
+      m_frames++;
+      m_queue_us_sum += us;
+      m_queue_us_max = std::max(m_queue_us_max, us);
+      // every delay seen so far is in the sample with the same chance
+      if (m_queue_samples.size() < kQueueSamples) {
+        m_queue_samples.push_back(us);
+      } else {
+        unsigned long long slot = m_sample_rng() % m_frames;
+        if (slot < kQueueSamples) m_queue_samples[slot] = us;
+      }
+    }
+  }
+
+  static double percentile(const std::vector<double>& sorted, double q) {
+    if (sorted.empty()) return 0;
+    size_t rank = std::min(sorted.size() - 1, (size_t)(q * sorted.size()));
+    return sorted[rank];
+  }
+
+  std::shared_ptr<BMNNNetwork> m_network;
+  std::shared_ptr<DeviceMemoryPool> m_pool;
+  std::shared_ptr<HostMemoryPool> m_host_pool;
+  DynamicBatcherConfig m_config;
+  std::vector<std::pair<int, int>> m_stages;  // (batch, stage index)
+  std::vector<std::unique_ptr<IOSet>> m_sets;
+  BoundedQueue<IOSet*> m_free;
+  BoundedQueue<Batch> m_done;
+
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::deque<Request> m_requests;
+  bool m_stop = false;
+  std::thread m_worker;
+  std::thread m_completer;
+
+  std::mutex m_metrics_mutex;
+  unsigned long long m_batches = 0;
+  unsigned long long m_frames = 0;
+  unsigned long long m_stage_slots = 0;
+  double m_queue_us_sum = 0;
+  double m_queue_us_max = 0;
+  std::vector<double> m_queue_samples;
+  std::minstd_rand m_sample_rng;
+  std::vector<unsigned long long> m_stage_batches;
+};
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef FLOAT16_H_
+#define FLOAT16_H_
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Scalar fp16 / bf16 conversions, for the elements the SIMD paths leave over.
+ */
+
+inline float halfToFloat(uint16_t h) {
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f;
+  uint32_t mant = h & 0x3ff;
+  uint32_t bits;
+  if (exp == 0x1f) {
+    bits = sign | 0x7f800000 | (mant << 13);
+  } else if (exp) {
+    bits = sign | ((exp + 112) << 23) | (mant << 13);
+  } else if (mant) {
+    // subnormal, normalize
+    exp = 113;
+    while (!(mant & 0x400)) {
+      mant <<= 1;
+      exp--;
+    }
+    bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+  } else {
+    bits = sign;
+  }
+  float ret;
+  memcpy(&ret, &bits, 4);
+  return ret;
+}
+
+inline float bf16ToFloat(uint16_t h) {
+  uint32_t bits = (uint32_t)h << 16;
+  float ret;
+  memcpy(&ret, &bits, 4);
+  return ret;
+}
+
+// Round to nearest even, overflow to inf, small values to subnormals or 0.
+inline uint16_t floatToHalf(float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, 4);
+  uint16_t sign = (bits >> 16) & 0x8000;
+  uint32_t abs = bits & 0x7fffffff;
+  if (abs >= 0x7f800000) {
+    return sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0);
+  }
+  if (abs >= 0x477ff000) return sign | 0x7c00;  // rounds above 65504
+  if (abs < 0x38800000) {
+    // subnormal half, value is mant * 2^-24
+    if (abs < 0x33000000) return sign;
+    int shift = 126 - (abs >> 23);
+    uint32_t mant = (abs & 0x7fffff) | 0x800000;
+    uint32_t half = mant >> shift;
+    uint32_t rest = mant & ((1u << shift) - 1);
+    uint32_t mid = 1u << (shift - 1);
+    if (rest > mid || (rest == mid && (half & 1))) half++;
+    return sign | half;
+  }
+  uint32_t half = ((abs >> 13) - (112 << 10));
+  uint32_t rest = abs & 0x1fff;
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+  return sign | half;
+}
+
+inline uint16_t floatToBf16(float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, 4);
+  if ((bits & 0x7fffffff) > 0x7f800000) return (bits >> 16) | 0x40;
+  bits += 0x7fff + ((bits >> 16) & 1);
+  return bits >> 16;
+}
+
+#endif
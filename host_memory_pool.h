@@ -0,0 +1,25 @@
+#ifndef HOST_MEMORY_POOL_H_
+#define HOST_MEMORY_POOL_H_
+
+#include <stdlib.h>
+
+#include "memory_pool.h"
+
+// 64-byte aligned host memory.
+struct HostAllocator {
+  using Pointer = char*;
+
+  char* allocate(unsigned long long bytes) const {
+    return static_cast<char*>(aligned_alloc(64, bytes));
+  }
+  void deallocate(char* data, unsigned long long) const { free(data); }
+};
+
+// Host buffer taken from a HostMemoryPool, given back to it on destruction.
+using HostBuffer = PooledBuffer<HostAllocator>;
+
+// Cache of host buffers, see SizeClassPool. Used for the host side of
+// uploads and read backs, so a size seen before is never allocated again.
+using HostMemoryPool = SizeClassPool<HostAllocator>;
+
+#endif
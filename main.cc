@@ -1,8 +1,8 @@
-#include <fstream>
 #include <iostream>
-#include <numeric>
 
+#include "dataset_reader.h"
 #include "post_process.cc"
+#include "tensor_compare.h"
 
 const std::string ref_in = "../data/1684x/input_int81b";
 const std::string ref_out = "../data/1684x/output_int81b";
@@ -11,136 +11,102 @@ const std::string modelPath =
     "/home/xyz/projects/1690/model_trans/YOLOv5/models/BM1690/"
     "yolov5s_v6.1_3output_int8_1b.bmodel";
 
-char* inBuffer;
-char** outBuffer;
-char** fileOutBuffer;
-
-float getDiff(char** outBuffer, char** groundTruth, std::vector<int>& dims) {
-  float ret = 0.0;
-  float** outBufferFloat = reinterpret_cast<float**>(outBuffer);
-  float** groundTruthFloat = reinterpret_cast<float**>(groundTruth);
-  std::vector<std::vector<float>> absDiff(dims.size());
-
-  for (int i = 0; i < dims.size(); ++i) {
-    int len = dims[i] / sizeof(float);
-    for (int j = 0; j < len; ++j) {
-      absDiff[i].push_back(
-          std::abs(outBufferFloat[i][j] - groundTruthFloat[i][j]));
-    }
-    ret += std::accumulate(absDiff[i].begin(), absDiff[i].end(), 0.0);
-  }
-  return ret;
-}
-
-void prepareHostTensorsFromFile(const std::string& ref_in,
-                                const std::string& ref_out,
-                                std::vector<int>& dims) {
-  std::ifstream file1(ref_in, std::ios::binary | std::ios::ate);
-  if (file1.is_open()) {
-    std::streampos fileSize = file1.tellg();
-    file1.seekg(0, std::ios::beg);
-    inBuffer = new char[int(fileSize)];
-    file1.read(inBuffer, int(fileSize));
-    file1.close();
-  } else {
-    std::cerr << "无法打开文件" << std::endl;
-  }
-
-  std::ifstream file2(ref_out, std::ios::binary | std::ios::ate);
-  if (file2.is_open()) {
-    std::streampos fileSize = file2.tellg();
-
-    fileOutBuffer[0] = new char[dims[0]];
-    fileOutBuffer[1] = new char[dims[1]];
-    fileOutBuffer[2] = new char[dims[2]];
-
-    file2.seekg(0, std::ios::beg);
-    file2.read(fileOutBuffer[0], dims[0]);
-    file2.read(fileOutBuffer[1], dims[1]);
-    file2.read(fileOutBuffer[2], dims[2]);
-
-    file2.close();
-  } else {
-    std::cerr << "无法打开文件" << std::endl;
-  }
-
-  outBuffer[0] = new char[dims[0]];
-  outBuffer[1] = new char[dims[1]];
-  outBuffer[2] = new char[dims[2]];
-
-  return;
-}
-
-void mallocAndCopyTpuRtTensors(
-    std::shared_ptr<BMNNNetwork> net,
+void mallocTpuRtTensors(
+    std::shared_ptr<BMNNContext> context, std::shared_ptr<BMNNNetwork> net,
     std::vector<std::shared_ptr<tpuRtTensor_t>>& inputTensors,
     std::vector<std::shared_ptr<tpuRtTensor_t>>& outputTensors,
-    char* inBuffer) {
+    std::vector<DeviceBuffer>& deviceBuffers) {
+  auto pool = context->memoryPool();
   for (int i = 0; i < net->inputTensorNum(); ++i) {
     int size = getTensorBytes(*inputTensors[i]);
-    tpuRtMalloc(&(inputTensors[i]->data), size, 0);
-    tpuRtMemcpyS2D(inputTensors[i]->data, inBuffer, size);
+    deviceBuffers.push_back(pool->acquire(size));
+    inputTensors[i]->data = deviceBuffers.back().data();
   }
   for (int i = 0; i < net->outputTensorNum(); ++i) {
     int size = getTensorBytes(*outputTensors[i]);
-    tpuRtMalloc(&(outputTensors[i]->data), size, 0);
+    deviceBuffers.push_back(pool->acquire(size));
+    outputTensors[i]->data = deviceBuffers.back().data();
   }
   return;
 }
 
 
-int main() {
+// usage: tpuv7_test [device]
+int main(int argc, char** argv) {
+  int device = argc > 1 ? atoi(argv[1]) : 0;
   tpuRtInit();
-  tpuRtSetDevice(0);
+  if (tpuRtSetDevice(device) != tpuRtSuccess) {
+    std::cerr << "no device " << device << std::endl;
+    return 1;
+  }
   tpuRtStatus_t ret;
-  std::vector<int> dims;
+  std::vector<size_t> refBytes;
   long inSize, outSize;
-  auto context = std::make_shared<BMNNContext>(modelPath.c_str());
-  auto network = context->network();
-  outBuffer = new char*[network->outputTensorNum()];
-  fileOutBuffer = new char*[network->outputTensorNum()];
-
+  auto context = std::make_shared<BMNNContext>(modelPath.c_str(), device);
+  auto network = context->network(true);
+  std::vector<size_t> inBytes;
   std::vector<std::shared_ptr<tpuRtTensor_t>> inputTensors(
       network->inputTensorNum());
   for (int i = 0; i < network->inputTensorNum(); ++i) {
     inputTensors[i] = network->inputTpuRtTensor(i);
+    inBytes.push_back(getTensorBytes(*inputTensors[i]));
   }
   std::vector<std::shared_ptr<tpuRtTensor_t>> outputTensors(
       network->outputTensorNum());
   for (int i = 0; i < network->outputTensorNum(); ++i) {
     outputTensors[i] = network->outputTpuRtTensor(i);
-    dims.push_back(getTensorBytes(*outputTensors[i]));
+    // the references are fp32 whatever the output dtype is
+    refBytes.push_back(getShapeElements(outputTensors[i]->shape) *
+                       sizeof(float));
   }
 
-  prepareHostTensorsFromFile(ref_in, ref_out, dims);
-  mallocAndCopyTpuRtTensors(network, inputTensors, outputTensors, inBuffer);
-
-  ret = network->forward(inputTensors, outputTensors);
+  std::vector<DeviceBuffer> deviceBuffers;
+  mallocTpuRtTensors(context, network, inputTensors, outputTensors,
+                     deviceBuffers);
+
+  // ref_in / ref_out may be single frames, packed frames or directories
+  DatasetReader dataset(ref_in, inBytes, ref_out, refBytes);
+  TensorComparator total;
+  DetectionBatch detections;
+  for (int f = 0; f < dataset.size(); ++f) {
+    DatasetFrame frame = dataset.frame(f);
+    for (int i = 0; i < network->inputTensorNum(); ++i) {
+      TPUV7_TRACE_SCOPE("tpuRtMemcpyS2D");
+      tpuRtMemcpyS2D(inputTensors[i]->data, frame.inputs[i], inBytes[i]);
+    }
+    ret = network->forward(inputTensors, outputTensors);
+
+    std::vector<std::shared_ptr<BMNNTensor>> outputBMNNTensors =
+        network->startOutputCopies(outputTensors);
+    // decoded in the output dtype, int8 outputs are never converted whole
+    std::vector<const char*> outputs;
+    for (auto& tensor : outputBMNNTensors) {
+      outputs.push_back(tensor->get_host_data());
+    }
+    postProcessCPU(outputs.data(), outputBMNNTensors, detections);
+    for (size_t i = 0; i < detections.size(); ++i) {
+      Detection det = detections[i];
+      std::cout << det.x << " " << det.y << " " << det.width << " "
+                << det.height << std::endl;
+    }
+    TensorComparator comparator;
+    for (int i = 0; i < network->outputTensorNum(); ++i) {
+      comparator.add(*outputBMNNTensors[i], frame.outputs[i]);
+      total.add(*outputBMNNTensors[i], frame.outputs[i]);
+    }
 
-  std::vector<std::shared_ptr<BMNNTensor>> outputBMNNTensors;
-  for (int i = 0; i < network->outputTensorNum(); ++i) {
-    outputBMNNTensors.push_back(std::make_shared<BMNNTensor>(
-        "", 1.0, outputTensors[i].get(), network->getStream()));
-    outBuffer[i] = outputBMNNTensors[i]->get_host_data();
-  }
-  std::vector<std::shared_ptr<DetectedObjectMetadata>> detDatas =
-      postProcessCPU(fileOutBuffer, outputBMNNTensors);
-  for (int i = 0; i < detDatas.size(); ++i) {
-      std::cout << detDatas[i]->mBox.mX << " " << detDatas[i]->mBox.mY << " "
-              << detDatas[i]->mBox.mWidth << " " << detDatas[i]->mBox.mHeight
+    std::cout << "frame " << f << " diff is " << comparator.stats().l1
               << std::endl;
+    std::cout << "  " << comparator.stats() << std::endl;
   }
-  auto diff = getDiff(outBuffer, fileOutBuffer, dims);
-
-  std::cout << "diff is " << diff << std::endl;
-  delete[] inBuffer;
-  for (int i = 0; i < network->inputTensorNum(); ++i) delete[] fileOutBuffer[i];
-  delete[] fileOutBuffer;
+  std::cout << dataset.size() << " frames, " << total.stats() << std::endl;
 
-  for (int i = 0; i < network->inputTensorNum(); ++i)
-    tpuRtFree(&inputTensors[i]->data, 0);
+  if (TPUV7_TRACE_EXPORT("tpuv7_trace.json")) {
+    std::cout << "trace written to tpuv7_trace.json" << std::endl;
+  }
 
-  for (int i = 0; i < network->outputTensorNum(); ++i)
-    tpuRtFree(&outputTensors[i]->data, 0);
+  auto stats = context->memoryPoolStats();
+  std::cout << "device pool hits " << stats.hits << " misses " << stats.misses
+            << " allocated " << stats.allocated_bytes << " bytes" << std::endl;
   return 0;
 }
@@ -0,0 +1,178 @@
+#ifndef MEMORY_POOL_H_
+#define MEMORY_POOL_H_
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+struct MemoryPoolStats {
+  unsigned long long hits = 0;
+  unsigned long long misses = 0;
+  unsigned long long allocated_bytes = 0;  // held from the allocator
+  unsigned long long cached_bytes = 0;     // free in the pool
+};
+
+template <class Allocator>
+class SizeClassPool;
+
+/*
+ * Buffer taken from a SizeClassPool, given back to it on destruction.
+ * Movable, not copyable.
+ */
+template <class Allocator>
+class PooledBuffer {
+ public:
+  using Pointer = typename Allocator::Pointer;
+
+  PooledBuffer() = default;
+  PooledBuffer(std::shared_ptr<SizeClassPool<Allocator>> pool, Pointer data,
+               unsigned long long size, unsigned long long capacity)
+      : m_pool(std::move(pool)), m_data(data), m_size(size),
+        m_capacity(capacity) {}
+  PooledBuffer(PooledBuffer&& other) noexcept { *this = std::move(other); }
+  PooledBuffer& operator=(PooledBuffer&& other) noexcept {
+    if (this != &other) {
+      reset();
+      m_pool = std::move(other.m_pool);
+      m_data = other.m_data;
+      m_size = other.m_size;
+      m_capacity = other.m_capacity;
+      other.m_data = nullptr;
+      other.m_size = other.m_capacity = 0;
+    }
+    return *this;
+  }
+  PooledBuffer(const PooledBuffer&) = delete;
+  PooledBuffer& operator=(const PooledBuffer&) = delete;
+  ~PooledBuffer() { reset(); }
+
+  Pointer data() const { return m_data; }
+  // bytes asked for, the buffer may be larger
+  unsigned long long size() const { return m_size; }
+  unsigned long long capacity() const { return m_capacity; }
+  explicit operator bool() const { return m_data != nullptr; }
+
+  void reset() {
+    if (m_data && m_pool) m_pool->release(m_data, m_capacity);
+    m_pool.reset();
+    m_data = nullptr;
+    m_size = m_capacity = 0;
+  }
+
+ private:
+  std::shared_ptr<SizeClassPool<Allocator>> m_pool;
+  Pointer m_data = nullptr;
+  unsigned long long m_size = 0;
+  unsigned long long m_capacity = 0;
+};
+
+/*
+ * Cache of buffers in front of an allocator. Requests are rounded up to a
+ * size class (4 classes per power of two, at least 4KB) and served from the
+ * buffers released into that class before falling back to the allocator,
+ * which provides `Pointer`, `Pointer allocate(bytes)` returning null on
+ * failure, and `deallocate(Pointer, bytes)`. Thread safe. Create it with
+ * std::make_shared, buffers keep it alive.
+ */
+template <class Allocator>
+class SizeClassPool
+    : public std::enable_shared_from_this<SizeClassPool<Allocator>> {
+ public:
+  using Pointer = typename Allocator::Pointer;
+  using Buffer = PooledBuffer<Allocator>;
+
+  explicit SizeClassPool(const Allocator& allocator = Allocator())
+      : m_allocator(allocator) {}
+  SizeClassPool(const SizeClassPool&) = delete;
+  SizeClassPool& operator=(const SizeClassPool&) = delete;
+
+  ~SizeClassPool() { trim(); }
+
+  static unsigned long long sizeClass(unsigned long long bytes) {
+    const unsigned long long min_class = 4096;
+    if (bytes <= min_class) return min_class;
+    int top = 63 - __builtin_clzll(bytes - 1);
+    unsigned long long step = 1ull << (top - 2);
+    return (bytes + step - 1) & ~(step - 1);
+  }
+
+  // Return an empty buffer if the allocation fails.
+  Buffer acquire(unsigned long long bytes) {
+    unsigned long long capacity = sizeClass(bytes);
+    Pointer data = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      auto& bucket = m_free[capacity];
+      if (!bucket.empty()) {
+        data = bucket.back();
+        bucket.pop_back();
+        m_stats.hits++;
+        m_stats.cached_bytes -= capacity;
+      } else {
+        m_stats.misses++;
+      }
+    }
+    if (!data) {
+      data = m_allocator.allocate(capacity);
+      if (!data) return Buffer();
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stats.allocated_bytes += capacity;
+    }
+    return Buffer(this->shared_from_this(), data, bytes, capacity);
+  }
+
+  // Make sure `count` buffers of `bytes` are cached, so the next acquires of
+  // that size do not touch the allocator.
+  void reserve(unsigned long long bytes, int count = 1) {
+    unsigned long long capacity = sizeClass(bytes);
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      count -= (int)m_free[capacity].size();
+    }
+    for (int i = 0; i < count; ++i) {
+      Pointer data = m_allocator.allocate(capacity);
+      if (!data) break;
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stats.allocated_bytes += capacity;
+      m_stats.cached_bytes += capacity;
+      m_free[capacity].push_back(data);
+    }
+  }
+
+  // Give every cached buffer back to the allocator.
+  void trim() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto& bucket : m_free) {
+      for (Pointer data : bucket.second) {
+        m_allocator.deallocate(data, bucket.first);
+        m_stats.allocated_bytes -= bucket.first;
+      }
+      bucket.second.clear();
+    }
+    m_stats.cached_bytes = 0;
+  }
+
+  const Allocator& allocator() const { return m_allocator; }
+
+  MemoryPoolStats stats() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+  }
+
+ private:
+  friend class PooledBuffer<Allocator>;
+
+  void release(Pointer data, unsigned long long capacity) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_free[capacity].push_back(data);
+    m_stats.cached_bytes += capacity;
+  }
+
+  Allocator m_allocator;
+  std::mutex m_mutex;
+  std::map<unsigned long long, std::vector<Pointer>> m_free;
+  MemoryPoolStats m_stats;
+};
+
+#endif
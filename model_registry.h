@@ -0,0 +1,132 @@
+#ifndef MODEL_REGISTRY_H_
+#define MODEL_REGISTRY_H_
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "thread_pool.h"
+#include "tpu_utils.h"
+
+// One bmodel to load into a ModelRegistry.
+struct ModelSpec {
+  std::string name;  // registry key, the path when empty
+  std::string path;
+  int device = 0;
+  int instances = 1;  // network instances, each with its own stream
+  int max_users = 1;
+  int warmup = 1;  // launches per stage and instance before it is served
+  bool verbose = false;  // print the info table once loaded
+};
+
+// A loaded bmodel, its network instances warmed up.
+struct LoadedModel {
+  ModelSpec spec;
+  std::shared_ptr<BMNNContext> context;
+  std::shared_ptr<BMNNNetworkPool> networks;
+  double load_ms = 0;
+  double warmup_ms = 0;
+};
+
+/*
+ * The bmodels of a service, loaded side by side at startup. Each model is
+ * loaded on its own thread: the net info and stage table are queried once
+ * per bmodel and shared by all its instances, then every stage of every
+ * instance is launched `warmup` times so no request meets a cold network.
+ * Lookups are thread safe.
+ */
+class ModelRegistry : public NoCopyable {
+ public:
+  // Load every model of `specs` on up to `threads` threads, one per model
+  // when 0. Models that fail to load or warm up are reported on stderr and
+  // left out; the others stay registered.
+  tpuRtStatus_t load(const std::vector<ModelSpec>& specs, int threads = 0) {
+    std::vector<ModelSpec> todo = specs;
+    std::set<std::string> seen;
+    for (auto& spec : todo) {
+      if (spec.name.empty()) spec.name = spec.path;
+      if (get(spec.name) || !seen.insert(spec.name).second) {
+        std::cerr << "model " << spec.name << " registered twice" << std::endl;
+        return tpuRtErrParam;
+      }
+    }
+    if (todo.empty()) return tpuRtSuccess;
+    if (threads <= 0) threads = todo.size();
+    ThreadPool pool(std::min<int>(threads, todo.size()));
+    std::vector<std::shared_ptr<LoadedModel>> models(todo.size());
+    pool.parallelFor(todo.size(),
+                     [&](int i) { models[i] = loadModel(todo[i]); });
+
+    tpuRtStatus_t ret = tpuRtSuccess;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto& model : models) {
+      if (model) {
+        m_models[model->spec.name] = model;
+      } else {
+        ret = tpuRtErrFailure;
+      }
+    }
+    return ret;
+  }
+
+  // nullptr when `name` is not loaded.
+  std::shared_ptr<LoadedModel> get(const std::string& name) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_models.find(name);
+    return it == m_models.end() ? nullptr : it->second;
+  }
+
+  std::vector<std::string> names() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<std::string> ret;
+    for (auto& model : m_models) ret.push_back(model.first);
+    return ret;
+  }
+
+ private:
+  static double msSince(std::chrono::steady_clock::time_point begin) {
+    return std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - begin)
+        .count();
+  }
+
+  static std::shared_ptr<LoadedModel> loadModel(const ModelSpec& spec) {
+    TPUV7_TRACE_SCOPE("loadModel");
+    // the current device is per thread
+    if (tpuRtSetDevice(spec.device) != tpuRtSuccess) {
+      std::cerr << "model " << spec.name << ": no device " << spec.device
+                << std::endl;
+      return nullptr;
+    }
+    auto model = std::make_shared<LoadedModel>();
+    model->spec = spec;
+    auto begin = std::chrono::steady_clock::now();
+    model->context = std::make_shared<BMNNContext>(spec.path.c_str(),
+                                                   spec.device);
+    if (!model->context->loaded()) return nullptr;
+    model->networks = model->context->networkPool(spec.instances,
+                                                  spec.max_users, spec.verbose);
+    model->load_ms = msSince(begin);
+
+    begin = std::chrono::steady_clock::now();
+    tpuRtStatus_t ret = model->networks->warmup(spec.warmup);
+    if (ret != tpuRtSuccess) {
+      std::cerr << "model " << spec.name << ": warmup failed (" << ret << ")"
+                << std::endl;
+      return nullptr;
+    }
+    model->warmup_ms = msSince(begin);
+    return model;
+  }
+
+  std::mutex m_mutex;
+  std::map<std::string, std::shared_ptr<LoadedModel>> m_models;
+};
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef NMS_H_
+#define NMS_H_
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#include "yolov5_decoder.h"
+
+struct NMSParams {
+  float iou_threshold = 0.5f;
+  // candidates kept per class before suppression, 0 keeps all
+  int top_k = 0;
+  // detections kept over all classes after suppression, 0 keeps all
+  int max_det = 0;
+  // suppress across classes instead of per class
+  bool agnostic = false;
+};
+
+/*
+ * Greedy NMS over class buckets. Each bucket is sorted by descending score and
+ * laid out as structure of arrays, the IoU of a kept box is computed against a
+ * whole block of later boxes at once, and suppression only sets bits, so no
+ * element is ever moved. Buffers are reused between calls.
+ */
+class NMSEngine {
+ public:
+  explicit NMSEngine(const NMSParams& params = NMSParams())
+      : m_params(params) {}
+
+  const NMSParams& params() const { return m_params; }
+
+  // Keep the surviving boxes of `dets`, ordered by descending score.
+  void run(YoloV5BoxVec& dets) {
+    bucketByClass(dets);
+    m_kept.clear();
+    for (size_t c = 0; c + 1 < m_offsets.size(); ++c) {
+      int begin = m_offsets[c];
+      int end = m_offsets[c + 1];
+      if (begin == end) continue;
+      suppressBucket(dets, begin, end);
+    }
+
+    // merge the buckets, ties keep decode order
+    std::sort(m_kept.begin(), m_kept.end(), [&](int a, int b) {
+      if (dets[a].score != dets[b].score) return dets[a].score > dets[b].score;
+      return a < b;
+    });
+    if (m_params.max_det > 0 && (int)m_kept.size() > m_params.max_det) {
+      m_kept.resize(m_params.max_det);
+    }
+    m_result.clear();
+    for (int k : m_kept) m_result.push_back(dets[k]);
+    dets.swap(m_result);
+  }
+
+ private:
+  // Fill m_order with the indices of `dets` grouped by class, m_offsets[c]
+  // being the start of class c.
+  void bucketByClass(const YoloV5BoxVec& dets) {
+    int class_num = 1;
+    if (!m_params.agnostic) {
+      for (auto& det : dets) class_num = std::max(class_num, det.class_id + 1);
+    }
+    m_offsets.assign(class_num + 1, 0);
+    for (auto& det : dets) {
+      m_offsets[(m_params.agnostic ? 0 : det.class_id) + 1]++;
+    }
+    for (int c = 0; c < class_num; ++c) m_offsets[c + 1] += m_offsets[c];
+    m_order.resize(dets.size());
+    m_cursor.assign(m_offsets.begin(), m_offsets.end() - 1);
+    for (int i = 0; i < (int)dets.size(); ++i) {
+      m_order[m_cursor[m_params.agnostic ? 0 : dets[i].class_id]++] = i;
+    }
+  }
+
+  void suppressBucket(const YoloV5BoxVec& dets, int begin, int end) {
+    int* order = m_order.data() + begin;
+    std::sort(order, order + (end - begin), [&](int a, int b) {
+      if (dets[a].score != dets[b].score) return dets[a].score > dets[b].score;
+      return a < b;
+    });
+    int n = end - begin;
+    if (m_params.top_k > 0 && n > m_params.top_k) n = m_params.top_k;
+
+    // pad to a whole SIMD block so the IoU loop never needs a tail
+    int padded = (n + 15) & ~15;
+    m_x1.resize(padded);
+    m_y1.resize(padded);
+    m_x2.resize(padded);
+    m_y2.resize(padded);
+    m_area.resize(padded);
+    for (int i = 0; i < n; ++i) {
+      const YoloV5Box& box = dets[order[i]];
+      m_x1[i] = box.x;
+      m_y1[i] = box.y;
+      m_x2[i] = box.x + box.width;
+      m_y2[i] = box.y + box.height;
+      m_area[i] = box.width * box.height;
+    }
+    for (int i = n; i < padded; ++i) {
+      m_x1[i] = m_y1[i] = m_x2[i] = m_y2[i] = m_area[i] = 0;
+    }
+    m_suppressed.assign((padded + 63) / 64, 0);
+
+    // a single bucket never contributes more than max_det detections
+    int kept = 0;
+    for (int i = 0; i < n; ++i) {
+      if (m_suppressed[i >> 6] >> (i & 63) & 1) continue;
+      m_kept.push_back(order[i]);
+      if (++kept == m_params.max_det) break;
+      suppressAgainst(i, n);
+    }
+  }
+
+  // Set the suppressed bit of every box after `i` whose IoU with box `i` is
+  // above the threshold.
+  void suppressAgainst(int i, int n) {
+    const float thresh = m_params.iou_threshold;
+    const float bx1 = m_x1[i], by1 = m_y1[i], bx2 = m_x2[i], by2 = m_y2[i];
+    const float barea = m_area[i];
+#if defined(__AVX512F__)
+    int j = (i + 1) & ~15;
+    const __m512 vx1 = _mm512_set1_ps(bx1), vy1 = _mm512_set1_ps(by1);
+    const __m512 vx2 = _mm512_set1_ps(bx2), vy2 = _mm512_set1_ps(by2);
+    const __m512 varea = _mm512_set1_ps(barea);
+    const __m512 vthresh = _mm512_set1_ps(thresh);
+    const __m512 zero = _mm512_setzero_ps();
+    for (; j < n; j += 16) {
+      __m512 w = _mm512_max_ps(
+          zero, _mm512_sub_ps(_mm512_min_ps(vx2, _mm512_loadu_ps(&m_x2[j])),
+                              _mm512_max_ps(vx1, _mm512_loadu_ps(&m_x1[j]))));
+      __m512 h = _mm512_max_ps(
+          zero, _mm512_sub_ps(_mm512_min_ps(vy2, _mm512_loadu_ps(&m_y2[j])),
+                              _mm512_max_ps(vy1, _mm512_loadu_ps(&m_y1[j]))));
+      __m512 overlap = _mm512_mul_ps(w, h);
+      __m512 uni = _mm512_sub_ps(
+          _mm512_add_ps(varea, _mm512_loadu_ps(&m_area[j])), overlap);
+      uint64_t mask = _mm512_cmp_ps_mask(_mm512_div_ps(overlap, uni), vthresh,
+                                         _CMP_GT_OQ);
+      setBits(j, mask, i, n);
+    }
+#elif defined(__AVX2__)
+    int j = (i + 1) & ~7;
+    const __m256 vx1 = _mm256_set1_ps(bx1), vy1 = _mm256_set1_ps(by1);
+    const __m256 vx2 = _mm256_set1_ps(bx2), vy2 = _mm256_set1_ps(by2);
+    const __m256 varea = _mm256_set1_ps(barea);
+    const __m256 vthresh = _mm256_set1_ps(thresh);
+    const __m256 zero = _mm256_setzero_ps();
+    for (; j < n; j += 8) {
+      __m256 w = _mm256_max_ps(
+          zero, _mm256_sub_ps(_mm256_min_ps(vx2, _mm256_loadu_ps(&m_x2[j])),
+                              _mm256_max_ps(vx1, _mm256_loadu_ps(&m_x1[j]))));
+      __m256 h = _mm256_max_ps(
+          zero, _mm256_sub_ps(_mm256_min_ps(vy2, _mm256_loadu_ps(&m_y2[j])),
+                              _mm256_max_ps(vy1, _mm256_loadu_ps(&m_y1[j]))));
+      __m256 overlap = _mm256_mul_ps(w, h);
+      __m256 uni = _mm256_sub_ps(
+          _mm256_add_ps(varea, _mm256_loadu_ps(&m_area[j])), overlap);
+      uint64_t mask = _mm256_movemask_ps(
+          _mm256_cmp_ps(_mm256_div_ps(overlap, uni), vthresh, _CMP_GT_OQ));
+      setBits(j, mask, i, n);
+    }
+#else
+    for (int j = i + 1; j < n; ++j) {
+      float w = std::max(0.0f, std::min(bx2, m_x2[j]) - std::max(bx1, m_x1[j]));
+      float h = std::max(0.0f, std::min(by2, m_y2[j]) - std::max(by1, m_y1[j]));
+      float overlap = w * h;
+      if (overlap / (barea + m_area[j] - overlap) > thresh) {
+        m_suppressed[j >> 6] |= 1ull << (j & 63);
+      }
+    }
+#endif
+  }
+
+  // Merge the IoU mask of the block starting at `j` into the suppressed bits,
+  // ignoring boxes at or before `i` and the padding at or after `n`.
+  void setBits(int j, uint64_t mask, int i, int n) {
+    if (j <= i) mask &= ~0ull << (i - j + 1);
+    if (n - j < 16) mask &= (1ull << (n - j)) - 1;
+    m_suppressed[j >> 6] |= mask << (j & 63);
+  }
+
+  NMSParams m_params;
+  std::vector<int> m_offsets;
+  std::vector<int> m_cursor;
+  std::vector<int> m_order;
+  std::vector<int> m_kept;
+  std::vector<float> m_x1, m_y1, m_x2, m_y2, m_area;
+  std::vector<uint64_t> m_suppressed;
+  YoloV5BoxVec m_result;
+};
+
+#endif
@@ -0,0 +1,143 @@
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <tuple>
+#include <vector>
+
+#include "nms.h"
+
+/*
+ * Benchmark of NMSEngine against the erase-based NMS it replaced in
+ * post_process.cc, at 100, 1k and 10k candidates. The old NMS separated
+ * classes by shifting boxes with class_id * max_wh, so it gets the shifted
+ * copy; both must keep the same boxes.
+ */
+
+static void legacyNMS(YoloV5BoxVec& dets, float nmsConfidence) {
+  int length = dets.size();
+  int index = length - 1;
+
+  std::sort(
+      dets.begin(), dets.end(),
+      [](const YoloV5Box& a, const YoloV5Box& b) { return a.score < b.score; });
+
+  std::vector<float> areas(length);
+  for (int i = 0; i < length; i++) {
+    areas[i] = dets[i].width * dets[i].height;
+  }
+
+  while (index > 0) {
+    int i = 0;
+    while (i < index) {
+      float left = std::max(dets[index].x, dets[i].x);
+      float top = std::max(dets[index].y, dets[i].y);
+      float right = std::min(dets[index].x + dets[index].width,
+                             dets[i].x + dets[i].width);
+      float bottom = std::min(dets[index].y + dets[index].height,
+                              dets[i].y + dets[i].height);
+      float overlap =
+          std::max(0.0f, right - left) * std::max(0.0f, bottom - top);
+      if (overlap / (areas[index] + areas[i] - overlap) > nmsConfidence) {
+        areas.erase(areas.begin() + i);
+        dets.erase(dets.begin() + i);
+        index--;
+      } else {
+        i++;
+      }
+    }
+    index--;
+  }
+}
+
+static void sortForCompare(YoloV5BoxVec& boxes) {
+  std::sort(boxes.begin(), boxes.end(),
+            [](const YoloV5Box& a, const YoloV5Box& b) {
+              return std::tie(a.score, a.class_id, a.x, a.y) >
+                     std::tie(b.score, b.class_id, b.x, b.y);
+            });
+}
+
+static bool sameBoxes(YoloV5BoxVec a, YoloV5BoxVec b) {
+  if (a.size() != b.size()) return false;
+  sortForCompare(a);
+  sortForCompare(b);
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (a[i].x != b[i].x || a[i].y != b[i].y || a[i].width != b[i].width ||
+        a[i].height != b[i].height || a[i].score != b[i].score ||
+        a[i].class_id != b[i].class_id)
+      return false;
+  }
+  return true;
+}
+
+// Candidates clustered around a few objects, like decoder output.
+static YoloV5BoxVec makeCandidates(int num, std::mt19937& rng) {
+  std::uniform_int_distribution<int> pos(0, 600), size(10, 200);
+  std::uniform_int_distribution<int> jitter(-8, 8), cls(0, 9);
+  std::uniform_real_distribution<float> score(0.25f, 1.0f);
+  int objects = std::max(1, num / 20);
+  std::vector<YoloV5Box> centers(objects);
+  for (auto& c : centers) {
+    c.x = pos(rng);
+    c.y = pos(rng);
+    c.width = size(rng);
+    c.height = size(rng);
+    c.class_id = cls(rng);
+  }
+  YoloV5BoxVec boxes(num);
+  for (int i = 0; i < num; ++i) {
+    const YoloV5Box& c = centers[i % objects];
+    boxes[i].x = std::max(0, c.x + jitter(rng));
+    boxes[i].y = std::max(0, c.y + jitter(rng));
+    boxes[i].width = std::max(1, c.width + jitter(rng));
+    boxes[i].height = std::max(1, c.height + jitter(rng));
+    boxes[i].class_id = c.class_id;
+    boxes[i].score = score(rng);
+  }
+  return boxes;
+}
+
+int main() {
+  const int max_wh = 7680;
+  std::mt19937 rng(1234);
+  bool ok = true;
+  for (int num : {100, 1000, 10000}) {
+    YoloV5BoxVec candidates = makeCandidates(num, rng);
+    YoloV5BoxVec shifted = candidates;
+    for (auto& box : shifted) {
+      box.x += box.class_id * max_wh;
+      box.y += box.class_id * max_wh;
+    }
+    int iters = std::max(1, 200000 / num);
+    NMSEngine engine;
+
+    YoloV5BoxVec ref, out;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iters; ++i) {
+      ref = shifted;
+      legacyNMS(ref, 0.5);
+    }
+    auto mid = std::chrono::steady_clock::now();
+    for (int i = 0; i < iters; ++i) {
+      out = candidates;
+      engine.run(out);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    for (auto& box : ref) {
+      box.x -= box.class_id * max_wh;
+      box.y -= box.class_id * max_wh;
+    }
+    bool same = sameBoxes(ref, out);
+    ok = ok && same;
+    double legacy_us =
+        std::chrono::duration<double, std::micro>(mid - start).count() / iters;
+    double engine_us =
+        std::chrono::duration<double, std::micro>(end - mid).count() / iters;
+    std::cout << "candidates=" << num << " kept=" << out.size()
+              << " identical=" << (same ? "yes" : "NO")
+              << " legacy=" << legacy_us << "us engine=" << engine_us
+              << "us speedup=" << legacy_us / engine_us << "x" << std::endl;
+  }
+  return ok ? 0 : 1;
+}
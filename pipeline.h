@@ -0,0 +1,222 @@
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "bounded_queue.h"
+#include "tpu_utils.h"
+
+struct PipelineConfig {
+  // sets of device I/O, i.e. frames between upload and post process
+  int inflight = 2;
+  // compiled stage every frame runs, its batch is the frames per submit()
+  int stage_idx = 0;
+};
+
+/*
+ * Inference pipeline on top of BMNNNetwork::forwardAsync. Every frame goes
+ * through four stages, each on its own thread and connected by bounded
+ * queues:
+ *
+ *   upload (H2D) -> launch -> read back (D2H) -> post process (callback)
+ *
+ * A frame holds one of `inflight` I/O sets, each with its own stream, device
+ * buffers and host staging, from upload until its callback returns, so the
+ * device runs frame n + 1 while the host post processes frame n.
+ */
+class InferencePipeline : public NoCopyable {
+ public:
+  // Called on the post process thread, in submission order. get_host_data()
+  // on an output waits for that output only, and host data is only valid
+  // during the call.
+  using Callback = std::function<void(
+      uint64_t frame_id, tpuRtStatus_t status,
+      std::vector<std::shared_ptr<BMNNTensor>>& outputs)>;
+
+  InferencePipeline(std::shared_ptr<BMNNContext> context,
+                    std::shared_ptr<BMNNNetwork> network, Callback callback,
+                    const PipelineConfig& config = PipelineConfig())
+      : m_network(network),
+        m_callback(callback),
+        m_free(config.inflight),
+        m_upload(config.inflight),
+        m_launch(config.inflight),
+        m_readback(config.inflight),
+        m_post(config.inflight) {
+    const tpuRtNetInfo_t& info = network->getNetInfo();
+    auto pool = context->memoryPool();
+    for (int s = 0; s < config.inflight; ++s) {
+      std::unique_ptr<IOSet> set(new IOSet());
+      tpuRtStreamCreate(&set->stream);
+      std::vector<void*> input_data, output_data;
+      std::vector<tensorSizeType> output_sizes;
+      for (int i = 0; i < info.input.num; ++i) {
+        tpuRtTensor_t tensor = *network->inputTpuRtTensor(i, config.stage_idx);
+        set->buffers.push_back(pool->acquire(getTensorBytes(tensor)));
+        ASSERT(set->buffers.back());
+        input_data.push_back(set->buffers.back().data());
+      }
+      for (int i = 0; i < info.output.num; ++i) {
+        tpuRtTensor_t tensor =
+            *network->outputTpuRtTensor(i, config.stage_idx);
+        output_sizes.push_back(getTensorBytes(tensor));
+        set->buffers.push_back(pool->acquire(output_sizes.back()));
+        ASSERT(set->buffers.back());
+        output_data.push_back(set->buffers.back().data());
+      }
+      set->binding.reset(new BMNNIOBinding(
+          network->createBinding(input_data, output_data, config.stage_idx)));
+      set->staging.reset(new HostStagingArena(output_sizes, set->stream));
+      m_free.push(set.get());
+      m_sets.push_back(std::move(set));
+    }
+    m_threads.emplace_back([this] { uploadLoop(); });
+    m_threads.emplace_back([this] { launchLoop(); });
+    m_threads.emplace_back([this] { readbackLoop(); });
+    m_threads.emplace_back([this] { postLoop(); });
+  }
+
+  ~InferencePipeline() {
+    m_upload.close();
+    for (auto& thread : m_threads) thread.join();
+    for (auto& set : m_sets) {
+      set->staging.reset();
+      tpuRtStreamDestroy(set->stream);
+    }
+  }
+
+  // Queue a frame, one host pointer per network input. Blocks while the
+  // pipeline is full. The input memory must stay valid until the callback of
+  // the frame returns. Ids follow the order frames enter the pipeline, also
+  // with several submitting threads.
+  uint64_t submit(const std::vector<const void*>& inputs) {
+    Frame frame;
+    frame.inputs = inputs;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_pending++;
+    }
+    // not m_mutex, the post process thread takes it to free a slot
+    std::lock_guard<std::mutex> lock(m_submit_mutex);
+    frame.id = m_next_id++;
+    uint64_t id = frame.id;
+    m_upload.push(std::move(frame));
+    return id;
+  }
+
+  // Wait for the callback of every frame submitted so far.
+  void flush() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_idle.wait(lock, [this] { return m_pending == 0; });
+  }
+
+ private:
+  struct IOSet {
+    tpuRtStream_t stream;
+    std::vector<DeviceBuffer> buffers;
+    std::unique_ptr<BMNNIOBinding> binding;
+    std::unique_ptr<HostStagingArena> staging;
+  };
+
+  struct Frame {
+    uint64_t id = 0;
+    std::vector<const void*> inputs;
+    IOSet* set = nullptr;
+    tpuRtStatus_t status = tpuRtSuccess;
+    std::vector<std::shared_ptr<BMNNTensor>> outputs;
+  };
+
+  void uploadLoop() {
+    TPUV7_TRACE_THREAD_NAME("pipeline upload");
+    Frame frame;
+    while (m_upload.pop(frame)) {
+      m_free.pop(frame.set);
+      IOSet* set = frame.set;
+      for (int i = 0; i < set->binding->inputNum(); ++i) {
+        const tpuRtTensor_t* input = set->binding->input(i);
+        TPUV7_TRACE_SCOPE("tpuRtMemcpyS2DAsync");
+        tpuRtStatus_t ret = tpuRtMemcpyS2DAsync(
+            input->data, frame.inputs[i], getTensorBytes(*input), set->stream);
+        if (ret != tpuRtSuccess) frame.status = ret;
+      }
+      m_launch.push(std::move(frame));
+    }
+    m_launch.close();
+  }
+
+  void launchLoop() {
+    TPUV7_TRACE_THREAD_NAME("pipeline launch");
+    Frame frame;
+    while (m_launch.pop(frame)) {
+      if (frame.status == tpuRtSuccess) {
+        frame.status =
+            m_network->forwardAsync(*frame.set->binding, frame.set->stream);
+      }
+      m_readback.push(std::move(frame));
+    }
+    m_readback.close();
+  }
+
+  void readbackLoop() {
+    TPUV7_TRACE_THREAD_NAME("pipeline readback");
+    const tpuRtNetInfo_t& info = m_network->getNetInfo();
+    Frame frame;
+    while (m_readback.pop(frame)) {
+      IOSet* set = frame.set;
+      for (int i = 0; i < info.output.num; ++i) {
+        frame.outputs.push_back(std::make_shared<BMNNTensor>(
+            info.output.names[i], info.output.scales[i],
+            set->binding->output(i), &set->stream, set->staging->slot(i),
+            info.output.zero_points[i]));
+        if (frame.status == tpuRtSuccess) frame.outputs[i]->start_host_copy();
+      }
+      m_post.push(std::move(frame));
+    }
+    m_post.close();
+  }
+
+  void postLoop() {
+    TPUV7_TRACE_THREAD_NAME("pipeline post");
+    Frame frame;
+    while (m_post.pop(frame)) {
+      {
+        TPUV7_TRACE_SCOPE("pipeline callback");
+        m_callback(frame.id, frame.status, frame.outputs);
+      }
+      // the set is reused by the next upload, and the caller may reuse the
+      // input memory, once everything queued for this frame is done
+      tpuRtStreamSynchronize(frame.set->stream);
+      frame.outputs.clear();
+      m_free.push(frame.set);
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending--;
+      }
+      m_idle.notify_all();
+    }
+  }
+
+  std::shared_ptr<BMNNNetwork> m_network;
+  Callback m_callback;
+  std::vector<std::unique_ptr<IOSet>> m_sets;
+  BoundedQueue<IOSet*> m_free;
+  BoundedQueue<Frame> m_upload;
+  BoundedQueue<Frame> m_launch;
+  BoundedQueue<Frame> m_readback;
+  BoundedQueue<Frame> m_post;
+  std::vector<std::thread> m_threads;
+  std::mutex m_submit_mutex;
+  uint64_t m_next_id = 0;
+  std::mutex m_mutex;
+  std::condition_variable m_idle;
+  uint64_t m_pending = 0;
+};
+
+#endif
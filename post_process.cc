@@ -4,13 +4,13 @@
 #include <memory>
 #include <vector>
 
+#include "detection_batch.h"
+#include "nms.h"
+#include "preprocess.h"
+#include "thread_pool.h"
 #include "tpu_utils.h"
-
-struct YoloV5Box {
-  int x, y, width, height;
-  float score;
-  int class_id;
-};
+#include "tracker.h"
+#include "yolov5_decoder.h"
 
 template <class T>
 struct Point {
@@ -51,59 +51,6 @@ struct Rectangle {
   T mHeight;
 };
 
-using YoloV5BoxVec = std::vector<YoloV5Box>;
-
-void NMS(YoloV5BoxVec& dets, float nmsConfidence) {
-  int length = dets.size();
-  int index = length - 1;
-
-  std::sort(
-      dets.begin(), dets.end(),
-      [](const YoloV5Box& a, const YoloV5Box& b) { return a.score < b.score; });
-
-  std::vector<float> areas(length);
-  for (int i = 0; i < length; i++) {
-    areas[i] = dets[i].width * dets[i].height;
-  }
-
-  while (index > 0) {
-    int i = 0;
-    while (i < index) {
-      float left = std::max(dets[index].x, dets[i].x);
-      float top = std::max(dets[index].y, dets[i].y);
-      float right = std::min(dets[index].x + dets[index].width,
-                             dets[i].x + dets[i].width);
-      float bottom = std::min(dets[index].y + dets[index].height,
-                              dets[i].y + dets[i].height);
-      float overlap =
-          std::max(0.0f, right - left) * std::max(0.0f, bottom - top);
-      if (overlap / (areas[index] + areas[i] - overlap) > nmsConfidence) {
-        areas.erase(areas.begin() + i);
-        dets.erase(dets.begin() + i);
-        index--;
-      } else {
-        i++;
-      }
-    }
-    index--;
-  }
-}
-
-float get_aspect_scaled_ratio(int src_w, int src_h, int dst_w, int dst_h,
-                              bool* pIsAligWidth) {
-  float ratio;
-  float r_w = (float)dst_w / src_w;
-  float r_h = (float)dst_h / src_h;
-  if (r_h > r_w) {
-    *pIsAligWidth = true;
-    ratio = r_w;
-  } else {
-    *pIsAligWidth = false;
-    ratio = r_h;
-  }
-  return ratio;
-}
-
 int argmax(float* data, int num) {
   float max_value = 0.0;
   int max_index = 0;
@@ -118,8 +65,6 @@ int argmax(float* data, int num) {
   return max_index;
 }
 
-float sigmoid(float x) { return 1.0 / (1 + expf(-x)); }
-
 struct PointMetadata {
   int getLabel() const {
     if (mTopKLabels.empty()) {
@@ -144,7 +89,8 @@ struct PointMetadata {
 };
 
 struct DetectedObjectMetadata {
-  DetectedObjectMetadata() : mClassify(-1), mTrackIouThreshold(0.f) {}
+  DetectedObjectMetadata()
+      : mClassify(-1), mTrackIouThreshold(0.f), mTrackId(-1) {}
 
   int getLabel() const {
     if (mTopKLabels.empty()) {
@@ -173,173 +119,415 @@ struct DetectedObjectMetadata {
   int mClassify;
   std::string mClassifyName;
   float mTrackIouThreshold;
+  // set by trackObjects(), -1 when untracked
+  int mTrackId;
   std::vector<std::shared_ptr<PointMetadata>> mKeyPoints;
 };
 
-std::vector<std::shared_ptr<DetectedObjectMetadata>> postProcessCPU(
-    char** outBuffers,
-    std::vector<std::shared_ptr<BMNNTensor>> outputBMNNTensors) {
-  YoloV5BoxVec yolobox_vec;
-  int idx = 0;
-  yolobox_vec.clear();
-  int frame_width = 1920;
-  int frame_height = 1080;
-
-  int tx1 = 0, ty1 = 0;
-  bool isAlignWidth = false;
-  float ratio = get_aspect_scaled_ratio(frame_width, frame_height, 640, 640,
-                                        &isAlignWidth);
-  if (isAlignWidth) {
-    ty1 = (int)((640 - (int)((frame_height)*ratio)) / 2);
-  } else {
-    tx1 = (int)((640 - (int)((frame_width)*ratio)) / 2);
+YoloV5Decoder& threadDecoder(int net_w, int net_h) {
+  static thread_local YoloV5Decoder decoder;
+  if (decoder.params().net_w != net_w || decoder.params().net_h != net_h) {
+    YoloV5DecodeParams params;
+    params.net_w = net_w;
+    params.net_h = net_h;
+    decoder = YoloV5Decoder(params);
+  }
+  return decoder;
+}
+
+/*
+ * Candidate buffers of the tiles of one frame decoded in parallel, one per
+ * tile so their merge order does not depend on the scheduling. Kept by the
+ * calling thread, so nothing is allocated once they have grown.
+ */
+struct TileBuffers {
+  std::vector<YoloV5Tile> tiles;
+  std::vector<YoloV5BoxVec> boxes;
+  std::vector<std::vector<int>> cells;
+};
+
+/*
+ * decoder.decode() with the head, anchor and cell range tiles spread over
+ * `pool`, which must not be the pool running the caller. The tile buffers
+ * are appended to `boxes` in tile order, the order of decode().
+ */
+void decodeParallel(YoloV5Decoder& decoder,
+                    const std::vector<YoloV5Head>& heads,
+                    const std::vector<const tpuRtShape_t*>& shapes,
+                    ThreadPool& pool, YoloV5BoxVec& boxes) {
+  static thread_local TileBuffers thread_buffers;
+  TileBuffers& buffers = thread_buffers;  // the workers use the caller's
+  decoder.tiles(shapes, buffers.tiles);
+  int tile_num = buffers.tiles.size();
+  if ((int)buffers.boxes.size() < tile_num) {
+    buffers.boxes.resize(tile_num);
+    buffers.cells.resize(tile_num);
+  }
+  int tile_cells = decoder.params().tile_cells;
+  pool.parallelFor(tile_num, [&](int t) {
+    std::vector<int>& cells = buffers.cells[t];
+    if ((int)cells.size() < tile_cells) cells.resize(tile_cells);
+    buffers.boxes[t].clear();
+    decoder.decodeTile(buffers.tiles[t], heads, shapes, cells.data(),
+                       buffers.boxes[t]);
+  });
+  size_t total = boxes.size();
+  for (int t = 0; t < tile_num; ++t) total += buffers.boxes[t].size();
+  boxes.reserve(total);
+  for (int t = 0; t < tile_num; ++t) {
+    boxes.insert(boxes.end(), buffers.boxes[t].begin(),
+                 buffers.boxes[t].end());
   }
-  int min_idx = 0;
-  int box_num = 0;
-  int min_dim = 9999;
-  for (int i = 0; i < 3; ++i) {
-    auto output_shape = outputBMNNTensors[i]->get_shape();
-    auto output_dims = output_shape->num_dims;
-    if (output_dims == 5) {
-      box_num +=
-          output_shape->dims[1] * output_shape->dims[2] * output_shape->dims[3];
+}
+
+// Candidate buffer of the calling thread, empty, its capacity kept.
+YoloV5BoxVec& threadCandidates() {
+  static thread_local YoloV5BoxVec candidates;
+  candidates.clear();
+  return candidates;
+}
+
+// DetectedObjectMetadata of the detections of `view`, for the callers that
+// still want them.
+std::vector<std::shared_ptr<DetectedObjectMetadata>> toDetectedObjects(
+    const DetectionView& view) {
+  std::vector<std::shared_ptr<DetectedObjectMetadata>> detDatas;
+  detDatas.reserve(view.size());
+  for (size_t i = 0; i < view.size(); ++i) {
+    std::shared_ptr<DetectedObjectMetadata> detData =
+        std::make_shared<DetectedObjectMetadata>();
+    detData->mBox.mX = view.x()[i];
+    detData->mBox.mY = view.y()[i];
+    detData->mBox.mWidth = view.width()[i];
+    detData->mBox.mHeight = view.height()[i];
+    detData->mScores.push_back(view.score()[i]);
+    detData->mClassify = view.classId()[i];
+    for (int k = 0; k < view.keypointNum(); ++k) {
+      const float* kp = view.keypoints(i) + k * 3;
+      auto point = std::make_shared<PointMetadata>();
+      point->mPoint = Point<int>(kp[0], kp[1]);
+      point->mScores.push_back(kp[2]);
+      detData->mKeyPoints.push_back(point);
     }
+    detDatas.push_back(detData);
+  }
+  return detDatas;
+}
+
+// Track `objects`, the next frame of stream `stream_idx`, and write their
+// track ids to mTrackId. An object's mTrackIouThreshold, when set, replaces
+// the IoU threshold of the tracker for it.
+void trackObjects(
+    MultiStreamTracker& tracker, int stream_idx,
+    std::vector<std::shared_ptr<DetectedObjectMetadata>>& objects) {
+  static thread_local DetectionBatch batch;
+  static thread_local std::vector<float> thresholds;
+  static thread_local std::vector<int> ids;
+  batch.reset();
+  thresholds.clear();
+  for (auto& object : objects) {
+    batch.push(Detection{object->mBox.mX, object->mBox.mY,
+                         object->mBox.mWidth, object->mBox.mHeight,
+                         object->mScores.empty() ? 0.f : object->mScores[0],
+                         object->mClassify});
+    thresholds.push_back(object->mTrackIouThreshold);
+  }
+  ids.resize(objects.size());
+  tracker.update(stream_idx, batch.view(), ids.data(), thresholds.data());
+  for (size_t i = 0; i < objects.size(); ++i) objects[i]->mTrackId = ids[i];
+}
+
+/*
+ * NMS the decoded candidates of one image, map them back to its frame and
+ * append them to `out`.
+ */
+void finishFrame(YoloV5BoxVec& yolobox_vec, const FrameGeometry& geometry,
+                 DetectionBatch& out) {
+  int frame_width = geometry.frame_width;
+  int frame_height = geometry.frame_height;
+  float ratio = geometry.ratio;
+  int tx1 = geometry.tx1, ty1 = geometry.ty1;
+
+  static thread_local NMSEngine nms;
+  {
+    TPUV7_TRACE_SCOPE("nms");
+    nms.run(yolobox_vec);
+  }
+
+  for (auto& box : yolobox_vec) {
+    box.x = (box.x - tx1) / ratio;
+    if (box.x < 0) box.x = 0;
+    box.y = (box.y - ty1) / ratio;
+    if (box.y < 0) box.y = 0;
+    box.width = (box.width) / ratio;
+    if (box.x + box.width >= frame_width) box.width = frame_width - box.x;
+    box.height = (box.height) / ratio;
+    if (box.y + box.height >= frame_height) box.height = frame_height - box.y;
+  }
+  out.reserve(out.size() + yolobox_vec.size());
+  for (const auto& box : yolobox_vec) {
+    out.push(Detection{box.x, box.y, box.width, box.height, box.score,
+                       box.class_id});
+  }
+}
 
-    if (min_dim > output_dims) {
-      min_idx = i;
-      min_dim = output_dims;
+std::vector<std::shared_ptr<DetectedObjectMetadata>> finishFrame(
+    YoloV5BoxVec& yolobox_vec, const FrameGeometry& geometry) {
+  static thread_local DetectionBatch batch;
+  batch.reset();
+  finishFrame(yolobox_vec, geometry, batch);
+  return toDetectedObjects(batch.view());
+}
+
+// Whether YoloV5Decoder reads these outputs of a net_w x net_h model: 5-D
+// heads it has anchors for, or a pre-decoded [1, N, 5 + class] output beside
+// which the others are ignored.
+bool allHeadsDecodable(const std::vector<const tpuRtShape_t*>& shapes,
+                       int net_w, int net_h) {
+  if (YoloV5Decoder::rowOutput(shapes) >= 0) return true;
+  for (auto shape : shapes) {
+    if (shape->num_dims != 5) return false;
+  }
+  if (threadDecoder(net_w, net_h).hasAnchors(shapes)) return true;
+  static thread_local bool reported = false;
+  if (!reported) {
+    std::cerr << "no anchors for these " << shapes.size()
+              << " yolov5 heads, add a YoloV5Spec; they are not decoded"
+              << std::endl;
+    reported = true;
+  }
+  return false;
+}
+
+bool allHeadsDecodable(const std::vector<const tpuRtShape_t*>& shapes,
+                       const std::vector<YoloV5Head>& heads, int net_w,
+                       int net_h) {
+  int row = YoloV5Decoder::rowOutput(shapes);
+  if (row >= 0) return YoloV5Decoder::supports(heads[row].dtype);
+  for (auto& head : heads) {
+    if (!YoloV5Decoder::supports(head.dtype)) return false;
+  }
+  return allHeadsDecodable(shapes, net_w, net_h);
+}
+
+// Head of `tensor`, read in its own dtype from `data`, its host copy by
+// default.
+YoloV5Head tensorHead(BMNNTensor& tensor, const char* data = nullptr) {
+  YoloV5Head head;
+  head.data = data ? data : tensor.get_host_data();
+  head.dtype = tensor.get_dtype();
+  head.scale = tensor.get_scale();
+  head.zero_point = tensor.get_zero_point();
+  return head;
+}
+
+/*
+ * Decode, NMS and map back to the source frame the heads of one image, into
+ * `out`, which is reset first. Nothing is allocated once the thread buffers
+ * and `out` have grown to the largest frame. With a `pool`, the decode of
+ * the frame is split over it, with the same results.
+ */
+void postProcessFrame(const std::vector<YoloV5Head>& heads,
+                      const std::vector<const tpuRtShape_t*>& shapes,
+                      int net_w, int net_h, const FrameGeometry& geometry,
+                      DetectionBatch& out, ThreadPool* pool = nullptr) {
+  out.reset();
+  YoloV5BoxVec& yolobox_vec = threadCandidates();
+  if (allHeadsDecodable(shapes, heads, net_w, net_h)) {
+    TPUV7_TRACE_SCOPE("decode");
+    YoloV5Decoder& decoder = threadDecoder(net_w, net_h);
+    if (pool) {
+      decodeParallel(decoder, heads, shapes, *pool, yolobox_vec);
+    } else {
+      decoder.decode(heads, shapes, yolobox_vec);
     }
   }
+  finishFrame(yolobox_vec, geometry, out);
+}
+
+// With a `tracker`, the objects are tracked as the next frame of stream
+// `stream_idx` and carry their track id in mTrackId.
+std::vector<std::shared_ptr<DetectedObjectMetadata>> postProcessFrame(
+    const std::vector<YoloV5Head>& heads,
+    const std::vector<const tpuRtShape_t*>& shapes, int net_w, int net_h,
+    const FrameGeometry& geometry, MultiStreamTracker* tracker = nullptr,
+    int stream_idx = 0) {
+  static thread_local DetectionBatch batch;
+  postProcessFrame(heads, shapes, net_w, net_h, geometry, batch);
+  auto objects = toDetectedObjects(batch.view());
+  if (tracker) trackObjects(*tracker, stream_idx, objects);
+  return objects;
+}
 
-  auto out_tensor = outputBMNNTensors[min_idx];
-  int nout = out_tensor->get_shape()->dims[min_dim - 1];
-  int m_class_num = nout - 5;
-
-  int out_nout = 7;
-  int max_wh = 7680;
-  bool agnostic = false;
-
-  float* output_data = nullptr;
-  std::vector<float> decoded_data;
-
-  if (min_dim == 5) {
-    const std::vector<std::vector<std::vector<int>>> anchors{
-        {{10, 13}, {16, 30}, {33, 23}},
-        {{30, 61}, {62, 45}, {59, 119}},
-        {{116, 90}, {156, 198}, {373, 326}}};
-    const int anchor_num = anchors[0].size();
-    if ((int)decoded_data.size() != box_num * out_nout) {
-      decoded_data.resize(box_num * out_nout);
+/*
+ * Same as postProcessFrame, reading the heads from output tensors whose copy
+ * was queued with BMNNNetwork::startOutputCopies(). Each head is decoded as
+ * soon as its own copy is done, while the later ones are still in flight.
+ */
+void postProcessTensors(
+    std::vector<std::shared_ptr<BMNNTensor>>& outputBMNNTensors, int net_w,
+    int net_h, const FrameGeometry& geometry, DetectionBatch& out) {
+  out.reset();
+  static thread_local std::vector<const tpuRtShape_t*> shapes;
+  shapes.clear();
+  bool supported = true;
+  for (auto& tensor : outputBMNNTensors) {
+    shapes.push_back(tensor->get_shape());
+    supported = supported && YoloV5Decoder::supports(tensor->get_dtype());
+  }
+  YoloV5BoxVec& yolobox_vec = threadCandidates();
+  int row = YoloV5Decoder::rowOutput(shapes);
+  if (row >= 0) {
+    // only the pre-decoded output is waited for
+    BMNNTensor& tensor = *outputBMNNTensors[row];
+    if (YoloV5Decoder::supports(tensor.get_dtype())) {
+      YoloV5Head head = tensorHead(tensor);
+      TPUV7_TRACE_SCOPE("decode");
+      threadDecoder(net_w, net_h).decodeHead(row, head, shapes, yolobox_vec);
     }
-    float* dst = decoded_data.data();
-
-    for (int tidx = 0; tidx < 3; ++tidx) {
-      auto output_tensor = outputBMNNTensors[tidx];
-      int feat_c = output_tensor->get_shape()->dims[1];
-      int feat_h = output_tensor->get_shape()->dims[2];
-      int feat_w = output_tensor->get_shape()->dims[3];
-      int area = feat_h * feat_w;
-      int feature_size = feat_h * feat_w * nout;
-      float* tensor_data = reinterpret_cast<float*>(outBuffers[tidx]);
-
-      for (int anchor_idx = 0; anchor_idx < anchor_num; anchor_idx++) {
-        float* ptr = tensor_data + anchor_idx * feature_size;
-        for (int i = 0; i < area; i++) {
-          if (ptr[4] > 0.5) {
-            dst[0] = (sigmoid(ptr[0]) * 2 - 0.5 + i % feat_w) / feat_w * 640;
-            dst[1] = (sigmoid(ptr[1]) * 2 - 0.5 + i / feat_w) / feat_h * 640;
-            dst[2] = std::pow((sigmoid(ptr[2]) * 2), 2) *
-                     anchors[tidx][anchor_idx][0];
-            dst[3] = std::pow((sigmoid(ptr[3]) * 2), 2) *
-                     anchors[tidx][anchor_idx][1];
-            dst[4] = sigmoid(ptr[4]);
-
-            dst[5] = ptr[5];
-            dst[6] = 5;
-            for (int d = 6; d < nout; d++) {
-              if (ptr[d] > dst[5]) {
-                dst[5] = ptr[d];
-                dst[6] = d;
-              }
-            }
-            dst[6] -= 5;
-            float score = dst[4];
-
-            int class_id = dst[6];
-            float confidence = dst[5];
-            float cur_class_thresh = 0.5;
-            float box_transformed_m_conf_threshold =
-                -std::log(score / cur_class_thresh - 1);
-            if (confidence > box_transformed_m_conf_threshold) {
-              float centerX = dst[0];
-              float centerY = dst[1];
-              float width = dst[2];
-              float height = dst[3];
-
-              YoloV5Box box;
-              if (!agnostic)
-                box.x = centerX - width / 2 + class_id * max_wh;
-              else
-                box.x = centerX - width / 2;
-              if (box.x < 0) box.x = 0;
-              if (!agnostic)
-                box.y = centerY - height / 2 + class_id * max_wh;
-              else
-                box.y = centerY - height / 2;
-              if (box.y < 0) box.y = 0;
-              box.width = width;
-              box.height = height;
-              box.class_id = class_id;
-              confidence = sigmoid(confidence);
-              box.score = confidence * score;
-              yolobox_vec.push_back(box);
-            }
-          }
-          dst += out_nout;
-          ptr += nout;
-        }
-      }
+  } else if (supported && allHeadsDecodable(shapes, net_w, net_h)) {
+    YoloV5Decoder& decoder = threadDecoder(net_w, net_h);
+    for (size_t h = 0; h < outputBMNNTensors.size(); ++h) {
+      YoloV5Head head = tensorHead(*outputBMNNTensors[h]);
+      TPUV7_TRACE_SCOPE("decode");
+      decoder.decodeHead(h, head, shapes, yolobox_vec);
     }
-    output_data = decoded_data.data();
   }
+  finishFrame(yolobox_vec, geometry, out);
+}
 
-  NMS(yolobox_vec, 0.5);
-
-  if (!agnostic)
-    for (auto& box : yolobox_vec) {
-      box.x -= box.class_id * max_wh;
-      box.y -= box.class_id * max_wh;
-      box.x = (box.x - tx1) / ratio;
-      if (box.x < 0) box.x = 0;
-      box.y = (box.y - ty1) / ratio;
-      if (box.y < 0) box.y = 0;
-      box.width = (box.width) / ratio;
-      if (box.x + box.width >= frame_width) box.width = frame_width - box.x;
-      box.height = (box.height) / ratio;
-      if (box.y + box.height >= frame_height) box.height = frame_height - box.y;
+std::vector<std::shared_ptr<DetectedObjectMetadata>> postProcessTensors(
+    std::vector<std::shared_ptr<BMNNTensor>>& outputBMNNTensors, int net_w,
+    int net_h, const FrameGeometry& geometry,
+    MultiStreamTracker* tracker = nullptr, int stream_idx = 0) {
+  static thread_local DetectionBatch batch;
+  postProcessTensors(outputBMNNTensors, net_w, net_h, geometry, batch);
+  auto objects = toDetectedObjects(batch.view());
+  if (tracker) trackObjects(*tracker, stream_idx, objects);
+  return objects;
+}
+
+// Whether `tensors` have the output shapes of stage `stage_idx` of `info`.
+bool stageOutputs(const tpuRtNetInfo_t& info, int stage_idx,
+                  const std::vector<std::shared_ptr<BMNNTensor>>& tensors) {
+  if (stage_idx < 0 || stage_idx >= info.stage_num ||
+      (int)tensors.size() != info.output.num) {
+    return false;
+  }
+  for (int i = 0; i < info.output.num; ++i) {
+    const tpuRtShape_t& shape = *tensors[i]->get_shape();
+    const tpuRtShape_t& stage_shape = info.stages[stage_idx].output_shapes[i];
+    if (shape.num_dims != stage_shape.num_dims ||
+        !std::equal(shape.dims, shape.dims + shape.num_dims,
+                    stage_shape.dims)) {
+      return false;
     }
-  else
-    for (auto& box : yolobox_vec) {
-      box.x = (box.x - tx1) / ratio;
-      if (box.x < 0) box.x = 0;
-      box.y = (box.y - ty1) / ratio;
-      if (box.y < 0) box.y = 0;
-      box.width = (box.width) / ratio;
-      if (box.x + box.width >= frame_width) box.width = frame_width - box.x;
-      box.height = (box.height) / ratio;
-      if (box.y + box.height >= frame_height) box.height = frame_height - box.y;
+  }
+  return true;
+}
+
+/*
+ * Post process an N-batch output of `network`. outBuffers hold the host copy
+ * of every output in its own dtype, frame after frame, and frames[i]
+ * describes image i, whose detections go to results[i]. The batch size and,
+ * unless `stage_idx` names it, the stage that ran come from the output
+ * shapes; the input size of that stage scales the boxes. With a `pool`,
+ * frames are decoded in parallel on it, and a single frame is split into
+ * tiles instead. Reusing `results` from batch to batch keeps their memory.
+ */
+void postProcessBatch(
+    BMNNNetwork& network, const char* const* outBuffers,
+    std::vector<std::shared_ptr<BMNNTensor>>& outputBMNNTensors,
+    const std::vector<FrameGeometry>& frames,
+    std::vector<DetectionBatch>& results, ThreadPool* pool = nullptr,
+    int stage_idx = -1) {
+  const tpuRtNetInfo_t& info = network.getNetInfo();
+  for (int s = 0; stage_idx < 0 && s < info.stage_num; ++s) {
+    if (stageOutputs(info, s, outputBMNNTensors)) stage_idx = s;
+  }
+  ASSERT(stageOutputs(info, stage_idx, outputBMNNTensors));
+  const tpuRtShape_t& input_shape = info.stages[stage_idx].input_shapes[0];
+  int net_h = input_shape.dims[2];
+  int net_w = input_shape.dims[3];
+
+  int output_num = outputBMNNTensors.size();
+  int batch = outputBMNNTensors[0]->get_shape()->dims[0];
+  ASSERT(batch <= network.maxBatch());
+  ASSERT((int)frames.size() <= batch);
+
+  std::vector<const tpuRtShape_t*> shapes(output_num);
+  std::vector<tensorSizeType> frame_bytes(output_num);
+  for (int i = 0; i < output_num; ++i) {
+    shapes[i] = outputBMNNTensors[i]->get_shape();
+    frame_bytes[i] = getTensorBytes(*outputBMNNTensors[i]->getTensor()) / batch;
+  }
+
+  results.resize(frames.size());
+  ThreadPool* tile_pool = frames.size() == 1 ? pool : nullptr;
+  auto processFrame = [&](int f) {
+    static thread_local std::vector<YoloV5Head> heads;
+    heads.resize(output_num);
+    for (int i = 0; i < output_num; ++i) {
+      heads[i] = tensorHead(*outputBMNNTensors[i],
+                            outBuffers[i] + f * frame_bytes[i]);
     }
-  std::vector<std::shared_ptr<DetectedObjectMetadata>> detDatas;
-  for (auto bbox : yolobox_vec) {
-    std::shared_ptr<DetectedObjectMetadata> detData =
-        std::make_shared<DetectedObjectMetadata>();
-    detData->mBox.mX = bbox.x;
-    detData->mBox.mY = bbox.y;
-    detData->mBox.mWidth = bbox.width;
-    detData->mBox.mHeight = bbox.height;
-    detData->mScores.push_back(bbox.score);
-    detData->mClassify = bbox.class_id;
-    detDatas.push_back(detData);
+    postProcessFrame(heads, shapes, net_w, net_h, frames[f], results[f],
+                     tile_pool);
+  };
+  if (pool && !tile_pool) {
+    pool->parallelFor(frames.size(), processFrame);
+  } else {
+    for (int f = 0; f < (int)frames.size(); ++f) processFrame(f);
   }
-  return detDatas;
-}
\ No newline at end of file
+}
+
+// With a `tracker`, frame i is tracked as the next frame of stream
+// stream_ids[i], stream i when stream_ids is empty, in frame order.
+std::vector<std::vector<std::shared_ptr<DetectedObjectMetadata>>>
+postProcessBatch(BMNNNetwork& network, const char* const* outBuffers,
+                 std::vector<std::shared_ptr<BMNNTensor>> outputBMNNTensors,
+                 const std::vector<FrameGeometry>& frames,
+                 ThreadPool* pool = nullptr, int stage_idx = -1,
+                 MultiStreamTracker* tracker = nullptr,
+                 const std::vector<int>& stream_ids = {}) {
+  ASSERT(stream_ids.empty() || stream_ids.size() == frames.size());
+  std::vector<DetectionBatch> batches;
+  postProcessBatch(network, outBuffers, outputBMNNTensors, frames, batches,
+                   pool, stage_idx);
+  std::vector<std::vector<std::shared_ptr<DetectedObjectMetadata>>> results;
+  for (size_t f = 0; f < batches.size(); ++f) {
+    results.push_back(toDetectedObjects(batches[f].view()));
+    if (tracker) {
+      trackObjects(*tracker, stream_ids.empty() ? f : stream_ids[f],
+                   results.back());
+    }
+  }
+  return results;
+}
+
+// outBuffers are host copies of the outputs, in the dtype of the tensors.
+// The decode is split over `pool` when one is given.
+void postProcessCPU(
+    const char* const* outBuffers,
+    std::vector<std::shared_ptr<BMNNTensor>>& outputBMNNTensors,
+    DetectionBatch& out, ThreadPool* pool = nullptr) {
+  std::vector<YoloV5Head> heads;
+  std::vector<const tpuRtShape_t*> shapes;
+  for (size_t tidx = 0; tidx < outputBMNNTensors.size(); ++tidx) {
+    heads.push_back(tensorHead(*outputBMNNTensors[tidx], outBuffers[tidx]));
+    shapes.push_back(outputBMNNTensors[tidx]->get_shape());
+  }
+  postProcessFrame(heads, shapes, 640, 640,
+                   letterboxGeometry(1920, 1080, 640, 640), out, pool);
+}
+
+std::vector<std::shared_ptr<DetectedObjectMetadata>> postProcessCPU(
+    const char* const* outBuffers,
+    std::vector<std::shared_ptr<BMNNTensor>> outputBMNNTensors,
+    MultiStreamTracker* tracker = nullptr, int stream_idx = 0) {
+  DetectionBatch batch;
+  postProcessCPU(outBuffers, outputBMNNTensors, batch);
+  auto objects = toDetectedObjects(batch.view());
+  if (tracker) trackObjects(*tracker, stream_idx, objects);
+  return objects;
+}
@@ -0,0 +1,519 @@
+#ifndef PREPROCESS_H_
+#define PREPROCESS_H_
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "float16.h"
+#include "host_memory_pool.h"
+#include "tpu_utils.h"
+
+enum class PixelFormat { kBGR, kRGB, kNV12 };
+
+/*
+ * One raw frame: packed 8-bit BGR / RGB, or NV12 with its luma plane in
+ * `data` and the interleaved U, V plane in `uv`, right after the luma plane
+ * when not given.
+ */
+struct RawFrame {
+  const uint8_t* data = nullptr;
+  int width = 0;
+  int height = 0;
+  int stride = 0;  // bytes per row of data, 0 for tightly packed rows
+  PixelFormat format = PixelFormat::kBGR;
+  const uint8_t* uv = nullptr;
+  int uv_stride = 0;  // 0 for the luma stride
+};
+
+struct PreprocessParams {
+  // the input of the network is (pixel - mean) * norm, per R, G, B
+  float mean[3] = {0.f, 0.f, 0.f};
+  float norm[3] = {1 / 255.f, 1 / 255.f, 1 / 255.f};
+  // planes in B, G, R order instead of R, G, B
+  bool bgr = false;
+  // value of the letterbox border, in every channel
+  int pad_value = 114;
+};
+
+inline float get_aspect_scaled_ratio(int src_w, int src_h, int dst_w, int dst_h,
+                                     bool* pIsAligWidth) {
+  float ratio;
+  float r_w = (float)dst_w / src_w;
+  float r_h = (float)dst_h / src_h;
+  if (r_h > r_w) {
+    *pIsAligWidth = true;
+    ratio = r_w;
+  } else {
+    *pIsAligWidth = false;
+    ratio = r_h;
+  }
+  return ratio;
+}
+
+/*
+ * Source resolution of a frame and the letterbox that mapped it onto the
+ * network input.
+ */
+struct FrameGeometry {
+  int frame_width;
+  int frame_height;
+  float ratio;
+  int tx1;
+  int ty1;
+};
+
+inline FrameGeometry letterboxGeometry(int frame_width, int frame_height,
+                                       int net_w, int net_h) {
+  FrameGeometry geometry;
+  geometry.frame_width = frame_width;
+  geometry.frame_height = frame_height;
+  geometry.tx1 = 0;
+  geometry.ty1 = 0;
+  bool isAlignWidth = false;
+  geometry.ratio = get_aspect_scaled_ratio(frame_width, frame_height, net_w,
+                                           net_h, &isAlignWidth);
+  if (isAlignWidth) {
+    geometry.ty1 = (int)((net_h - (int)((frame_height)*geometry.ratio)) / 2);
+  } else {
+    geometry.tx1 = (int)((net_w - (int)((frame_width)*geometry.ratio)) / 2);
+  }
+  return geometry;
+}
+
+namespace preprocess_detail {
+
+inline float clampPixel(float v) { return std::min(std::max(v, 0.f), 255.f); }
+
+// BT.601 video range Y, U, V to R, G, B.
+inline void yuvToRgb(float y, float u, float v, float* r, float* g, float* b) {
+  float c = (y - 16.f) * 1.164f;
+  float d = u - 128.f;
+  float e = v - 128.f;
+  *r = clampPixel(c + 1.596f * e);
+  *g = clampPixel(c - 0.391f * d - 0.813f * e);
+  *b = clampPixel(c + 2.018f * d);
+}
+
+#if defined(__AVX2__)
+inline __m256 gatherBytes(const uint8_t* row, const int* ofs) {
+  __m256i o = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ofs));
+  __m256i v = _mm256_i32gather_epi32(reinterpret_cast<const int*>(row), o, 1);
+  return _mm256_cvtepi32_ps(_mm256_and_si256(v, _mm256_set1_epi32(0xff)));
+}
+
+inline void yuvToRgb(__m256 y, __m256 u, __m256 v, __m256* r, __m256* g,
+                     __m256* b) {
+  const __m256 zero = _mm256_setzero_ps(), top = _mm256_set1_ps(255.f);
+  __m256 c = _mm256_mul_ps(_mm256_sub_ps(y, _mm256_set1_ps(16.f)),
+                           _mm256_set1_ps(1.164f));
+  __m256 d = _mm256_sub_ps(u, _mm256_set1_ps(128.f));
+  __m256 e = _mm256_sub_ps(v, _mm256_set1_ps(128.f));
+  __m256 vr = _mm256_add_ps(c, _mm256_mul_ps(_mm256_set1_ps(1.596f), e));
+  __m256 vg = _mm256_sub_ps(
+      _mm256_sub_ps(c, _mm256_mul_ps(_mm256_set1_ps(0.391f), d)),
+      _mm256_mul_ps(_mm256_set1_ps(0.813f), e));
+  __m256 vb = _mm256_add_ps(c, _mm256_mul_ps(_mm256_set1_ps(2.018f), d));
+  *r = _mm256_min_ps(_mm256_max_ps(vr, zero), top);
+  *g = _mm256_min_ps(_mm256_max_ps(vg, zero), top);
+  *b = _mm256_min_ps(_mm256_max_ps(vb, zero), top);
+}
+
+inline __m256 lerp(__m256 p0, __m256 p1, __m256 a) {
+  return _mm256_add_ps(p0, _mm256_mul_ps(_mm256_sub_ps(p1, p0), a));
+}
+#endif
+
+// out[i] = row[ofs0[i]] + (row[ofs1[i]] - row[ofs0[i]]) * alpha[i]. The
+// gathers load 4 bytes from each offset, so only the first `gather_n`
+// offsets, which leave 3 bytes of the row after them, are gathered.
+inline void resizeRow(const uint8_t* row, const int* ofs0, const int* ofs1,
+                      const float* alpha, int n, int gather_n, float* out) {
+  int i = 0;
+#if defined(__AVX2__)
+  for (; i + 8 <= gather_n; i += 8) {
+    __m256 p0 = gatherBytes(row, ofs0 + i);
+    __m256 p1 = gatherBytes(row, ofs1 + i);
+    _mm256_storeu_ps(out + i, lerp(p0, p1, _mm256_loadu_ps(alpha + i)));
+  }
+#endif
+  for (; i < n; ++i) {
+    float p0 = row[ofs0[i]];
+    out[i] = p0 + (row[ofs1[i]] - p0) * alpha[i];
+  }
+}
+
+// resizeRow of an NV12 row into R, G, B. Both taps are converted before the
+// interpolation, as when the whole frame is converted first. ofs[c][t] are
+// the offsets of tap t of Y (in y_row), U and V (in uv_row).
+inline void resizeNv12Row(const uint8_t* y_row, const uint8_t* uv_row,
+                          const int* const ofs[3][2], const float* alpha,
+                          int n, int gather_n, float* r, float* g, float* b) {
+  int i = 0;
+#if defined(__AVX2__)
+  for (; i + 8 <= gather_n; i += 8) {
+    __m256 rgb[2][3];
+    for (int t = 0; t < 2; ++t) {
+      yuvToRgb(gatherBytes(y_row, ofs[0][t] + i),
+               gatherBytes(uv_row, ofs[1][t] + i),
+               gatherBytes(uv_row, ofs[2][t] + i), &rgb[t][0], &rgb[t][1],
+               &rgb[t][2]);
+    }
+    __m256 a = _mm256_loadu_ps(alpha + i);
+    _mm256_storeu_ps(r + i, lerp(rgb[0][0], rgb[1][0], a));
+    _mm256_storeu_ps(g + i, lerp(rgb[0][1], rgb[1][1], a));
+    _mm256_storeu_ps(b + i, lerp(rgb[0][2], rgb[1][2], a));
+  }
+#endif
+  for (; i < n; ++i) {
+    float rgb[2][3];
+    for (int t = 0; t < 2; ++t) {
+      yuvToRgb(y_row[ofs[0][t][i]], uv_row[ofs[1][t][i]],
+               uv_row[ofs[2][t][i]], &rgb[t][0], &rgb[t][1], &rgb[t][2]);
+    }
+    r[i] = rgb[0][0] + (rgb[1][0] - rgb[0][0]) * alpha[i];
+    g[i] = rgb[0][1] + (rgb[1][1] - rgb[0][1]) * alpha[i];
+    b[i] = rgb[0][2] + (rgb[1][2] - rgb[0][2]) * alpha[i];
+  }
+}
+
+// out[i] = r0[i] + (r1[i] - r0[i]) * beta
+inline void blendRows(const float* r0, const float* r1, float beta, int n,
+                      float* out) {
+  int i = 0;
+#if defined(__AVX2__)
+  const __m256 b = _mm256_set1_ps(beta);
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(out + i, lerp(_mm256_loadu_ps(r0 + i),
+                                   _mm256_loadu_ps(r1 + i), b));
+  }
+#endif
+  for (; i < n; ++i) out[i] = r0[i] + (r1[i] - r0[i]) * beta;
+}
+
+// dst[i] = v[i] * k + m, rounded and saturated to the integer types.
+inline void storeRow(const float* v, int n, float k, float m,
+                     tpuRtDataType_t dtype, char* dst) {
+  int i = 0;
+  if (dtype == TPU_INT8 || dtype == TPU_UINT8) {
+    const bool is_signed = dtype == TPU_INT8;
+    const float lo = is_signed ? -128.f : 0.f, hi = is_signed ? 127.f : 255.f;
+#if defined(__AVX2__)
+    const __m256 vk = _mm256_set1_ps(k), vm = _mm256_set1_ps(m);
+    const __m256 vlo = _mm256_set1_ps(lo), vhi = _mm256_set1_ps(hi);
+    for (; i + 8 <= n; i += 8) {
+      __m256 q = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(v + i), vk), vm);
+      q = _mm256_min_ps(_mm256_max_ps(q, vlo), vhi);
+      __m256i q32 = _mm256_cvtps_epi32(q);
+      __m128i q16 = _mm_packs_epi32(_mm256_castsi256_si128(q32),
+                                    _mm256_extracti128_si256(q32, 1));
+      __m128i q8 = is_signed ? _mm_packs_epi16(q16, q16)
+                             : _mm_packus_epi16(q16, q16);
+      _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + i), q8);
+    }
+#endif
+    for (; i < n; ++i) {
+      float q = std::min(std::max(v[i] * k + m, lo), hi);
+      dst[i] = (char)(int)lrintf(q);
+    }
+  } else if (dtype == TPU_FLOAT32) {
+    float* out = reinterpret_cast<float*>(dst);
+#if defined(__AVX2__)
+    const __m256 vk = _mm256_set1_ps(k), vm = _mm256_set1_ps(m);
+    for (; i + 8 <= n; i += 8) {
+      __m256 q = _mm256_mul_ps(_mm256_loadu_ps(v + i), vk);
+      _mm256_storeu_ps(out + i, _mm256_add_ps(q, vm));
+    }
+#endif
+    for (; i < n; ++i) out[i] = v[i] * k + m;
+  } else if (dtype == TPU_FLOAT16) {
+    uint16_t* out = reinterpret_cast<uint16_t*>(dst);
+    for (; i < n; ++i) out[i] = floatToHalf(v[i] * k + m);
+  } else if (dtype == TPU_BFLOAT16) {
+    uint16_t* out = reinterpret_cast<uint16_t*>(dst);
+    for (; i < n; ++i) out[i] = floatToBf16(v[i] * k + m);
+  }
+}
+
+// `count` copies of the element of `size` bytes at `elem`.
+inline void fillElements(char* dst, int count, const char* elem, int size) {
+  if (size == 1) {
+    memset(dst, *elem, count);
+  } else if (size == 2) {
+    uint16_t v;
+    memcpy(&v, elem, 2);
+    std::fill_n(reinterpret_cast<uint16_t*>(dst), count, v);
+  } else {
+    uint32_t v;
+    memcpy(&v, elem, 4);
+    std::fill_n(reinterpret_cast<uint32_t*>(dst), count, v);
+  }
+}
+
+}  // namespace preprocess_detail
+
+/*
+ * Letterbox preprocessing of raw frames into one input of a net, without
+ * OpenCV or intermediate images. The frame is resized bilinearly (pixel
+ * centers aligned, like cv::resize) to the size letterboxGeometry() gives,
+ * padded with pad_value, normalized and written as CHW in the dtype of the
+ * input, quantized with its scale and zero point. Each output row is built
+ * from two horizontally resized source rows, kept while the next rows use
+ * them, so a frame is read once and written once. Resize tables are kept
+ * per frame size. Not thread safe, use one per thread.
+ */
+class LetterboxPreprocessor {
+ public:
+  LetterboxPreprocessor(const tpuRtNetInfo_t& info, int stage_idx = 0,
+                        int input_idx = 0,
+                        const PreprocessParams& params = PreprocessParams(),
+                        std::shared_ptr<HostMemoryPool> pool = nullptr)
+      : m_params(params), m_pool(pool) {
+    const tpuRtShape_t& shape = info.stages[stage_idx].input_shapes[input_idx];
+    ASSERT(shape.num_dims == 4 && shape.dims[1] == 3);
+    m_net_h = shape.dims[2];
+    m_net_w = shape.dims[3];
+    m_dtype = info.input.dtypes[input_idx];
+    ASSERT(m_dtype == TPU_FLOAT32 || m_dtype == TPU_FLOAT16 ||
+           m_dtype == TPU_BFLOAT16 || m_dtype == TPU_INT8 ||
+           m_dtype == TPU_UINT8);
+    tpuRtTensor_t one;
+    one.dtype = m_dtype;
+    one.shape.num_dims = 1;
+    one.shape.dims[0] = 1;
+    m_elem_bytes = getTensorBytes(one);
+    bool quantized = m_dtype == TPU_INT8 || m_dtype == TPU_UINT8;
+    float scale = quantized ? info.input.scales[input_idx] : 1.f;
+    float zero_point = quantized ? info.input.zero_points[input_idx] : 0.f;
+    for (int p = 0; p < 3; ++p) {
+      int c = params.bgr ? 2 - p : p;  // R, G, B index of plane p
+      m_k[p] = params.norm[c] / scale;
+      m_m[p] = -params.mean[c] * params.norm[c] / scale + zero_point;
+      float pad = params.pad_value;
+      preprocess_detail::storeRow(&pad, 1, m_k[p], m_m[p], m_dtype, m_pad[p]);
+    }
+    if (!m_pool) m_pool = std::make_shared<HostMemoryPool>();
+  }
+
+  int netWidth() const { return m_net_w; }
+  int netHeight() const { return m_net_h; }
+  tpuRtDataType_t dtype() const { return m_dtype; }
+  size_t imageBytes() const {
+    return (size_t)3 * m_net_h * m_net_w * m_elem_bytes;
+  }
+
+  // Pooled host buffer for `batch` images, ready for tpuRtMemcpyS2D once
+  // filled by run().
+  HostBuffer acquire(int batch = 1) {
+    return m_pool->acquire(batch * imageBytes());
+  }
+
+  // Write `frame` letterboxed to the input at `image`, imageBytes() bytes.
+  FrameGeometry run(const RawFrame& frame, void* image) {
+    TPUV7_TRACE_SCOPE("preprocess");
+    FrameGeometry geometry =
+        letterboxGeometry(frame.width, frame.height, m_net_w, m_net_h);
+    preparePlan(frame, geometry);
+    char* dst = static_cast<char*>(image);
+    const size_t plane = (size_t)m_net_h * m_net_w * m_elem_bytes;
+    const size_t row_bytes = (size_t)m_net_w * m_elem_bytes;
+    const int x0 = geometry.tx1, x1 = geometry.tx1 + m_resized_w;
+    const int y0 = geometry.ty1, y1 = geometry.ty1 + m_resized_h;
+
+    m_cached[0] = m_cached[1] = -1;
+    for (int y = 0; y < m_net_h; ++y) {
+      char* rows[3];
+      for (int p = 0; p < 3; ++p) rows[p] = dst + p * plane + y * row_bytes;
+      if (y < y0 || y >= y1) {
+        for (int p = 0; p < 3; ++p) {
+          preprocess_detail::fillElements(rows[p], m_net_w, m_pad[p],
+                                          m_elem_bytes);
+        }
+        continue;
+      }
+      int dy = y - y0;
+      const float* r0 = sourceRow(frame, m_yofs[2 * dy]);
+      const float* r1 = sourceRow(frame, m_yofs[2 * dy + 1]);
+      float beta = m_beta[dy];
+      for (int c = 0; c < 3; ++c) {
+        preprocess_detail::blendRows(r0 + c * m_resized_w, r1 + c * m_resized_w,
+                                     beta, m_resized_w,
+                                     m_out.data() + c * m_resized_w);
+      }
+      for (int p = 0; p < 3; ++p) {
+        preprocess_detail::fillElements(rows[p], x0, m_pad[p], m_elem_bytes);
+        preprocess_detail::storeRow(
+            m_out.data() + m_channel[p] * m_resized_w, m_resized_w, m_k[p],
+            m_m[p], m_dtype, rows[p] + x0 * m_elem_bytes);
+        preprocess_detail::fillElements(rows[p] + x1 * m_elem_bytes,
+                                        m_net_w - x1, m_pad[p], m_elem_bytes);
+      }
+    }
+    return geometry;
+  }
+
+ private:
+  // Resize tables of frames of this size and format.
+  void preparePlan(const RawFrame& frame, const FrameGeometry& geometry) {
+    if (frame.width == m_plan_w && frame.height == m_plan_h &&
+        frame.format == m_plan_format) {
+      return;
+    }
+    m_plan_w = frame.width;
+    m_plan_h = frame.height;
+    m_plan_format = frame.format;
+    bool align_width = false;
+    get_aspect_scaled_ratio(frame.width, frame.height, m_net_w, m_net_h,
+                            &align_width);
+    m_resized_w =
+        align_width ? m_net_w : (int)(frame.width * geometry.ratio);
+    m_resized_h =
+        align_width ? (int)(frame.height * geometry.ratio) : m_net_h;
+
+    // resized channel of each plane: R, G, B for RGB and NV12 (converted
+    // while resizing), reversed for BGR frames
+    for (int p = 0; p < 3; ++p) {
+      int c = m_params.bgr ? 2 - p : p;
+      m_channel[p] = frame.format == PixelFormat::kBGR ? 2 - c : c;
+    }
+
+    int n = m_resized_w;
+    m_alpha.resize(n);
+    for (int c = 0; c < 3; ++c) {
+      m_xofs[c][0].resize(n);
+      m_xofs[c][1].resize(n);
+    }
+    double scale_x = (double)frame.width / n;
+    for (int dx = 0; dx < n; ++dx) {
+      int sx0, sx1;
+      m_alpha[dx] = sourceCoord(dx, scale_x, frame.width, &sx0, &sx1);
+      for (int c = 0; c < 3; ++c) {
+        if (frame.format != PixelFormat::kNV12) {
+          m_xofs[c][0][dx] = sx0 * 3 + c;
+          m_xofs[c][1][dx] = sx1 * 3 + c;
+        } else if (c == 0) {
+          m_xofs[c][0][dx] = sx0;
+          m_xofs[c][1][dx] = sx1;
+        } else {
+          m_xofs[c][0][dx] = (sx0 & ~1) + c - 1;
+          m_xofs[c][1][dx] = (sx1 & ~1) + c - 1;
+        }
+      }
+    }
+    for (int c = 0; c < 3; ++c) {
+      int row_bytes = frame.format != PixelFormat::kNV12 ? frame.width * 3
+                      : c == 0 ? frame.width
+                               : (frame.width + 1) & ~1;
+      int gather_n = n;
+      while (gather_n > 0 && m_xofs[c][1][gather_n - 1] + 4 > row_bytes) {
+        --gather_n;
+      }
+      m_gather_n[c] = gather_n;
+    }
+
+    m_beta.resize(m_resized_h);
+    m_yofs.resize(2 * m_resized_h);
+    double scale_y = (double)frame.height / m_resized_h;
+    for (int dy = 0; dy < m_resized_h; ++dy) {
+      m_beta[dy] = sourceCoord(dy, scale_y, frame.height, &m_yofs[2 * dy],
+                               &m_yofs[2 * dy + 1]);
+    }
+    m_rows.resize(2 * 3 * n);
+    m_out.resize(3 * n);
+  }
+
+  // Taps and weight of destination pixel d for a source of `size` pixels.
+  static float sourceCoord(int d, double scale, int size, int* s0, int* s1) {
+    double f = (d + 0.5) * scale - 0.5;
+    int s = (int)floor(f);
+    float w = f - s;
+    if (s < 0) {
+      s = 0;
+      w = 0;
+    }
+    if (s >= size - 1) {
+      s = size - 1;
+      w = 0;
+    }
+    *s0 = s;
+    *s1 = std::min(s + 1, size - 1);
+    return w;
+  }
+
+  // Channels of source row `sy` resized horizontally, from the two row cache.
+  const float* sourceRow(const RawFrame& frame, int sy) {
+    for (int i = 0; i < 2; ++i) {
+      if (m_cached[i] == sy) return m_rows.data() + i * 3 * m_resized_w;
+    }
+    int slot = m_cached[0] < m_cached[1] ? 0 : 1;
+    m_cached[slot] = sy;
+    float* out = m_rows.data() + slot * 3 * m_resized_w;
+    int width = frame.format == PixelFormat::kNV12 ? frame.width
+                                                   : frame.width * 3;
+    int stride = frame.stride ? frame.stride : width;
+    const uint8_t* row = frame.data + (size_t)sy * stride;
+    const uint8_t* uv_row = nullptr;
+    if (frame.format == PixelFormat::kNV12) {
+      const uint8_t* uv =
+          frame.uv ? frame.uv : frame.data + (size_t)stride * frame.height;
+      int uv_stride = frame.uv_stride ? frame.uv_stride : stride;
+      uv_row = uv + (size_t)(sy / 2) * uv_stride;
+    }
+    if (frame.format == PixelFormat::kNV12) {
+      const int* ofs[3][2];
+      for (int c = 0; c < 3; ++c) {
+        ofs[c][0] = m_xofs[c][0].data();
+        ofs[c][1] = m_xofs[c][1].data();
+      }
+      int gather_n = std::min(m_gather_n[0], std::min(m_gather_n[1],
+                                                      m_gather_n[2]));
+      preprocess_detail::resizeNv12Row(row, uv_row, ofs, m_alpha.data(),
+                                       m_resized_w, gather_n, out,
+                                       out + m_resized_w,
+                                       out + 2 * m_resized_w);
+      return out;
+    }
+    for (int c = 0; c < 3; ++c) {
+      preprocess_detail::resizeRow(row, m_xofs[c][0].data(),
+                                   m_xofs[c][1].data(), m_alpha.data(),
+                                   m_resized_w, m_gather_n[c],
+                                   out + c * m_resized_w);
+    }
+    return out;
+  }
+
+  PreprocessParams m_params;
+  std::shared_ptr<HostMemoryPool> m_pool;
+  int m_net_w;
+  int m_net_h;
+  tpuRtDataType_t m_dtype;
+  int m_elem_bytes;
+  float m_k[3];  // per plane: input = value * k + m
+  float m_m[3];
+  char m_pad[3][4];  // the border element of each plane
+
+  int m_plan_w = 0;
+  int m_plan_h = 0;
+  PixelFormat m_plan_format = PixelFormat::kBGR;
+  int m_resized_w = 0;
+  int m_resized_h = 0;
+  int m_channel[3];  // resized channel written to each plane
+  std::vector<int> m_xofs[3][2];  // byte offsets of the taps, per channel
+  int m_gather_n[3];
+  std::vector<float> m_alpha;
+  std::vector<int> m_yofs;  // source rows of the taps
+  std::vector<float> m_beta;
+  std::vector<float> m_rows;  // two cached source rows, 3 channels each
+  int m_cached[2];
+  std::vector<float> m_out;
+};
+
+#endif
@@ -0,0 +1,246 @@
+#include <stdint.h>
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "preprocess.h"
+
+/*
+ * Microbenchmark of LetterboxPreprocessor against the resize, pad, color
+ * convert, normalize and HWC to CHW passes it replaces, each through its own
+ * intermediate image. A 1920x1080 frame goes to a 640x640 input as BGR, RGB
+ * and NV12, written as int8, uint8 and fp32. The two must agree to one step
+ * of the input dtype, float rounding being the only difference.
+ */
+
+namespace {
+
+struct InputSpec {
+  const char* name;
+  tpuRtDataType_t dtype;
+  float scale;
+  int zero_point;
+};
+
+// 1 / 255 normalized pixels, quantized like yolov5s int8 inputs
+const InputSpec kInputs[] = {{"int8", TPU_INT8, 1 / 127.f, 0},
+                             {"uint8", TPU_UINT8, 1 / 255.f, 0},
+                             {"fp32", TPU_FLOAT32, 1.f, 0}};
+
+void sourceTaps(int d, double scale, int size, int* s0, int* s1, float* w) {
+  double f = (d + 0.5) * scale - 0.5;
+  int s = (int)floor(f);
+  *w = f - s;
+  if (s < 0) {
+    s = 0;
+    *w = 0;
+  }
+  if (s >= size - 1) {
+    s = size - 1;
+    *w = 0;
+  }
+  *s0 = s;
+  *s1 = std::min(s + 1, size - 1);
+}
+
+// The passes of a cv::resize / copyMakeBorder / cvtColor / convertTo /
+// split based preprocessing, on float images.
+void legacyPreprocess(const std::vector<uint8_t>& frame, int width,
+                      int height, PixelFormat format, int net_w, int net_h,
+                      const InputSpec& input, std::vector<char>& out) {
+  // NV12 to BGR at the source resolution
+  std::vector<float> bgr((size_t)width * height * 3);
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      float* p = &bgr[((size_t)y * width + x) * 3];
+      if (format == PixelFormat::kNV12) {
+        const uint8_t* uv = frame.data() + (size_t)width * height;
+        float c = (frame[(size_t)y * width + x] - 16.f) * 1.164f;
+        float d = uv[(size_t)(y / 2) * width + (x & ~1)] - 128.f;
+        float e = uv[(size_t)(y / 2) * width + (x & ~1) + 1] - 128.f;
+        p[2] = std::min(std::max(c + 1.596f * e, 0.f), 255.f);
+        p[1] = std::min(std::max(c - 0.391f * d - 0.813f * e, 0.f), 255.f);
+        p[0] = std::min(std::max(c + 2.018f * d, 0.f), 255.f);
+      } else {
+        const uint8_t* s = &frame[((size_t)y * width + x) * 3];
+        bool rgb = format == PixelFormat::kRGB;
+        p[0] = s[rgb ? 2 : 0];
+        p[1] = s[1];
+        p[2] = s[rgb ? 0 : 2];
+      }
+    }
+  }
+
+  // resize
+  FrameGeometry geometry = letterboxGeometry(width, height, net_w, net_h);
+  bool align_width = false;
+  get_aspect_scaled_ratio(width, height, net_w, net_h, &align_width);
+  int rw = align_width ? net_w : (int)(width * geometry.ratio);
+  int rh = align_width ? (int)(height * geometry.ratio) : net_h;
+  std::vector<float> resized((size_t)rw * rh * 3);
+  for (int dy = 0; dy < rh; ++dy) {
+    int y0, y1;
+    float b;
+    sourceTaps(dy, (double)height / rh, height, &y0, &y1, &b);
+    for (int dx = 0; dx < rw; ++dx) {
+      int x0, x1;
+      float a;
+      sourceTaps(dx, (double)width / rw, width, &x0, &x1, &a);
+      for (int c = 0; c < 3; ++c) {
+        float p00 = bgr[((size_t)y0 * width + x0) * 3 + c];
+        float p01 = bgr[((size_t)y0 * width + x1) * 3 + c];
+        float p10 = bgr[((size_t)y1 * width + x0) * 3 + c];
+        float p11 = bgr[((size_t)y1 * width + x1) * 3 + c];
+        float top = p00 + (p01 - p00) * a;
+        float bottom = p10 + (p11 - p10) * a;
+        resized[((size_t)dy * rw + dx) * 3 + c] = top + (bottom - top) * b;
+      }
+    }
+  }
+
+  // pad
+  std::vector<float> canvas((size_t)net_w * net_h * 3, 114.f);
+  for (int y = 0; y < rh; ++y) {
+    for (int x = 0; x < rw; ++x) {
+      for (int c = 0; c < 3; ++c) {
+        canvas[(((size_t)y + geometry.ty1) * net_w + x + geometry.tx1) * 3 +
+               c] = resized[((size_t)y * rw + x) * 3 + c];
+      }
+    }
+  }
+
+  // normalize, quantize, split to R, G, B planes
+  size_t plane = (size_t)net_w * net_h;
+  int elem = input.dtype == TPU_FLOAT32 ? 4 : 1;
+  out.resize(plane * 3 * elem);
+  for (size_t i = 0; i < plane; ++i) {
+    for (int p = 0; p < 3; ++p) {
+      float v = canvas[i * 3 + 2 - p] / 255.f;
+      if (input.dtype == TPU_FLOAT32) {
+        reinterpret_cast<float*>(out.data())[p * plane + i] = v;
+      } else {
+        int lo = input.dtype == TPU_INT8 ? -128 : 0;
+        int q = (int)lrintf(v / input.scale) + input.zero_point;
+        out[p * plane + i] = (char)std::min(std::max(q, lo), lo + 255);
+      }
+    }
+  }
+}
+
+// Largest difference between the two images in steps of the dtype.
+double maxDiff(const char* a, const char* b, size_t count,
+               tpuRtDataType_t dtype) {
+  double diff = 0;
+  for (size_t i = 0; i < count; ++i) {
+    double d;
+    if (dtype == TPU_FLOAT32) {
+      d = fabs(reinterpret_cast<const float*>(a)[i] -
+               reinterpret_cast<const float*>(b)[i]) * 255;
+    } else if (dtype == TPU_INT8) {
+      d = abs((int8_t)a[i] - (int8_t)b[i]);
+    } else {
+      d = abs((uint8_t)a[i] - (uint8_t)b[i]);
+    }
+    diff = std::max(diff, d);
+  }
+  return diff;
+}
+
+template <class F>
+double timeUs(int iters, F&& f) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iters; ++i) f();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::micro>(end - start).count() /
+         iters;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int iters = argc > 1 ? atoi(argv[1]) : 20;
+  const int width = 1920, height = 1080, net_w = 640, net_h = 640;
+
+  // smooth gradients with noise, so the interpolation matters
+  std::mt19937 rng(99);
+  std::uniform_int_distribution<int> noise(-20, 20);
+  std::vector<uint8_t> packed((size_t)width * height * 3);
+  std::vector<uint8_t> nv12((size_t)width * height * 3 / 2);
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      for (int c = 0; c < 3; ++c) {
+        int v = (x * (c + 1) / 8 + y * (3 - c) / 4) % 256 + noise(rng);
+        packed[((size_t)y * width + x) * 3 + c] = std::min(std::max(v, 0), 255);
+      }
+      nv12[(size_t)y * width + x] = packed[((size_t)y * width + x) * 3];
+    }
+  }
+  for (size_t i = (size_t)width * height; i < nv12.size(); ++i) {
+    nv12[i] = 128 + noise(rng) * 3;
+  }
+
+  tpuRtShape_t input_shape;
+  input_shape.num_dims = 4;
+  input_shape.dims[0] = 1;
+  input_shape.dims[1] = 3;
+  input_shape.dims[2] = net_h;
+  input_shape.dims[3] = net_w;
+  tpuRtStageInfo_t stage{&input_shape, nullptr};
+
+  bool ok = true;
+  auto pool = std::make_shared<HostMemoryPool>();
+  const PixelFormat formats[] = {PixelFormat::kBGR, PixelFormat::kRGB,
+                                 PixelFormat::kNV12};
+  const char* format_names[] = {"bgr", "rgb", "nv12"};
+  for (const InputSpec& input : kInputs) {
+    const char* name = "images";
+    float scale = input.scale;
+    int zero_point = input.zero_point;
+    tpuRtDataType_t dtype = input.dtype;
+    tpuRtNetInfo_t info{};
+    info.input = tpuRtIOInfo_t{1, &name, &scale, &zero_point, &dtype};
+    info.stage_num = 1;
+    info.stages = &stage;
+    LetterboxPreprocessor preprocessor(info, 0, 0, PreprocessParams(), pool);
+
+    for (int f = 0; f < 3; ++f) {
+      RawFrame frame;
+      frame.width = width;
+      frame.height = height;
+      frame.format = formats[f];
+      frame.data = formats[f] == PixelFormat::kNV12 ? nv12.data()
+                                                     : packed.data();
+      const std::vector<uint8_t>& bytes =
+          formats[f] == PixelFormat::kNV12 ? nv12 : packed;
+
+      std::vector<char> expect;
+      legacyPreprocess(bytes, width, height, formats[f], net_w, net_h, input,
+                       expect);
+      HostBuffer image = preprocessor.acquire();
+      preprocessor.run(frame, image.data());
+      double diff = maxDiff(expect.data(), image.data(),
+                            (size_t)3 * net_w * net_h, input.dtype);
+      bool close = diff <= 1.0;
+      ok = ok && close;
+
+      double legacy_us = timeUs(iters, [&] {
+        legacyPreprocess(bytes, width, height, formats[f], net_w, net_h,
+                         input, expect);
+      });
+      double fused_us = timeUs(iters, [&] {
+        HostBuffer buffer = preprocessor.acquire();
+        preprocessor.run(frame, buffer.data());
+      });
+      std::cout << format_names[f] << " -> " << input.name
+                << " max_diff=" << diff << (close ? "" : " TOO LARGE")
+                << " legacy=" << legacy_us << "us fused=" << fused_us
+                << "us speedup=" << legacy_us / fused_us << "x" << std::endl;
+    }
+  }
+  MemoryPoolStats stats = pool->stats();
+  std::cout << "host pool hits " << stats.hits << " misses " << stats.misses
+            << std::endl;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,92 @@
+// Startup time of ModelRegistry, loading a set of bmodels one after the
+// other and side by side, then its error paths.
+//
+//   tpuv7_registry_bench [models] [model.bmodel ...]
+//
+// On the stand-in runtime, set e.g. TPUV7_STUB_DEVICES=4 and
+// TPUV7_STUB_LOAD_US=200000 so loads take time and can overlap.
+//
+// `models` specs (4 by default) spread over the devices, each with two
+// network instances warmed up twice, take the given bmodels in turn, or the
+// built-in yolov5s of the stand-in runtime. Registering a name twice and a
+// model on a missing device must fail without dropping the other models.
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "model_registry.h"
+
+namespace {
+
+double msSince(std::chrono::steady_clock::time_point begin) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - begin)
+      .count();
+}
+
+// Load `specs` on `threads` threads and print the time of each model.
+double load(const std::vector<ModelSpec>& specs, int threads, bool& ok) {
+  ModelRegistry registry;
+  auto begin = std::chrono::steady_clock::now();
+  tpuRtStatus_t ret = registry.load(specs, threads);
+  double ms = msSince(begin);
+  ok = ok && ret == tpuRtSuccess && registry.names().size() == specs.size();
+  std::cout << (threads == 1 ? "serial" : "parallel") << ": " << ms
+            << " ms" << std::endl;
+  for (auto& spec : specs) {
+    std::shared_ptr<LoadedModel> model = registry.get(spec.name);
+    if (!model) continue;
+    std::cout << "  " << spec.name << " device " << spec.device << " load "
+              << model->load_ms << " ms warmup " << model->warmup_ms << " ms"
+              << std::endl;
+  }
+  return ms;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int model_num = argc > 1 ? atoi(argv[1]) : 4;
+  std::vector<std::string> paths(argv + std::min(argc, 2), argv + argc);
+  if (paths.empty()) paths.push_back("yolov5s.bmodel");
+  tpuRtInit();
+  int devices = 1;
+  tpuRtGetDeviceCount(&devices);
+
+  std::vector<ModelSpec> specs;
+  for (int i = 0; i < model_num; ++i) {
+    ModelSpec spec;
+    spec.name = "model" + std::to_string(i);
+    spec.path = paths[i % paths.size()];
+    spec.device = i % devices;
+    spec.instances = 2;
+    spec.warmup = 2;
+    specs.push_back(spec);
+  }
+
+  bool ok = true;
+  double serial = load(specs, 1, ok);
+  double parallel = load(specs, 0, ok);
+  std::cout << "speedup " << serial / parallel << "x" << std::endl;
+
+  ModelRegistry registry;
+  ok = ok && registry.load({specs[0]}) == tpuRtSuccess;
+  // already registered, and twice in one call
+  bool dup = registry.load({specs[0]}) == tpuRtErrParam;
+  ModelSpec twin = specs[1];
+  dup = dup && registry.load({twin, twin}) == tpuRtErrParam;
+  dup = dup && !registry.get(twin.name);
+  // a missing device fails that model only
+  ModelSpec missing = specs[1];
+  missing.name = "missing";
+  missing.device = devices;
+  bool failed = registry.load({missing, specs[1]}) == tpuRtErrFailure &&
+                !registry.get("missing") && registry.get(specs[1].name) &&
+                registry.names().size() == 2;
+  std::cout << "duplicate names " << (dup ? "rejected" : "NOT REJECTED")
+            << ", failed load " << (failed ? "isolated" : "NOT ISOLATED")
+            << std::endl;
+  return ok && dup && failed ? 0 : 1;
+}
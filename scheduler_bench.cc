@@ -0,0 +1,76 @@
+// Throughput of DeviceManager on every device of the machine, with and
+// without work stealing.
+//
+//   TPUV7_STUB_DEVICES=4 tpuv7_scheduler_bench yolov5s.bmodel [requests]
+//
+// Half of the requests are pinned to the first device, the rest go to the
+// least loaded one, as when a few busy streams stick to one device. Without
+// stealing the first device runs its backlog alone; with it the others take
+// over its queue once theirs are empty. With few host cores, raise
+// TPUV7_STUB_LAUNCH_US so the devices and not the host copies are the
+// bottleneck.
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "device_manager.h"
+
+namespace {
+
+double run(const char* model, int requests, bool stealing) {
+  DeviceManagerConfig config;
+  config.work_stealing = stealing;
+  DeviceManager manager(model, config);
+  if (manager.deviceNum() == 0) return 0;
+
+  const tpuRtNetInfo_t& info = manager.context(0)->netInfo()->info();
+  std::vector<std::vector<char>> inputs(info.input.num);
+  std::vector<const void*> input_data;
+  for (int i = 0; i < info.input.num; ++i) {
+    tpuRtTensor_t tensor;
+    tensor.dtype = info.input.dtypes[i];
+    tensor.shape = info.stages[0].input_shapes[i];
+    inputs[i].assign(getTensorBytes(tensor), 1);
+    input_data.push_back(inputs[i].data());
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::future<DeviceFrameResult>> results;
+  for (int r = 0; r < requests; ++r) {
+    results.push_back(manager.submit(input_data, {}, r % 2 ? -1 : 0));
+  }
+  int errors = 0;
+  for (auto& result : results) {
+    errors += result.get().status != tpuRtSuccess;
+  }
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+  std::cout << (stealing ? "stealing" : "no stealing") << ": "
+            << requests / seconds << " requests/s, " << errors << " errors"
+            << std::endl;
+  for (const DeviceMetrics& metrics : manager.metrics()) {
+    std::cout << "  device " << metrics.device << " executed "
+              << metrics.executed << " stolen " << metrics.stolen << std::endl;
+  }
+  return errors ? 0 : requests / seconds;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << " MODEL [REQUESTS]" << std::endl;
+    return 1;
+  }
+  int requests = argc > 2 ? atoi(argv[2]) : 400;
+  tpuRtInit();
+  double without = run(argv[1], requests, false);
+  double with = run(argv[1], requests, true);
+  if (without > 0 && with > 0) {
+    std::cout << "speedup " << with / without << "x" << std::endl;
+  }
+  return without > 0 && with > 0 ? 0 : 1;
+}
@@ -0,0 +1,296 @@
+#ifndef TENSOR_COMPARE_H_
+#define TENSOR_COMPARE_H_
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iostream>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "float16.h"
+#include "tpu_utils.h"
+
+struct CompareStats {
+  unsigned long long count = 0;
+  double l1 = 0;       // sum of |a - b|
+  double max_abs = 0;  // largest |a - b|
+  long long max_index = -1;  // element of max_abs, counted over all adds
+  double rmse = 0;
+  double cosine = 0;
+  unsigned long long over_tolerance = 0;  // elements with |a - b| > tolerance
+
+  double meanAbs() const { return count ? l1 / count : 0; }
+};
+
+/*
+ * One side of a comparison: `count` elements of `dtype` at `data`, real value
+ * (x - zero_point) * scale for integer types, fp types are taken as is.
+ */
+struct CompareOperand {
+  const void* data = nullptr;
+  tpuRtDataType_t dtype = TPU_FLOAT32;
+  float scale = 1.f;
+  int zero_point = 0;
+
+  CompareOperand() = default;
+  CompareOperand(const void* data, tpuRtDataType_t dtype = TPU_FLOAT32,
+                 float scale = 1.f, int zero_point = 0)
+      : data(data), dtype(dtype), scale(scale), zero_point(zero_point) {}
+  // host copy of an output, waits for its D2H copy
+  explicit CompareOperand(BMNNTensor& tensor)
+      : data(tensor.get_host_data()),
+        dtype(tensor.get_dtype()),
+        scale(tensor.get_scale()),
+        zero_point(tensor.get_zero_point()) {}
+};
+
+namespace compare_detail {
+
+// Convert elements [begin, begin + n) of `op` to real values in dst.
+inline void toFloat(const CompareOperand& op, size_t begin, int n,
+                    float* dst) {
+  const float scale = op.scale;
+  const float zp = op.zero_point;
+  int i = 0;
+  switch (op.dtype) {
+    case TPU_FLOAT32:
+      memcpy(dst, static_cast<const float*>(op.data) + begin, n * 4);
+      return;
+    case TPU_FLOAT16: {
+      const uint16_t* src = static_cast<const uint16_t*>(op.data) + begin;
+#if defined(__AVX2__) && defined(__F16C__)
+      for (; i + 8 <= n; i += 8) {
+        __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+      }
+#endif
+      for (; i < n; ++i) dst[i] = halfToFloat(src[i]);
+      return;
+    }
+    case TPU_BFLOAT16: {
+      const uint16_t* src = static_cast<const uint16_t*>(op.data) + begin;
+#if defined(__AVX2__)
+      for (; i + 8 <= n; i += 8) {
+        __m256i h = _mm256_cvtepu16_epi32(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+        _mm256_storeu_ps(dst + i,
+                         _mm256_castsi256_ps(_mm256_slli_epi32(h, 16)));
+      }
+#endif
+      for (; i < n; ++i) dst[i] = bf16ToFloat(src[i]);
+      return;
+    }
+    case TPU_INT8: {
+      const int8_t* src = static_cast<const int8_t*>(op.data) + begin;
+#if defined(__AVX2__)
+      const __m256 vscale = _mm256_set1_ps(scale), vzp = _mm256_set1_ps(zp);
+      for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_cvtepi8_epi32(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_sub_ps(
+                                      _mm256_cvtepi32_ps(v), vzp), vscale));
+      }
+#endif
+      for (; i < n; ++i) dst[i] = (src[i] - zp) * scale;
+      return;
+    }
+    case TPU_UINT8: {
+      const uint8_t* src = static_cast<const uint8_t*>(op.data) + begin;
+#if defined(__AVX2__)
+      const __m256 vscale = _mm256_set1_ps(scale), vzp = _mm256_set1_ps(zp);
+      for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_sub_ps(
+                                      _mm256_cvtepi32_ps(v), vzp), vscale));
+      }
+#endif
+      for (; i < n; ++i) dst[i] = (src[i] - zp) * scale;
+      return;
+    }
+    case TPU_INT16: {
+      const int16_t* src = static_cast<const int16_t*>(op.data) + begin;
+      for (; i < n; ++i) dst[i] = (src[i] - zp) * scale;
+      return;
+    }
+    case TPU_UINT16: {
+      const uint16_t* src = static_cast<const uint16_t*>(op.data) + begin;
+      for (; i < n; ++i) dst[i] = (src[i] - zp) * scale;
+      return;
+    }
+    case TPU_INT32: {
+      const int32_t* src = static_cast<const int32_t*>(op.data) + begin;
+      for (; i < n; ++i) dst[i] = ((float)src[i] - zp) * scale;
+      return;
+    }
+    case TPU_UINT32: {
+      const uint32_t* src = static_cast<const uint32_t*>(op.data) + begin;
+      for (; i < n; ++i) dst[i] = ((float)src[i] - zp) * scale;
+      return;
+    }
+    case TPU_INT4:
+    case TPU_UINT4: {
+      // two elements per byte, low nibble first
+      const uint8_t* src = static_cast<const uint8_t*>(op.data);
+      for (; i < n; ++i) {
+        size_t e = begin + i;
+        int v = (src[e / 2] >> ((e & 1) * 4)) & 0xf;
+        if (op.dtype == TPU_INT4 && v >= 8) v -= 16;
+        dst[i] = (v - zp) * scale;
+      }
+      return;
+    }
+  }
+}
+
+// Per block sums, kept in float inside a block and folded into double.
+struct BlockSums {
+  float l1 = 0, sq = 0, ab = 0, aa = 0, bb = 0, max_abs = 0;
+  unsigned long long over = 0;
+};
+
+inline BlockSums blockSums(const float* a, const float* b, int n,
+                           float tolerance) {
+  BlockSums s;
+  int i = 0;
+#if defined(__AVX2__)
+  const __m256 sign_mask = _mm256_set1_ps(-0.f);
+  const __m256 vtol = _mm256_set1_ps(tolerance);
+  __m256 l1 = _mm256_setzero_ps(), sq = l1, ab = l1, aa = l1, bb = l1,
+         vmax = l1;
+  __m256i over = _mm256_setzero_si256();
+  for (; i + 8 <= n; i += 8) {
+    __m256 va = _mm256_loadu_ps(a + i);
+    __m256 vb = _mm256_loadu_ps(b + i);
+    __m256 d = _mm256_sub_ps(va, vb);
+    __m256 ad = _mm256_andnot_ps(sign_mask, d);
+    l1 = _mm256_add_ps(l1, ad);
+    sq = _mm256_add_ps(sq, _mm256_mul_ps(d, d));
+    ab = _mm256_add_ps(ab, _mm256_mul_ps(va, vb));
+    aa = _mm256_add_ps(aa, _mm256_mul_ps(va, va));
+    bb = _mm256_add_ps(bb, _mm256_mul_ps(vb, vb));
+    vmax = _mm256_max_ps(vmax, ad);
+    // compare mask is all ones, i.e. -1, per element over tolerance
+    over = _mm256_sub_epi32(
+        over, _mm256_castps_si256(_mm256_cmp_ps(ad, vtol, _CMP_GT_OQ)));
+  }
+  float lanes[8];
+  int over_lanes[8];
+  auto hsum = [&lanes](__m256 v) {
+    _mm256_storeu_ps(lanes, v);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + lanes[4] + lanes[5] +
+           lanes[6] + lanes[7];
+  };
+  s.l1 = hsum(l1);
+  s.sq = hsum(sq);
+  s.ab = hsum(ab);
+  s.aa = hsum(aa);
+  s.bb = hsum(bb);
+  _mm256_storeu_ps(lanes, vmax);
+  s.max_abs = *std::max_element(lanes, lanes + 8);
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(over_lanes), over);
+  for (int l = 0; l < 8; ++l) s.over += over_lanes[l];
+#endif
+  for (; i < n; ++i) {
+    float d = a[i] - b[i];
+    float ad = fabsf(d);
+    s.l1 += ad;
+    s.sq += d * d;
+    s.ab += a[i] * b[i];
+    s.aa += a[i] * a[i];
+    s.bb += b[i] * b[i];
+    s.max_abs = std::max(s.max_abs, ad);
+    s.over += ad > tolerance;
+  }
+  return s;
+}
+
+}  // namespace compare_detail
+
+/*
+ * Streaming comparison of tensors of any dtype. Every add() goes over its
+ * elements once, a block at a time converted to float and reduced with AVX2,
+ * and folds them into running totals, so a whole validation set can be
+ * compared element by element without materializing anything. stats() can
+ * be read at any point.
+ */
+class TensorComparator {
+ public:
+  explicit TensorComparator(float tolerance = 1e-3f) : m_tolerance(tolerance) {}
+
+  void add(const CompareOperand& a, const CompareOperand& b, size_t count) {
+    float buf_a[kBlock], buf_b[kBlock];
+    for (size_t begin = 0; begin < count; begin += kBlock) {
+      int n = std::min<size_t>(kBlock, count - begin);
+      compare_detail::toFloat(a, begin, n, buf_a);
+      compare_detail::toFloat(b, begin, n, buf_b);
+      compare_detail::BlockSums s =
+          compare_detail::blockSums(buf_a, buf_b, n, m_tolerance);
+      m_l1 += s.l1;
+      m_sq += s.sq;
+      m_ab += s.ab;
+      m_aa += s.aa;
+      m_bb += s.bb;
+      m_over += s.over;
+      if (s.max_abs > m_max_abs || m_max_index < 0) {
+        // first element of the block reaching the block max
+        for (int i = 0; i < n; ++i) {
+          if (fabsf(buf_a[i] - buf_b[i]) == s.max_abs) {
+            m_max_index = m_count + begin + i;
+            break;
+          }
+        }
+        m_max_abs = s.max_abs;
+      }
+    }
+    m_count += count;
+  }
+
+  // Compare an output against a reference buffer holding the same number of
+  // elements, of `ref_dtype` with `ref_scale`.
+  void add(BMNNTensor& output, const void* reference,
+           tpuRtDataType_t ref_dtype = TPU_FLOAT32, float ref_scale = 1.f) {
+    add(CompareOperand(output),
+        CompareOperand(reference, ref_dtype, ref_scale),
+        getShapeElements(*output.get_shape()));
+  }
+
+  CompareStats stats() const {
+    CompareStats ret;
+    ret.count = m_count;
+    ret.l1 = m_l1;
+    ret.max_abs = m_max_abs;
+    ret.max_index = m_max_index;
+    ret.rmse = m_count ? sqrt(m_sq / m_count) : 0;
+    double norm = sqrt(m_aa) * sqrt(m_bb);
+    ret.cosine = norm > 0 ? m_ab / norm : (m_aa == m_bb ? 1 : 0);
+    ret.over_tolerance = m_over;
+    return ret;
+  }
+
+  void reset() { *this = TensorComparator(m_tolerance); }
+
+ private:
+  static const int kBlock = 1024;
+
+  float m_tolerance;
+  unsigned long long m_count = 0;
+  double m_l1 = 0, m_sq = 0, m_ab = 0, m_aa = 0, m_bb = 0;
+  float m_max_abs = 0;
+  long long m_max_index = -1;
+  unsigned long long m_over = 0;
+};
+
+inline std::ostream& operator<<(std::ostream& os, const CompareStats& s) {
+  return os << "l1 " << s.l1 << " mean " << s.meanAbs() << " max "
+            << s.max_abs << " @" << s.max_index << " rmse " << s.rmse
+            << " cosine " << s.cosine << " over_tol " << s.over_tolerance
+            << "/" << s.count;
+}
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/*
+ * Fixed size pool of worker threads running queued tasks in FIFO order.
+ */
+class ThreadPool {
+ public:
+  explicit ThreadPool(int thread_num = std::thread::hardware_concurrency()) {
+    if (thread_num < 1) thread_num = 1;
+    for (int i = 0; i < thread_num; ++i) {
+      m_workers.emplace_back([this] { workerLoop(); });
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_cv.notify_all();
+    for (auto& worker : m_workers) worker.join();
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  int size() const { return m_workers.size(); }
+
+  template <class F, class R = decltype(std::declval<F&>()())>
+  std::future<R> submit(F&& f) {
+    auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(f));
+    std::future<R> ret = task->get_future();
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_tasks.emplace([task] { (*task)(); });
+    }
+    m_cv.notify_one();
+    return ret;
+  }
+
+  // Run f(0) ... f(n - 1) on the pool and wait for all of them.
+  template <class F>
+  void parallelFor(int n, F&& f) {
+    std::vector<std::future<void>> futures;
+    futures.reserve(n);
+    for (int i = 0; i < n; ++i) {
+      futures.push_back(submit([&f, i] { f(i); }));
+    }
+    for (auto& future : futures) future.get();
+  }
+
+ private:
+  void workerLoop() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+        if (m_stop && m_tasks.empty()) return;
+        task = std::move(m_tasks.front());
+        m_tasks.pop();
+      }
+      task();
+    }
+  }
+
+  std::vector<std::thread> m_workers;
+  std::queue<std::function<void()>> m_tasks;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  bool m_stop = false;
+};
+
+#endif
@@ -1,11 +1,21 @@
 #ifndef TPURTUTILS_H_
 #define TPURTUTILS_H_
 
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <condition_variable>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
+#include "device_memory_pool.h"
+#include "trace.h"
 #include "tpuv7_modelrt.h"
 #include "tpuv7_rt.h"
 
@@ -60,34 +70,157 @@ tensorSizeType getTensorBytes(const tpuRtTensor_t& tensor) {
   return ret;
 }
 
+// Fill `bytes` of tensor data of `dtype` with its quantized zero:
+// `zero_point` for the integer types, 0 for the floating point ones.
+void fillZeroPoint(char* dst, tensorSizeType bytes, tpuRtDataType_t dtype,
+                   int zero_point) {
+  if (zero_point == 0) {
+    memset(dst, 0, bytes);
+    return;
+  }
+  switch (dtype) {
+    case TPU_INT8:
+    case TPU_UINT8:
+      memset(dst, zero_point, bytes);
+      break;
+    case TPU_INT4:
+    case TPU_UINT4:
+      memset(dst, (zero_point & 0xf) * 0x11, bytes);
+      break;
+    case TPU_INT16:
+    case TPU_UINT16: {
+      uint16_t value = zero_point;
+      for (tensorSizeType b = 0; b + 2 <= bytes; b += 2) {
+        memcpy(dst + b, &value, 2);
+      }
+      break;
+    }
+    case TPU_INT32:
+    case TPU_UINT32: {
+      uint32_t value = zero_point;
+      for (tensorSizeType b = 0; b + 4 <= bytes; b += 4) {
+        memcpy(dst + b, &value, 4);
+      }
+      break;
+    }
+    default:
+      memset(dst, 0, bytes);
+      break;
+  }
+}
+
+/*
+ * Host memory slot a tensor is read back into, with the event marking the end
+ * of its last copy.
+ */
+struct HostStagingSlot {
+  char* data;
+  tensorSizeType bytes;
+  tpuRtEvent_t event;
+};
+
+/*
+ * Host memory a network reads its outputs back into: one 64 byte aligned slot
+ * per output, sized for the largest stage. Allocated once and reused by every
+ * frame, so the data of a slot is valid until the next copy of that output.
+ */
+class HostStagingArena : public NoCopyable {
+ public:
+  HostStagingArena(const std::vector<tensorSizeType>& sizes,
+                   tpuRtStream_t stream)
+      : m_stream(stream), m_slots(sizes.size()) {
+    const tensorSizeType align = 64;
+    std::vector<tensorSizeType> offsets(sizes.size());
+    tensorSizeType total = 0;
+    for (size_t i = 0; i < sizes.size(); ++i) {
+      offsets[i] = total;
+      total += (sizes[i] + align - 1) / align * align;
+    }
+    if (posix_memalign(reinterpret_cast<void**>(&m_block), align,
+                       total ? total : align) != 0) {
+      m_block = nullptr;
+    }
+    ASSERT(m_block);
+    for (size_t i = 0; i < sizes.size(); ++i) {
+      m_slots[i].data = m_block + offsets[i];
+      m_slots[i].bytes = sizes[i];
+      tpuRtEventCreate(&m_slots[i].event);
+    }
+  }
+
+  ~HostStagingArena() {
+    for (auto& slot : m_slots) tpuRtEventFree(slot.event, m_stream);
+    free(m_block);
+  }
+
+  HostStagingSlot* slot(int index) { return &m_slots[index]; }
+
+ private:
+  tpuRtStream_t m_stream;
+  char* m_block = nullptr;
+  std::vector<HostStagingSlot> m_slots;
+};
+
+tensorSizeType getShapeElements(const tpuRtShape_t& shape) {
+  tensorSizeType ret = 1;
+  for (int i = 0; i < shape.num_dims; ++i) {
+    ret *= shape.dims[i];
+  }
+  return ret;
+}
+
 class BMNNTensor {
  public:
   using byte = char;
+  // Without a staging slot the host copy is allocated by the tensor itself.
   BMNNTensor(const char* name, float scale, tpuRtTensor_t* tensor,
-             tpuRtStream_t* stream)
+             tpuRtStream_t* stream, HostStagingSlot* staging = nullptr,
+             int zero_point = 0)
       : m_name(name),
         m_host_data(nullptr),
         m_scale(scale),
+        m_zero_point(zero_point),
         m_tensor(tensor),
-        stream(stream) {}
+        stream(stream),
+        m_staging(staging) {}
 
   virtual ~BMNNTensor() {
-    if (m_host_data) {
-      delete m_host_data;
+    if (m_host_data && !m_staging) {
+      delete[] m_host_data;
     }
   }
 
-  // tpuRtTensor_t& getTensor() { return *m_tensor; }
-  // const tpuRtTensor_t& getTensor() const { return *m_tensor; }
+  tpuRtTensor_t* getTensor() { return m_tensor; }
+  const tpuRtTensor_t* getTensor() const { return m_tensor; }
 
-  // Return an array pointer to system memory of tensor.
-  byte* get_host_data() {
-    if (m_host_data) return m_host_data;
-    tpuRtStatus_t ret;
+  // Queue the copy of the tensor to system memory on the stream and return at
+  // once. get_host_data() then waits for this copy only, not for the copies
+  // queued after it.
+  void start_host_copy() {
+    if (m_host_data) return;
     auto size = getTensorBytes(*m_tensor);
-    m_host_data = new byte[size];  // bytes
+    if (m_staging) {
+      ASSERT(size <= m_staging->bytes);
+      m_host_data = m_staging->data;
+    } else {
+      m_host_data = new byte[size];  // bytes
+    }
+    TPUV7_TRACE_SCOPE("tpuRtMemcpyD2SAsync");
     tpuRtMemcpyD2SAsync(m_host_data, m_tensor->data, size, *stream);
-    tpuRtStreamSynchronize(*stream);
+    if (m_staging) tpuRtEventRecord(m_staging->event, *stream);
+  }
+
+  // Return an array pointer to system memory of tensor.
+  byte* get_host_data() {
+    if (m_host_ready) return m_host_data;
+    start_host_copy();
+    TPUV7_TRACE_SCOPE("get_host_data");
+    if (m_staging) {
+      tpuRtEventSynchronize(m_staging->event);
+    } else {
+      tpuRtStreamSynchronize(*stream);
+    }
+    m_host_ready = true;
     return m_host_data;
   }
 
@@ -97,14 +230,127 @@ class BMNNTensor {
 
   float get_scale() { return m_scale; }
 
+  int get_zero_point() { return m_zero_point; }
+
   // tpuRtTensor_t operator()() { return *m_tensor; }
 
  private:
   std::string m_name;
   byte* m_host_data;
   float m_scale;
+  int m_zero_point;
   tpuRtTensor_t* m_tensor;
   tpuRtStream_t* stream;
+  HostStagingSlot* m_staging;
+  bool m_host_ready = false;
+};
+
+/*
+ * Largest batch and per tensor bytes over the compiled stages of one net,
+ * what every network instance sizes its device buffers with.
+ */
+struct BMNNStageTable {
+  int max_batch = -1;
+  std::vector<tensorSizeType> input_max_bytes;
+  std::vector<tensorSizeType> output_max_bytes;
+};
+
+/*
+ * Names, info and stage tables of the nets in a loaded bmodel, queried once
+ * and shared by every BMNNNetwork built on it.
+ */
+class BMNNNetInfo : public NoCopyable {
+ public:
+  explicit BMNNNetInfo(tpuRtNet_t net) {
+    m_net_number = tpuRtGetNetNames(net, &m_net_names);
+    for (int i = 0; i < m_net_number; ++i) {
+      m_infos.push_back(tpuRtGetNetInfo(net, m_net_names[i]));
+      m_tables.push_back(buildTable(m_infos.back()));
+    }
+  }
+
+  ~BMNNNetInfo() {
+    if (m_net_names) tpuRtFreeNetNames(m_net_names);
+  }
+
+  int netNum() const { return m_net_number; }
+  const char* netName(int idx) const { return m_net_names[idx]; }
+  const tpuRtNetInfo_t& info(int idx = 0) const { return m_infos[idx]; }
+  const BMNNStageTable& stageTable(int idx = 0) const { return m_tables[idx]; }
+
+ private:
+  static BMNNStageTable buildTable(const tpuRtNetInfo_t& info) {
+    BMNNStageTable table;
+    for (int s = 0; s < info.stage_num; s++) {
+      table.max_batch =
+          std::max(table.max_batch, info.stages[s].input_shapes[0].dims[0]);
+    }
+    for (int i = 0; i < info.input.num; ++i) {
+      tensorSizeType max_size = 0;
+      for (int s = 0; s < info.stage_num; s++) {
+        tpuRtTensor_t tensor;
+        tensor.dtype = info.input.dtypes[i];
+        tensor.shape = info.stages[s].input_shapes[i];
+        max_size = std::max(max_size, getTensorBytes(tensor));
+      }
+      table.input_max_bytes.push_back(max_size);
+    }
+    for (int i = 0; i < info.output.num; ++i) {
+      tensorSizeType max_size = 0;
+      for (int s = 0; s < info.stage_num; s++) {
+        tpuRtTensor_t tensor;
+        tensor.dtype = info.output.dtypes[i];
+        tensor.shape = info.stages[s].output_shapes[i];
+        max_size = std::max(max_size, getTensorBytes(tensor));
+      }
+      table.output_max_bytes.push_back(max_size);
+    }
+    return table;
+  }
+
+  char** m_net_names = NULL;
+  int m_net_number = 0;
+  std::vector<tpuRtNetInfo_t> m_infos;
+  std::vector<BMNNStageTable> m_tables;
+};
+
+/*
+ * Immutable input and output tensors of one compiled stage with device memory
+ * attached, stored contiguously (inputs then outputs) and passed to
+ * tpuRtLaunchNet as is. Create it once with BMNNNetwork::createBinding(),
+ * launching through it copies and allocates nothing.
+ */
+class BMNNIOBinding {
+ public:
+  BMNNIOBinding(int stage_idx, const std::vector<tpuRtTensor_t>& inputs,
+                const std::vector<tpuRtTensor_t>& outputs)
+      : m_stage_idx(stage_idx),
+        m_input_num(inputs.size()),
+        m_output_num(outputs.size()),
+        m_tensors(new tpuRtTensor_t[inputs.size() + outputs.size()]) {
+    std::copy(inputs.begin(), inputs.end(), m_tensors.get());
+    std::copy(outputs.begin(), outputs.end(), m_tensors.get() + m_input_num);
+  }
+
+  BMNNIOBinding(BMNNIOBinding&&) = default;
+  BMNNIOBinding& operator=(BMNNIOBinding&&) = default;
+
+  int stageIdx() const { return m_stage_idx; }
+  int inputNum() const { return m_input_num; }
+  int outputNum() const { return m_output_num; }
+
+  // The descriptors never change; the runtime only writes the device memory
+  // they point to, hence the non-const pointers.
+  tpuRtTensor_t* inputs() const { return m_tensors.get(); }
+  tpuRtTensor_t* outputs() const { return m_tensors.get() + m_input_num; }
+  tpuRtTensor_t* input(int index) const { return inputs() + index; }
+  tpuRtTensor_t* output(int index) const { return outputs() + index; }
+
+ private:
+  int m_stage_idx;
+  int m_input_num;
+  int m_output_num;
+  std::unique_ptr<tpuRtTensor_t[]> m_tensors;
 };
 
 class BMNNNetwork : public NoCopyable {
@@ -116,68 +362,90 @@ class BMNNNetwork : public NoCopyable {
   // tpuRtNetInfo_t* m_netinfo;
   tpuRtNetInfo_t m_netinfo;
   tpuRtStream_t stream;
-  char **net_names = NULL;
-  int net_number = 0;
+  std::shared_ptr<BMNNNetInfo> m_info;
+  std::shared_ptr<DeviceMemoryPool> m_pool;
+  std::vector<DeviceBuffer> m_inputBuffers;
+  std::vector<DeviceBuffer> m_outputBuffers;
+  std::vector<tensorSizeType> m_inputMaxBytes;
+  std::vector<tensorSizeType> m_outputMaxBytes;
+  std::unique_ptr<HostStagingArena> m_staging;
+  std::vector<std::unique_ptr<BMNNIOBinding>> m_bindings;
+  std::map<std::vector<int>, int> m_stageCache;
+  std::vector<char> m_padBuffer;
+  int m_net_idx;
 
  public:
-  BMNNNetwork(tpuRtNet_t* netPtr) : net(netPtr) {
-    net_number = tpuRtGetNetNames(*netPtr, &net_names);
-    m_netinfo = getInfo();
+  // With a pool, device memory of the largest stage is taken from it for
+  // every input and output, so forward() can run right away. Without `info`
+  // the net info is queried from the runtime. The info table is printed
+  // only when `verbose`, showInfo() prints it on demand. `net_idx` picks the
+  // net of a bmodel holding several.
+  BMNNNetwork(tpuRtNet_t* netPtr,
+              std::shared_ptr<DeviceMemoryPool> pool = nullptr,
+              std::shared_ptr<BMNNNetInfo> info = nullptr,
+              bool verbose = false, int net_idx = 0)
+      : net(netPtr), m_info(info), m_pool(pool), m_net_idx(net_idx) {
+    if (!m_info) m_info = std::make_shared<BMNNNetInfo>(*netPtr);
+    ASSERT(net_idx >= 0 && net_idx < m_info->netNum());
+    m_netinfo = getInfo(net_idx);
+    const BMNNStageTable& table = m_info->stageTable(net_idx);
+    m_max_batch = table.max_batch;
+    m_inputMaxBytes = table.input_max_bytes;
+    m_outputMaxBytes = table.output_max_bytes;
     tpuRtStreamCreate(&stream);
     m_inputTensors = new tpuRtTensor_t[m_netinfo.input.num];
     m_outputTensors = new tpuRtTensor_t[m_netinfo.output.num];
-    m_max_batch = -1;
-    for (int i = 0; i < m_netinfo.stage_num; i++) {
-      int b = m_netinfo.stages[i].input_shapes[0].dims[0];
-      m_max_batch = m_max_batch > b ? m_max_batch : b;
-    }
     for (int i = 0; i < m_netinfo.input.num; ++i) {
       m_inputTensors[i].dtype = m_netinfo.input.dtypes[i];
       m_inputTensors[i].shape = m_netinfo.stages[0].input_shapes[i];
-      //   m_inputTensors[i].device_mem = bm_mem_null();
+      m_inputTensors[i].data = nullptr;
     }
     for (int i = 0; i < m_netinfo.output.num; ++i) {
       m_outputTensors[i].dtype = m_netinfo.output.dtypes[i];
       m_outputTensors[i].shape = m_netinfo.stages[0].output_shapes[i];
-      tensorSizeType max_size = 0;
-      for (int s = 0; s < m_netinfo.stage_num; s++) {
-        tensorSizeType out_size = getTensorBytes(m_outputTensors[i]);
-        if (max_size < out_size) {
-          max_size = out_size;
-        }
-      }
-      // auto ret = tpuRtMalloc(&m_outputTensors[i].data, max_size, 0);
-      // ASSERT(ret == 0);
+      m_outputTensors[i].data = nullptr;
     }
-    showInfo();
+    if (m_pool) allocDeviceBuffers();
+    m_bindings.resize(m_netinfo.stage_num);
+    m_staging.reset(new HostStagingArena(m_outputMaxBytes, stream));
+    if (verbose) showInfo();
   }
 
+  // Launches and copies still queued on the stream write into the staging
+  // and the device buffers, so they are drained before either is released.
   ~BMNNNetwork() {
+    tpuRtStreamSynchronize(stream);
+    m_staging.reset();
+    m_inputBuffers.clear();
+    m_outputBuffers.clear();
     tpuRtStreamDestroy(stream);
-    
-    tpuRtFreeNetNames(net_names);
+
+    delete[] m_inputTensors;
+    delete[] m_outputTensors;
   }
 
   tpuRtNetInfo_t getInfo(int idx=0) {
-    return tpuRtGetNetInfo(*net, net_names[idx]);
+    return m_info->info(idx);
   }
 
 
   int maxBatch() const { return m_max_batch; }
 
+  // Index of the net in its bmodel.
+  int netIdx() const { return m_net_idx; }
+
+  const tpuRtNetInfo_t& getNetInfo() const { return m_netinfo; }
+
   const tpuRtStream_t* getStream() const { return &stream; }
   tpuRtStream_t* getStream() { return &stream; }
 
+  // With a stage, the tensor is the one of binding(stage_idx).
   std::shared_ptr<BMNNTensor> inputTensor(int index, int stage_idx = -1) {
-    if (stage_idx >= 0) {
-      for (int i = 0; i < m_netinfo.input.num; ++i) {
-        m_inputTensors[i].shape = m_netinfo.stages[stage_idx].input_shapes[i];
-        m_inputTensors[i].dtype = m_netinfo.input.dtypes[i];
-      }
-    }
-    return std::make_shared<BMNNTensor>(m_netinfo.input.names[index],
-                                        m_netinfo.input.scales[index],
-                                        &m_inputTensors[index], &stream);
+    tpuRtTensor_t* tensor = stage_idx >= 0 ? binding(stage_idx).input(index)
+                                           : &m_inputTensors[index];
+    return std::make_shared<BMNNTensor>(
+        m_netinfo.input.names[index], m_netinfo.input.scales[index], tensor,
+        &stream, nullptr, m_netinfo.input.zero_points[index]);
   }
 
   std::shared_ptr<tpuRtTensor_t> inputTpuRtTensor(int index,
@@ -191,16 +459,210 @@ class BMNNNetwork : public NoCopyable {
   const int inputTensorNum() const { return m_netinfo.input.num; }
   const int outputTensorNum() const { return m_netinfo.output.num; }
 
+  // With a stage, the tensor is the one of binding(stage_idx).
   std::shared_ptr<BMNNTensor> outputTensor(int index, int stage_idx = -1) {
-    if (stage_idx >= 0) {
-      for (int i = 0; i < m_netinfo.output.num; ++i) {
-        m_outputTensors[i].shape = m_netinfo.stages[stage_idx].output_shapes[i];
-        m_outputTensors[i].dtype = m_netinfo.output.dtypes[i];
+    tpuRtTensor_t* tensor = stage_idx >= 0 ? binding(stage_idx).output(index)
+                                           : &m_outputTensors[index];
+    return std::make_shared<BMNNTensor>(
+        m_netinfo.output.names[index], m_netinfo.output.scales[index], tensor,
+        &stream, m_staging->slot(index), m_netinfo.output.zero_points[index]);
+  }
+
+  // I/O of stage `stage_idx` on the device buffers of this network, built on
+  // first use. All stages share the buffers, sized for the largest stage.
+  const BMNNIOBinding& binding(int stage_idx) {
+    std::unique_ptr<BMNNIOBinding>& io = m_bindings[stage_idx];
+    if (io) return *io;
+    if (m_inputBuffers.empty() && m_outputBuffers.empty()) allocDeviceBuffers();
+    std::vector<void*> input_data, output_data;
+    for (int i = 0; i < m_netinfo.input.num; ++i) {
+      input_data.push_back(m_inputTensors[i].data);
+    }
+    for (int i = 0; i < m_netinfo.output.num; ++i) {
+      output_data.push_back(m_outputTensors[i].data);
+    }
+    io.reset(new BMNNIOBinding(createBinding(input_data, output_data, stage_idx)));
+    return *io;
+  }
+
+  // Binding of stage `stage_idx` on caller owned device memory, one pointer
+  // per input and output, each large enough for that stage.
+  BMNNIOBinding createBinding(const std::vector<void*>& inputData,
+                              const std::vector<void*>& outputData,
+                              int stage_idx = 0) const {
+    std::vector<tpuRtTensor_t> inputs(m_netinfo.input.num);
+    std::vector<tpuRtTensor_t> outputs(m_netinfo.output.num);
+    for (int i = 0; i < m_netinfo.input.num; ++i) {
+      inputs[i].dtype = m_netinfo.input.dtypes[i];
+      inputs[i].shape = m_netinfo.stages[stage_idx].input_shapes[i];
+      inputs[i].data = inputData[i];
+    }
+    for (int i = 0; i < m_netinfo.output.num; ++i) {
+      outputs[i].dtype = m_netinfo.output.dtypes[i];
+      outputs[i].shape = m_netinfo.stages[stage_idx].output_shapes[i];
+      outputs[i].data = outputData[i];
+    }
+    return BMNNIOBinding(stage_idx, inputs, outputs);
+  }
+
+  // The stage that holds inputs of `shapes` with the least padding, -1 when
+  // none does. Cached per set of shapes.
+  int selectStage(const std::vector<tpuRtShape_t>& shapes) {
+    std::vector<int> key;
+    for (auto& shape : shapes) {
+      key.insert(key.end(), shape.dims, shape.dims + shape.num_dims);
+      key.push_back(-1);
+    }
+    auto it = m_stageCache.find(key);
+    if (it != m_stageCache.end()) return it->second;
+
+    int best = -1;
+    tensorSizeType best_elements = 0;
+    for (int s = 0; s < m_netinfo.stage_num; ++s) {
+      bool fits = (int)shapes.size() == m_netinfo.input.num;
+      tensorSizeType elements = 0;
+      for (int i = 0; fits && i < m_netinfo.input.num; ++i) {
+        const tpuRtShape_t& stage_shape = m_netinfo.stages[s].input_shapes[i];
+        fits = shapes[i].num_dims == stage_shape.num_dims;
+        for (int d = 0; fits && d < stage_shape.num_dims; ++d) {
+          fits = shapes[i].dims[d] <= stage_shape.dims[d];
+        }
+        elements += getShapeElements(stage_shape);
+      }
+      if (fits && (best < 0 || elements < best_elements)) {
+        best = s;
+        best_elements = elements;
+      }
+    }
+    m_stageCache.emplace(key, best);
+    return best;
+  }
+
+  // Copy a host input of `shape` into input `index` of `binding`, padding
+  // every dim up to the stage shape with the zero point of the input, which
+  // dequantizes to 0. Missing frames of a batch are padded as well, they do
+  // not keep the data of an earlier request.
+  tpuRtStatus_t uploadInput(const BMNNIOBinding& binding, int index,
+                            const void* host, const tpuRtShape_t& shape) {
+    const tpuRtTensor_t& dst = *binding.input(index);
+    tpuRtTensor_t src = dst;
+    src.shape = shape;
+    bool inner_equal = true;
+    for (int d = 1; d < shape.num_dims; ++d) {
+      inner_equal = inner_equal && shape.dims[d] == dst.shape.dims[d];
+    }
+    int zero_point = m_netinfo.input.zero_points[index];
+    tensorSizeType dst_bytes = getTensorBytes(dst);
+    TPUV7_TRACE_SCOPE("tpuRtMemcpyS2D");
+    if (inner_equal) {
+      // missing frames of a batch are whole trailing blocks, nothing to move
+      tensorSizeType bytes = getTensorBytes(src);
+      tpuRtStatus_t ret = tpuRtMemcpyS2D(dst.data, host, bytes);
+      if (ret != tpuRtSuccess || bytes >= dst_bytes) return ret;
+      m_padBuffer.resize(dst_bytes - bytes);
+      fillZeroPoint(m_padBuffer.data(), m_padBuffer.size(), dst.dtype,
+                    zero_point);
+      return tpuRtMemcpyS2D(static_cast<char*>(dst.data) + bytes,
+                            m_padBuffer.data(), m_padBuffer.size());
+    }
+
+    tensorSizeType elem = dst_bytes / getShapeElements(dst.shape);
+    ASSERT(elem * getShapeElements(dst.shape) == dst_bytes);
+    m_padBuffer.resize(dst_bytes);
+    fillZeroPoint(m_padBuffer.data(), dst_bytes, dst.dtype, zero_point);
+    int nd = shape.num_dims;
+    tensorSizeType row = shape.dims[nd - 1] * elem;
+    tensorSizeType rows = getShapeElements(shape) / shape.dims[nd - 1];
+    std::vector<int> idx(nd, 0);
+    const char* src_row = static_cast<const char*>(host);
+    for (tensorSizeType r = 0; r < rows; ++r, src_row += row) {
+      tensorSizeType offset = 0;
+      for (int d = 0; d < nd; ++d) offset = offset * dst.shape.dims[d] + idx[d];
+      memcpy(m_padBuffer.data() + offset * elem, src_row, row);
+      for (int d = nd - 2; d >= 0 && ++idx[d] == shape.dims[d]; --d) {
+        idx[d] = 0;
+      }
+    }
+    return tpuRtMemcpyS2D(dst.data, m_padBuffer.data(), dst_bytes);
+  }
+
+  // Pick the stage for host inputs of `shapes`, upload them padded to it and
+  // launch. The binding that ran is returned through `used`, its outputs are
+  // in outputTensor(i, (*used)->stageIdx()).
+  tpuRtStatus_t forward(const std::vector<const void*>& hostInputs,
+                        const std::vector<tpuRtShape_t>& shapes,
+                        const BMNNIOBinding** used = nullptr) {
+    int stage_idx = selectStage(shapes);
+    if (stage_idx < 0) return tpuRtErrParam;
+    const BMNNIOBinding& io = binding(stage_idx);
+    for (int i = 0; i < m_netinfo.input.num; ++i) {
+      tpuRtStatus_t ret = uploadInput(io, i, hostInputs[i], shapes[i]);
+      if (ret != tpuRtSuccess) return ret;
+    }
+    if (used) *used = &io;
+    return forward(io);
+  }
+
+  tpuRtStatus_t forward(const BMNNIOBinding& binding) {
+    TPUV7_TRACE_SCOPE("forward");
+    return tpuRtLaunchNet(*net, binding.inputs(), binding.outputs(),
+                          m_netinfo.name, stream);
+  }
+
+  // Launch every stage `launches` times on binding(stage), so the one time
+  // costs of the runtime (first launch of a stage, device buffers, bindings)
+  // are paid before the first real request. Inputs are first filled with
+  // their zero point, as padding is; the stages share the input buffers, so
+  // filling them whole through binding(0) covers every stage.
+  tpuRtStatus_t warmup(int launches = 1) {
+    TPUV7_TRACE_SCOPE("warmup");
+    for (int s = 0; s < m_netinfo.stage_num && launches > 0; ++s) {
+      const BMNNIOBinding& io = binding(s);
+      if (s == 0) {
+        for (int i = 0; i < m_netinfo.input.num; ++i) {
+          m_padBuffer.resize(m_inputMaxBytes[i]);
+          fillZeroPoint(m_padBuffer.data(), m_inputMaxBytes[i],
+                        m_netinfo.input.dtypes[i],
+                        m_netinfo.input.zero_points[i]);
+          tpuRtStatus_t ret = tpuRtMemcpyS2D(io.input(i)->data,
+                                             m_padBuffer.data(),
+                                             m_inputMaxBytes[i]);
+          if (ret != tpuRtSuccess) return ret;
+        }
       }
+      for (int n = 0; n < launches; ++n) {
+        tpuRtStatus_t ret = forward(io);
+        if (ret != tpuRtSuccess) return ret;
+      }
+    }
+    return tpuRtSuccess;
+  }
+
+  // Queue the read back of every output at once, in output order, into the
+  // staging arena of the network. get_host_data() on each returned tensor
+  // waits for that output only, so decoding the first output overlaps the
+  // copy of the others.
+  std::vector<std::shared_ptr<BMNNTensor>> startOutputCopies() {
+    std::vector<std::shared_ptr<BMNNTensor>> ret;
+    for (int i = 0; i < m_netinfo.output.num; ++i) {
+      ret.push_back(outputTensor(i));
+      ret.back()->start_host_copy();
+    }
+    return ret;
+  }
+
+  // Same as above for outputs launched through forward(inputs, outputs).
+  std::vector<std::shared_ptr<BMNNTensor>> startOutputCopies(
+      std::vector<std::shared_ptr<tpuRtTensor_t>>& outputTensors) {
+    std::vector<std::shared_ptr<BMNNTensor>> ret;
+    for (int i = 0; i < m_netinfo.output.num; ++i) {
+      ret.push_back(std::make_shared<BMNNTensor>(
+          m_netinfo.output.names[i], m_netinfo.output.scales[i],
+          outputTensors[i].get(), &stream, m_staging->slot(i),
+          m_netinfo.output.zero_points[i]));
+      ret.back()->start_host_copy();
     }
-    return std::make_shared<BMNNTensor>(m_netinfo.output.names[index],
-                                        m_netinfo.output.scales[index],
-                                        &m_outputTensors[index], &stream);
+    return ret;
   }
 
   std::shared_ptr<tpuRtTensor_t> outputTpuRtTensor(int index,
@@ -212,6 +674,7 @@ class BMNNNetwork : public NoCopyable {
   }
 
   tpuRtStatus_t forward() {
+    TPUV7_TRACE_SCOPE("forward");
     tpuRtStatus_t ret;
     ret = tpuRtLaunchNet(*net, m_inputTensors, m_outputTensors, m_netinfo.name,
                          stream);
@@ -221,6 +684,7 @@ class BMNNNetwork : public NoCopyable {
   tpuRtStatus_t forward(
       std::vector<std::shared_ptr<tpuRtTensor_t>>& inputTensors,
       std::vector<std::shared_ptr<tpuRtTensor_t>>& outputTensors) {
+    TPUV7_TRACE_SCOPE("forward");
     tpuRtTensor_t tempInputTensors[m_netinfo.input.num];
     for (int i = 0; i < m_netinfo.input.num; ++i)
       tempInputTensors[i] = *inputTensors[i];
@@ -237,6 +701,7 @@ class BMNNNetwork : public NoCopyable {
   }
 
   tpuRtStatus_t forwardAsync() {
+    TPUV7_TRACE_SCOPE("forwardAsync");
     tpuRtStatus_t ret;
     ret = tpuRtLaunchNetAsync(*net, m_inputTensors,
                               m_outputTensors, m_netinfo.name, stream);
@@ -246,6 +711,7 @@ class BMNNNetwork : public NoCopyable {
   tpuRtStatus_t forwardAsync(
       std::vector<std::shared_ptr<tpuRtTensor_t>>& inputTensors,
       std::vector<std::shared_ptr<tpuRtTensor_t>>& outputTensors) {
+    TPUV7_TRACE_SCOPE("forwardAsync");
     tpuRtTensor_t tempInputTensors[m_netinfo.input.num];
     for (int i = 0; i < m_netinfo.input.num; ++i)
       tempInputTensors[i] = *inputTensors[i];
@@ -259,6 +725,29 @@ class BMNNNetwork : public NoCopyable {
     return ret;
   }
 
+  tpuRtStatus_t forwardAsync(const BMNNIOBinding& binding) {
+    TPUV7_TRACE_SCOPE("forwardAsync");
+    return tpuRtLaunchNetAsync(*net, binding.inputs(), binding.outputs(),
+                               m_netinfo.name, stream);
+  }
+
+  tpuRtStatus_t forwardAsync(const BMNNIOBinding& binding,
+                             tpuRtStream_t launchStream) {
+    TPUV7_TRACE_SCOPE("forwardAsync");
+    return tpuRtLaunchNetAsync(*net, binding.inputs(), binding.outputs(),
+                               m_netinfo.name, launchStream);
+  }
+
+  // Launch on a stream owned by the caller, for engines that keep several
+  // sets of device I/O in flight.
+  tpuRtStatus_t forwardAsync(const tpuRtTensor_t* inputTensors,
+                             tpuRtTensor_t* outputTensors,
+                             tpuRtStream_t launchStream) {
+    TPUV7_TRACE_SCOPE("forwardAsync");
+    return tpuRtLaunchNetAsync(*net, inputTensors, outputTensors,
+                               m_netinfo.name, launchStream);
+  }
+
   static std::string shape_to_str(const tpuRtShape_t& shape) {
     std::string str = "[ ";
     for (int i = 0; i < shape.num_dims; i++) {
@@ -292,31 +781,184 @@ class BMNNNetwork : public NoCopyable {
     }
     printf("########################\n\n");
   }
+
+ private:
+  void allocDeviceBuffers() {
+    if (!m_pool) m_pool = std::make_shared<DeviceMemoryPool>();
+    for (int i = 0; i < m_netinfo.input.num; ++i) {
+      m_inputBuffers.push_back(m_pool->acquire(m_inputMaxBytes[i]));
+      ASSERT(m_inputBuffers.back());
+      m_inputTensors[i].data = m_inputBuffers.back().data();
+    }
+    for (int i = 0; i < m_netinfo.output.num; ++i) {
+      m_outputBuffers.push_back(m_pool->acquire(m_outputMaxBytes[i]));
+      ASSERT(m_outputBuffers.back());
+      m_outputTensors[i].data = m_outputBuffers.back().data();
+    }
+  }
+};
+
+/*
+ * Pool of network instances of one loaded bmodel, each with its own stream
+ * and preallocated I/O, sharing the net info. acquire() hands out the least
+ * loaded instance: the one with the fewest current users, then the fewest
+ * acquisitions so far. An instance takes at most `max_users` users at once;
+ * keep it at 1 when callers use the instance I/O tensors.
+ */
+class BMNNNetworkPool : public NoCopyable {
+ public:
+  /*
+   * Use of one instance, given back to the pool on destruction. The pool must
+   * outlive its leases.
+   */
+  class Lease {
+   public:
+    Lease() = default;
+    Lease(BMNNNetworkPool* pool, int index) : m_pool(pool), m_index(index) {}
+    Lease(Lease&& other) noexcept { *this = std::move(other); }
+    Lease& operator=(Lease&& other) noexcept {
+      if (this != &other) {
+        release();
+        m_pool = other.m_pool;
+        m_index = other.m_index;
+        other.m_pool = nullptr;
+      }
+      return *this;
+    }
+    ~Lease() { release(); }
+
+    BMNNNetwork* operator->() const { return get().get(); }
+    BMNNNetwork& operator*() const { return *get(); }
+    std::shared_ptr<BMNNNetwork> get() const {
+      return m_pool->m_instances[m_index];
+    }
+    int index() const { return m_index; }
+    explicit operator bool() const { return m_pool != nullptr; }
+
+    void release() {
+      if (m_pool) m_pool->release(m_index);
+      m_pool = nullptr;
+    }
+
+   private:
+    BMNNNetworkPool* m_pool = nullptr;
+    int m_index = -1;
+  };
+
+  BMNNNetworkPool(tpuRtNet_t* net, std::shared_ptr<BMNNNetInfo> info,
+                  std::shared_ptr<DeviceMemoryPool> pool, int instance_num,
+                  int max_users = 1, bool verbose = false, int net_idx = 0)
+      : m_max_users(max_users),
+        m_users(instance_num, 0),
+        m_acquisitions(instance_num, 0) {
+    for (int i = 0; i < instance_num; ++i) {
+      m_instances.push_back(
+          std::make_shared<BMNNNetwork>(net, pool, info, false, net_idx));
+    }
+    if (verbose && instance_num > 0) m_instances[0]->showInfo();
+  }
+
+  int size() const { return m_instances.size(); }
+
+  // BMNNNetwork::warmup() on every instance.
+  tpuRtStatus_t warmup(int launches = 1) {
+    for (auto& instance : m_instances) {
+      tpuRtStatus_t ret = instance->warmup(launches);
+      if (ret != tpuRtSuccess) return ret;
+    }
+    return tpuRtSuccess;
+  }
+
+  // Block until an instance has room for one more user.
+  Lease acquire() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    int index = -1;
+    m_cv.wait(lock, [&] { return (index = leastLoaded()) >= 0; });
+    m_users[index]++;
+    m_acquisitions[index]++;
+    return Lease(this, index);
+  }
+
+  // Acquisitions of every instance so far.
+  std::vector<unsigned long long> acquisitions() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_acquisitions;
+  }
+
+ private:
+  int leastLoaded() {
+    int best = -1;
+    for (int i = 0; i < (int)m_instances.size(); ++i) {
+      if (m_users[i] >= m_max_users) continue;
+      if (best < 0 || m_users[i] < m_users[best] ||
+          (m_users[i] == m_users[best] &&
+           m_acquisitions[i] < m_acquisitions[best])) {
+        best = i;
+      }
+    }
+    return best;
+  }
+
+  void release(int index) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_users[index]--;
+    }
+    m_cv.notify_one();
+  }
+
+  std::vector<std::shared_ptr<BMNNNetwork>> m_instances;
+  int m_max_users;
+  std::vector<int> m_users;
+  std::vector<unsigned long long> m_acquisitions;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
 };
 
 /*
  * Help user managing handles and networks of a bmodel, using class instances
- * above.
+ * above. A context given a device keeps its buffers and network streams on
+ * it, whatever the current device of the calling thread.
  */
 class BMNNContext : public NoCopyable {
   tpuRtNet_t net;
   tpuRtNetContext_t context;
   std::vector<std::string> m_network_names;
+  int m_device;
+  std::shared_ptr<DeviceMemoryPool> m_pool;
+  std::shared_ptr<BMNNNetInfo> m_info;
+  bool m_loaded = true;
 
  public:
-  BMNNContext(const char* bmodel_file) {
+  explicit BMNNContext(const char* bmodel_file, int device = -1)
+      : m_device(device), m_pool(std::make_shared<DeviceMemoryPool>(device)) {
+    ScopedDevice scope(m_device);
     auto ret = tpuRtCreateNetContext(&context);
     ret = tpuRtLoadNet(bmodel_file, context, &net);
     if (ret != tpuRtSuccess) {
       std::cout << "load bmodel(" << bmodel_file << ") failed" << std::endl;
+      m_loaded = false;
+      return;
+    }
+    m_info = std::make_shared<BMNNNetInfo>(net);
+    for (int i = 0; i < m_info->netNum(); ++i) {
+      m_network_names.push_back(m_info->netName(i));
     }
   }
 
   ~BMNNContext() {
-    tpuRtUnloadNet(net);
+    if (m_loaded) tpuRtUnloadNet(net);
     tpuRtDestroyNetContext(context);
   }
 
+  bool loaded() const { return m_loaded; }
+
+  // -1 when the context follows the current device.
+  int device() const { return m_device; }
+
+  // Shared by every network of this context.
+  std::shared_ptr<BMNNNetInfo> netInfo() { return m_info; }
+
   std::string network_name(int index) {
     if (index >= (int)m_network_names.size()) {
       return "Invalid index";
@@ -325,10 +967,52 @@ class BMNNContext : public NoCopyable {
     return m_network_names[index];
   }
 
-  std::shared_ptr<BMNNNetwork> network() {
-    return std::make_shared<BMNNNetwork>(&net);
+  int networkNum() const { return m_network_names.size(); }
+
+  // Index of the net called `name`, -1 when the bmodel has none.
+  int networkIndex(const std::string& name) const {
+    for (int i = 0; i < (int)m_network_names.size(); ++i) {
+      if (m_network_names[i] == name) return i;
+    }
+    return -1;
+  }
+
+  // The first net of the bmodel.
+  std::shared_ptr<BMNNNetwork> network(bool verbose = false) {
+    return networkAt(0, verbose);
+  }
+
+  // Net `net_idx` of the bmodel, on the weights and memory pool of this
+  // context.
+  std::shared_ptr<BMNNNetwork> networkAt(int net_idx, bool verbose = false) {
+    ScopedDevice scope(m_device);
+    return std::make_shared<BMNNNetwork>(&net, m_pool, m_info, verbose,
+                                         net_idx);
+  }
+
+  // One network of every net of the bmodel, in bmodel order.
+  std::vector<std::shared_ptr<BMNNNetwork>> networks(bool verbose = false) {
+    std::vector<std::shared_ptr<BMNNNetwork>> ret;
+    for (int i = 0; i < networkNum(); ++i) ret.push_back(networkAt(i, verbose));
+    return ret;
+  }
+
+  // `instance_num` networks of net `net_idx` sharing the loaded weights and
+  // the net info.
+  std::shared_ptr<BMNNNetworkPool> networkPool(int instance_num,
+                                               int max_users = 1,
+                                               bool verbose = false,
+                                               int net_idx = 0) {
+    ScopedDevice scope(m_device);
+    return std::make_shared<BMNNNetworkPool>(
+        &net, m_info, m_pool, instance_num, max_users, verbose, net_idx);
   }
 
+  // Device buffers of every network of this context come from here.
+  std::shared_ptr<DeviceMemoryPool> memoryPool() { return m_pool; }
+
+  MemoryPoolStats memoryPoolStats() { return m_pool->stats(); }
+
   //   std::shared_ptr<BMNNNetwork> network() {
   //     return std::make_shared<BMNNNetwork>();
   //   }
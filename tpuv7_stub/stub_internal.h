@@ -0,0 +1,62 @@
+#ifndef TPUV7_STUB_INTERNAL_H_
+#define TPUV7_STUB_INTERNAL_H_
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+
+#include "tpuv7_rt.h"
+
+namespace tpuv7_stub {
+
+/*
+ * Latency model and outputs of the stand-in runtime, read once from the
+ * TPUV7_STUB_* environment variables, see README.md.
+ */
+struct Config {
+  int devices = 1;
+  // launch time: launch_us + launch_per_frame_us * (batch - 1)
+  double launch_us = 2000;
+  double launch_per_frame_us = 600;
+  // copy time: copy_us + bytes / bandwidth
+  double copy_us = 20;
+  double h2d_gbps = 8;
+  double d2h_gbps = 8;
+  double d2d_gbps = 64;
+  // tpuRtLoadNet time, on the DMA engine of the current device
+  double load_us = 0;
+  // per device, 0 for no limit
+  unsigned long long mem_bytes = 0;
+  // write outputs on every launch
+  bool fill_outputs = true;
+  // raw outputs, frame after frame, replayed instead of synthetic ones
+  std::string output_file;
+  int objects = 8;  // synthetic objects per frame
+  unsigned seed = 1;
+  bool verbose = false;
+};
+
+const Config& config();
+
+int64_t nowNs();
+void sleepUntilNs(int64_t deadline);
+
+enum Engine { kCompute, kDma, kEngineNum };
+
+// Book `us` on `engine` of `device` after the work already booked there and
+// return when it ends, the caller sleeps until then. Engines run one thing
+// at a time, so streams sharing a device contend for it.
+int64_t reserve(int device, Engine engine, double us);
+
+int currentDevice();
+int streamDevice(tpuRtStream_t stream);
+// Device of the tpuRtMalloc allocation holding `ptr`, -1 for other memory.
+int allocationDevice(const void* ptr);
+
+// Run `task` in order on `stream`, or at once when stream is null.
+void enqueue(tpuRtStream_t stream, std::function<void()> task);
+
+}  // namespace tpuv7_stub
+
+#endif
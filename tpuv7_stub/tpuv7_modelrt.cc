@@ -0,0 +1,524 @@
+#include "tpuv7_modelrt.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "stub_internal.h"
+
+using namespace tpuv7_stub;
+
+namespace {
+
+// distinct synthetic frames cycled through by the launches of a stage
+const int kSyntheticFrames = 4;
+
+// Used when the loaded file is not a stub description: yolov5s with the
+// three 5-D heads of the 3output bmodels, compiled for batch 1 and 4.
+const char* kDefaultDescription =
+    "# tpuv7-stub\n"
+    "net yolov5s\n"
+    "stages 1 4\n"
+    "input images f32 3 640 640\n"
+    "output output0 f32 3 80 80 85\n"
+    "output output1 f32 3 40 40 85\n"
+    "output output2 f32 3 20 20 85\n";
+
+struct IODesc {
+  std::string name;
+  tpuRtDataType_t dtype = TPU_FLOAT32;
+  float scale = 1.f;
+  int zero_point = 0;
+  std::vector<int> dims;  // without batch
+};
+
+size_t dtypeBits(tpuRtDataType_t dtype) {
+  switch (dtype) {
+    case TPU_FLOAT32:
+    case TPU_INT32:
+    case TPU_UINT32:
+      return 32;
+    case TPU_FLOAT16:
+    case TPU_BFLOAT16:
+    case TPU_INT16:
+    case TPU_UINT16:
+      return 16;
+    case TPU_INT8:
+    case TPU_UINT8:
+      return 8;
+    case TPU_INT4:
+    case TPU_UINT4:
+      return 4;
+  }
+  return 32;
+}
+
+size_t shapeBytes(const tpuRtShape_t& shape, tpuRtDataType_t dtype) {
+  size_t elements = 1;
+  for (int d = 0; d < shape.num_dims; ++d) elements *= shape.dims[d];
+  return (elements * dtypeBits(dtype) + 7) / 8;
+}
+
+bool sameShape(const tpuRtShape_t& a, const tpuRtShape_t& b) {
+  if (a.num_dims != b.num_dims) return false;
+  for (int d = 0; d < a.num_dims; ++d) {
+    if (a.dims[d] != b.dims[d]) return false;
+  }
+  return true;
+}
+
+bool parseDtype(const std::string& s, tpuRtDataType_t* dtype) {
+  static const std::map<std::string, tpuRtDataType_t> names = {
+      {"f32", TPU_FLOAT32}, {"f16", TPU_FLOAT16}, {"bf16", TPU_BFLOAT16},
+      {"i8", TPU_INT8},     {"u8", TPU_UINT8},    {"i16", TPU_INT16},
+      {"u16", TPU_UINT16},  {"i32", TPU_INT32},   {"u32", TPU_UINT32}};
+  auto it = names.find(s);
+  if (it == names.end()) return false;
+  *dtype = it->second;
+  return true;
+}
+
+uint16_t floatToHalf(float f) {
+  uint32_t x;
+  memcpy(&x, &f, 4);
+  uint32_t sign = (x >> 16) & 0x8000;
+  int exp = ((x >> 23) & 0xff) - 127 + 15;
+  uint32_t mant = x & 0x7fffff;
+  if (exp <= 0) return sign;
+  if (exp >= 31) return sign | 0x7c00;
+  return sign | (exp << 10) | ((mant + 0x1000) >> 13);
+}
+
+// Store real value v as element i of a buffer of `io`.
+void storeValue(const IODesc& io, char* base, size_t i, float v) {
+  float q = io.dtype == TPU_FLOAT32 || io.dtype == TPU_FLOAT16 ||
+                    io.dtype == TPU_BFLOAT16
+                ? v
+                : roundf(v / io.scale) + io.zero_point;
+  switch (io.dtype) {
+    case TPU_FLOAT32:
+      reinterpret_cast<float*>(base)[i] = q;
+      break;
+    case TPU_FLOAT16:
+      reinterpret_cast<uint16_t*>(base)[i] = floatToHalf(q);
+      break;
+    case TPU_BFLOAT16: {
+      uint32_t x;
+      memcpy(&x, &q, 4);
+      reinterpret_cast<uint16_t*>(base)[i] = (x + 0x8000) >> 16;
+      break;
+    }
+    case TPU_INT8:
+      reinterpret_cast<int8_t*>(base)[i] =
+          std::min(127.f, std::max(-128.f, q));
+      break;
+    case TPU_UINT8:
+      reinterpret_cast<uint8_t*>(base)[i] = std::min(255.f, std::max(0.f, q));
+      break;
+    case TPU_INT16:
+      reinterpret_cast<int16_t*>(base)[i] =
+          std::min(32767.f, std::max(-32768.f, q));
+      break;
+    case TPU_UINT16:
+      reinterpret_cast<uint16_t*>(base)[i] =
+          std::min(65535.f, std::max(0.f, q));
+      break;
+    case TPU_INT32:
+      reinterpret_cast<int32_t*>(base)[i] = q;
+      break;
+    case TPU_UINT32:
+      reinterpret_cast<uint32_t*>(base)[i] = std::max(0.f, q);
+      break;
+    default:
+      break;
+  }
+}
+
+/*
+ * One frame of a YOLOv5 style output. 5-D heads [b, 3, h, w, 5 + C] hold
+ * logits: background cells at -10, `objects` cells with a box the size of
+ * the anchor, objectness and one class at +4. 3-D outputs [b, N, 5 + C] hold
+ * decoded boxes in pixels and probabilities. Anything else is zero.
+ */
+void syntheticFrame(const IODesc& io, int net_w, int net_h, unsigned seed,
+                    std::vector<char>& frame) {
+  tpuRtShape_t shape;
+  shape.num_dims = io.dims.size();
+  std::copy(io.dims.begin(), io.dims.end(), shape.dims);
+  size_t elements = 1;
+  for (int d : io.dims) elements *= d;
+  frame.assign(shapeBytes(shape, io.dtype), 0);
+  int attrs = io.dims.back();
+  bool head = io.dims.size() == 4 && attrs > 5;
+  bool rows = io.dims.size() == 2 && attrs > 5;
+  if (!head && !rows) return;
+
+  float background = head ? -10.f : 0.f;
+  for (size_t i = 0; i < elements; ++i) {
+    storeValue(io, frame.data(), i, background);
+  }
+  size_t cells = elements / attrs;
+  std::mt19937 rng(seed);
+  for (int k = 0; k < config().objects; ++k) {
+    size_t cell = rng() % cells;
+    int cls = rng() % (attrs - 5);
+    size_t base = cell * attrs;
+    if (head) {
+      for (int a = 0; a < 4; ++a) storeValue(io, frame.data(), base + a, 0.f);
+      storeValue(io, frame.data(), base + 4, 4.f);
+      storeValue(io, frame.data(), base + 5 + cls, 4.f);
+    } else {
+      float w = 20 + rng() % 200, h = 20 + rng() % 200;
+      float x = w / 2 + rng() % std::max(1, net_w - (int)w);
+      float y = h / 2 + rng() % std::max(1, net_h - (int)h);
+      storeValue(io, frame.data(), base + 0, x);
+      storeValue(io, frame.data(), base + 1, y);
+      storeValue(io, frame.data(), base + 2, w);
+      storeValue(io, frame.data(), base + 3, h);
+      storeValue(io, frame.data(), base + 4, 0.9f);
+      storeValue(io, frame.data(), base + 5 + cls, 0.9f);
+    }
+  }
+}
+
+struct StubNet {
+  std::string name;
+  std::vector<IODesc> inputs;
+  std::vector<IODesc> outputs;
+  std::vector<int> batches;
+
+  // storage behind info
+  tpuRtNetInfo_t info;
+  std::vector<const char*> input_names, output_names;
+  std::vector<float> input_scales, output_scales;
+  std::vector<int> input_zps, output_zps;
+  std::vector<tpuRtDataType_t> input_dtypes, output_dtypes;
+  std::vector<tpuRtStageInfo_t> stages;
+  std::vector<std::vector<tpuRtShape_t>> stage_inputs, stage_outputs;
+
+  // one frame of every output: synthetic ones, or frames of output_file
+  std::vector<std::vector<std::vector<char>>> frames;  // [frame][output]
+  std::mutex mutex;
+  unsigned long long launched_frames = 0;
+
+  void build() {
+    for (auto& io : inputs) {
+      input_names.push_back(io.name.c_str());
+      input_scales.push_back(io.scale);
+      input_zps.push_back(io.zero_point);
+      input_dtypes.push_back(io.dtype);
+    }
+    for (auto& io : outputs) {
+      output_names.push_back(io.name.c_str());
+      output_scales.push_back(io.scale);
+      output_zps.push_back(io.zero_point);
+      output_dtypes.push_back(io.dtype);
+    }
+    auto shapes = [](const std::vector<IODesc>& ios, int batch) {
+      std::vector<tpuRtShape_t> ret;
+      for (auto& io : ios) {
+        tpuRtShape_t shape;
+        shape.num_dims = io.dims.size() + 1;
+        shape.dims[0] = batch;
+        std::copy(io.dims.begin(), io.dims.end(), shape.dims + 1);
+        ret.push_back(shape);
+      }
+      return ret;
+    };
+    for (int batch : batches) {
+      stage_inputs.push_back(shapes(inputs, batch));
+      stage_outputs.push_back(shapes(outputs, batch));
+    }
+    for (size_t s = 0; s < batches.size(); ++s) {
+      stages.push_back(
+          tpuRtStageInfo_t{stage_inputs[s].data(), stage_outputs[s].data()});
+    }
+    info.name = name.c_str();
+    info.input = tpuRtIOInfo_t{(int)inputs.size(), input_names.data(),
+                               input_scales.data(), input_zps.data(),
+                               input_dtypes.data()};
+    info.output = tpuRtIOInfo_t{(int)outputs.size(), output_names.data(),
+                                output_scales.data(), output_zps.data(),
+                                output_dtypes.data()};
+    info.stage_num = stages.size();
+    info.stages = stages.data();
+  }
+
+  void loadFrames() {
+    int net_w = 640, net_h = 640;
+    if (!inputs.empty() && inputs[0].dims.size() == 3) {
+      net_h = inputs[0].dims[1];
+      net_w = inputs[0].dims[2];
+    }
+    std::vector<size_t> bytes;
+    size_t frame_bytes = 0;
+    for (auto& io : outputs) {
+      tpuRtShape_t shape;
+      shape.num_dims = io.dims.size();
+      std::copy(io.dims.begin(), io.dims.end(), shape.dims);
+      bytes.push_back(shapeBytes(shape, io.dtype));
+      frame_bytes += bytes.back();
+    }
+    if (!config().output_file.empty()) {
+      std::ifstream file(config().output_file, std::ios::binary);
+      std::vector<char> data((std::istreambuf_iterator<char>(file)),
+                             std::istreambuf_iterator<char>());
+      size_t count = frame_bytes ? data.size() / frame_bytes : 0;
+      for (size_t f = 0; f < count; ++f) {
+        std::vector<std::vector<char>> frame;
+        const char* p = data.data() + f * frame_bytes;
+        for (size_t bytes_i : bytes) {
+          frame.emplace_back(p, p + bytes_i);
+          p += bytes_i;
+        }
+        frames.push_back(std::move(frame));
+      }
+      if (frames.empty()) {
+        std::cerr << "[tpuv7 stub] no " << frame_bytes << " byte frame in "
+                  << config().output_file << ", using synthetic outputs"
+                  << std::endl;
+      }
+    }
+    for (int f = 0; frames.empty() || (config().output_file.empty() &&
+                                       f < kSyntheticFrames);
+         ++f) {
+      std::vector<std::vector<char>> frame(outputs.size());
+      for (size_t i = 0; i < outputs.size(); ++i) {
+        syntheticFrame(outputs[i], net_w, net_h,
+                       config().seed * 7919 + f * 31 + i, frame[i]);
+      }
+      frames.push_back(std::move(frame));
+      if (!config().output_file.empty()) break;
+    }
+  }
+
+  int findStage(const tpuRtTensor_t input[]) const {
+    for (size_t s = 0; s < stage_inputs.size(); ++s) {
+      bool match = true;
+      for (size_t i = 0; match && i < inputs.size(); ++i) {
+        match = sameShape(input[i].shape, stage_inputs[s][i]);
+      }
+      if (match) return s;
+    }
+    return -1;
+  }
+};
+
+struct StubModel {
+  std::vector<std::unique_ptr<StubNet>> nets;
+
+  StubNet* find(const char* name) {
+    for (auto& net : nets) {
+      if (!name || net->name == name) return net.get();
+    }
+    return nullptr;
+  }
+};
+
+bool parseDescription(std::istream& is, StubModel& model) {
+  std::string line;
+  StubNet* net = nullptr;
+  while (std::getline(is, line)) {
+    std::istringstream ls(line.substr(0, line.find('#')));
+    std::string key;
+    if (!(ls >> key)) continue;
+    if (key == "net") {
+      model.nets.emplace_back(new StubNet());
+      net = model.nets.back().get();
+      ls >> net->name;
+      continue;
+    }
+    if (!net) return false;
+    if (key == "stages") {
+      int batch;
+      while (ls >> batch) net->batches.push_back(batch);
+    } else if (key == "input" || key == "output") {
+      IODesc io;
+      std::string dtype, token;
+      ls >> io.name >> dtype;
+      if (!parseDtype(dtype, &io.dtype)) return false;
+      while (ls >> token) {
+        if (token == "scale") {
+          ls >> io.scale;
+        } else if (token == "zp") {
+          ls >> io.zero_point;
+        } else {
+          io.dims.push_back(atoi(token.c_str()));
+        }
+      }
+      if (io.dims.empty()) return false;
+      (key == "input" ? net->inputs : net->outputs).push_back(io);
+    } else {
+      return false;
+    }
+  }
+  for (auto& n : model.nets) {
+    if (n->batches.empty()) n->batches.push_back(1);
+    if (n->inputs.empty() || n->outputs.empty()) return false;
+  }
+  return !model.nets.empty();
+}
+
+}  // namespace
+
+extern "C" {
+
+tpuRtStatus_t tpuRtCreateNetContext(tpuRtNetContext_t* context) {
+  if (!context) return tpuRtErrParam;
+  *context = new int(0);
+  return tpuRtSuccess;
+}
+
+tpuRtStatus_t tpuRtDestroyNetContext(tpuRtNetContext_t context) {
+  delete static_cast<int*>(context);
+  return tpuRtSuccess;
+}
+
+/*
+ * A file starting with "# tpuv7-stub" describes the nets, see README.md; any
+ * other path, including a real bmodel, loads the built-in yolov5s.
+ */
+tpuRtStatus_t tpuRtLoadNet(const char* net_path, tpuRtNetContext_t context,
+                           tpuRtNet_t* net) {
+  (void)context;
+  if (!net) return tpuRtErrParam;
+  std::unique_ptr<StubModel> model(new StubModel());
+  std::ifstream file(net_path ? net_path : "");
+  std::string first;
+  bool described = file && std::getline(file, first) &&
+                   first.compare(0, 12, "# tpuv7-stub") == 0;
+  if (described) {
+    file.seekg(0);
+    if (!parseDescription(file, *model)) {
+      std::cerr << "[tpuv7 stub] bad description " << net_path << std::endl;
+      return tpuRtErrData;
+    }
+  } else {
+    std::istringstream is(kDefaultDescription);
+    parseDescription(is, *model);
+    if (config().verbose) {
+      std::cerr << "[tpuv7 stub] " << (net_path ? net_path : "(null)")
+                << " is not a stub description, loading yolov5s" << std::endl;
+    }
+  }
+  for (auto& n : model->nets) {
+    n->build();
+    n->loadFrames();
+  }
+  // weights go over the DMA engine, loads on one device queue behind it
+  if (config().load_us > 0) {
+    sleepUntilNs(reserve(currentDevice(), kDma, config().load_us));
+  }
+  *net = model.release();
+  return tpuRtSuccess;
+}
+
+tpuRtStatus_t tpuRtUnloadNet(tpuRtNet_t net) {
+  delete static_cast<StubModel*>(net);
+  return tpuRtSuccess;
+}
+
+int tpuRtGetNetNames(tpuRtNet_t net, char*** names) {
+  if (!net || !names) return 0;
+  StubModel& model = *static_cast<StubModel*>(net);
+  int n = model.nets.size();
+  *names = static_cast<char**>(calloc(n + 1, sizeof(char*)));
+  for (int i = 0; i < n; ++i) (*names)[i] = strdup(model.nets[i]->name.c_str());
+  return n;
+}
+
+void tpuRtFreeNetNames(char** names) {
+  if (!names) return;
+  for (char** p = names; *p; ++p) free(*p);
+  free(names);
+}
+
+tpuRtNetInfo_t tpuRtGetNetInfo(tpuRtNet_t net, const char* name) {
+  StubNet* stub = net ? static_cast<StubModel*>(net)->find(name) : nullptr;
+  if (!stub) {
+    tpuRtNetInfo_t empty;
+    memset(&empty, 0, sizeof(empty));
+    return empty;
+  }
+  return stub->info;
+}
+
+tpuRtStatus_t tpuRtLaunchNetAsync(tpuRtNet_t net, const tpuRtTensor_t input[],
+                                  tpuRtTensor_t output[], const char* net_name,
+                                  tpuRtStream_t stream) {
+  StubNet* stub = net ? static_cast<StubModel*>(net)->find(net_name) : nullptr;
+  if (!stub || !input || !output) return tpuRtErrParam;
+  int stage = stub->findStage(input);
+  if (stage < 0) {
+    std::cerr << "[tpuv7 stub] " << stub->name
+              << ": input shapes match no stage" << std::endl;
+    return tpuRtErrParam;
+  }
+  int batch = stub->batches[stage];
+  std::vector<void*> dst;
+  for (size_t i = 0; i < stub->outputs.size(); ++i) {
+    if (!output[i].data || !sameShape(output[i].shape,
+                                      stub->stage_outputs[stage][i])) {
+      return tpuRtErrParam;
+    }
+    dst.push_back(output[i].data);
+  }
+  for (size_t i = 0; i < stub->inputs.size(); ++i) {
+    if (!input[i].data) return tpuRtErrParam;
+  }
+  int device = stream ? streamDevice(stream) : currentDevice();
+  // a net only reads and writes the memory of the device it runs on
+  for (size_t i = 0; i < stub->inputs.size() + stub->outputs.size(); ++i) {
+    const void* data = i < stub->inputs.size()
+                           ? input[i].data
+                           : output[i - stub->inputs.size()].data;
+    int owner = allocationDevice(data);
+    if (owner >= 0 && owner != device) {
+      std::cerr << "[tpuv7 stub] " << stub->name << ": tensor on device "
+                << owner << " launched on device " << device << std::endl;
+      return tpuRtErrParam;
+    }
+  }
+  unsigned long long first;
+  {
+    std::lock_guard<std::mutex> lock(stub->mutex);
+    first = stub->launched_frames;
+    stub->launched_frames += batch;
+  }
+  double us = config().launch_us + config().launch_per_frame_us * (batch - 1);
+  enqueue(stream, [stub, dst, batch, first, device, us] {
+    int64_t end = reserve(device, kCompute, us);
+    if (config().fill_outputs) {
+      for (int b = 0; b < batch; ++b) {
+        auto& frame = stub->frames[(first + b) % stub->frames.size()];
+        for (size_t i = 0; i < dst.size(); ++i) {
+          memcpy(static_cast<char*>(dst[i]) + b * frame[i].size(),
+                 frame[i].data(), frame[i].size());
+        }
+      }
+    }
+    sleepUntilNs(end);
+  });
+  return tpuRtSuccess;
+}
+
+tpuRtStatus_t tpuRtLaunchNet(tpuRtNet_t net, const tpuRtTensor_t input[],
+                             tpuRtTensor_t output[], const char* net_name,
+                             tpuRtStream_t stream) {
+  tpuRtStatus_t ret =
+      tpuRtLaunchNetAsync(net, input, output, net_name, stream);
+  if (ret != tpuRtSuccess) return ret;
+  return tpuRtStreamSynchronize(stream);
+}
+
+}  // extern "C"
@@ -0,0 +1,85 @@
+#ifndef TPUV7_MODELRT_H_
+#define TPUV7_MODELRT_H_
+
+/*
+ * Stand-in declarations of the tpuv7 model runtime calls used by this repo,
+ * see tpuv7_stub/README.md. Built only with -DTPUV7_USE_STUB=ON.
+ */
+
+#include "tpuv7_rt.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+  TPU_FLOAT32 = 0,
+  TPU_FLOAT16 = 1,
+  TPU_INT8 = 2,
+  TPU_UINT8 = 3,
+  TPU_INT16 = 4,
+  TPU_UINT16 = 5,
+  TPU_INT32 = 6,
+  TPU_UINT32 = 7,
+  TPU_BFLOAT16 = 8,
+  TPU_INT4 = 9,
+  TPU_UINT4 = 10,
+} tpuRtDataType_t;
+
+#define TPURT_MAX_SHAPE_DIMS 8
+
+typedef struct {
+  int num_dims;
+  int dims[TPURT_MAX_SHAPE_DIMS];
+} tpuRtShape_t;
+
+typedef struct {
+  tpuRtDataType_t dtype;
+  tpuRtShape_t shape;
+  void* data;
+} tpuRtTensor_t;
+
+typedef struct {
+  tpuRtShape_t* input_shapes;
+  tpuRtShape_t* output_shapes;
+} tpuRtStageInfo_t;
+
+typedef struct {
+  int num;
+  char const** names;
+  float* scales;
+  int* zero_points;
+  tpuRtDataType_t* dtypes;
+} tpuRtIOInfo_t;
+
+typedef struct {
+  char const* name;
+  tpuRtIOInfo_t input;
+  tpuRtIOInfo_t output;
+  int stage_num;
+  tpuRtStageInfo_t* stages;
+} tpuRtNetInfo_t;
+
+typedef void* tpuRtNetContext_t;
+typedef void* tpuRtNet_t;
+
+tpuRtStatus_t tpuRtCreateNetContext(tpuRtNetContext_t* context);
+tpuRtStatus_t tpuRtDestroyNetContext(tpuRtNetContext_t context);
+tpuRtStatus_t tpuRtLoadNet(const char* net_path, tpuRtNetContext_t context,
+                           tpuRtNet_t* net);
+tpuRtStatus_t tpuRtUnloadNet(tpuRtNet_t net);
+int tpuRtGetNetNames(tpuRtNet_t net, char*** names);
+void tpuRtFreeNetNames(char** names);
+tpuRtNetInfo_t tpuRtGetNetInfo(tpuRtNet_t net, const char* name);
+tpuRtStatus_t tpuRtLaunchNet(tpuRtNet_t net, const tpuRtTensor_t input[],
+                             tpuRtTensor_t output[], const char* net_name,
+                             tpuRtStream_t stream);
+tpuRtStatus_t tpuRtLaunchNetAsync(tpuRtNet_t net, const tpuRtTensor_t input[],
+                                  tpuRtTensor_t output[], const char* net_name,
+                                  tpuRtStream_t stream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
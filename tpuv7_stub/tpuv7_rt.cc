@@ -0,0 +1,403 @@
+#include "tpuv7_rt.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "stub_internal.h"
+
+namespace tpuv7_stub {
+
+namespace {
+
+double envDouble(const char* name, double value) {
+  const char* env = getenv(name);
+  return env ? atof(env) : value;
+}
+
+struct Device {
+  std::mutex mutex;
+  int64_t free_ns[kEngineNum] = {0};
+  unsigned long long allocated = 0;
+};
+
+std::vector<std::unique_ptr<Device>>& devices() {
+  static std::vector<std::unique_ptr<Device>> ret = [] {
+    std::vector<std::unique_ptr<Device>> v;
+    for (int i = 0; i < config().devices; ++i) v.emplace_back(new Device());
+    return v;
+  }();
+  return ret;
+}
+
+thread_local int t_device = 0;
+
+struct Stream {
+  int device = 0;
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::condition_variable idle;
+  std::deque<std::function<void()>> tasks;
+  bool busy = false;
+  bool stop = false;
+
+  explicit Stream(int device) : device(device) {
+    worker = std::thread([this] { run(); });
+  }
+
+  ~Stream() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    cv.notify_all();
+    worker.join();
+  }
+
+  void push(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      tasks.push_back(std::move(task));
+    }
+    cv.notify_one();
+  }
+
+  void synchronize() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this] { return tasks.empty() && !busy; });
+  }
+
+ private:
+  void run() {
+    t_device = device;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      cv.wait(lock, [this] { return stop || !tasks.empty(); });
+      if (tasks.empty()) return;
+      std::function<void()> task = std::move(tasks.front());
+      tasks.pop_front();
+      busy = true;
+      lock.unlock();
+      task();
+      lock.lock();
+      busy = false;
+      if (tasks.empty()) idle.notify_all();
+    }
+  }
+};
+
+/*
+ * Recording queues a marker on the stream; the event is complete once every
+ * marker queued so far has run.
+ */
+struct Event {
+  std::mutex mutex;
+  std::condition_variable cv;
+  uint64_t recorded = 0;
+  uint64_t completed = 0;
+
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    uint64_t target = recorded;
+    cv.wait(lock, [&] { return completed >= target; });
+  }
+};
+
+// the handle owns one reference, queued markers hold their own
+using EventHandle = std::shared_ptr<Event>;
+
+std::mutex g_alloc_mutex;
+std::map<void*, std::pair<int, unsigned long long>> g_allocs;
+
+double copyUs(unsigned long long bytes, double gbps) {
+  return config().copy_us + bytes / (gbps * 1e3);
+}
+
+void copyOn(int device, void* dst, const void* src, unsigned long long bytes,
+            double gbps) {
+  int64_t end = reserve(device, kDma, copyUs(bytes, gbps));
+  memcpy(dst, src, bytes);
+  sleepUntilNs(end);
+}
+
+tpuRtStatus_t copyAsync(void* dst, const void* src, unsigned long long bytes,
+                        double gbps, tpuRtStream_t stream) {
+  if (!dst || !src) return tpuRtErrParam;
+  int device = stream ? streamDevice(stream) : currentDevice();
+  enqueue(stream, [=] { copyOn(device, dst, src, bytes, gbps); });
+  return tpuRtSuccess;
+}
+
+}  // namespace
+
+const Config& config() {
+  static Config ret = [] {
+    Config c;
+    c.devices = std::max(1, (int)envDouble("TPUV7_STUB_DEVICES", c.devices));
+    c.launch_us = envDouble("TPUV7_STUB_LAUNCH_US", c.launch_us);
+    c.launch_per_frame_us =
+        envDouble("TPUV7_STUB_LAUNCH_PER_FRAME_US", c.launch_per_frame_us);
+    c.copy_us = envDouble("TPUV7_STUB_COPY_US", c.copy_us);
+    c.h2d_gbps = envDouble("TPUV7_STUB_H2D_GBPS", c.h2d_gbps);
+    c.d2h_gbps = envDouble("TPUV7_STUB_D2H_GBPS", c.d2h_gbps);
+    c.d2d_gbps = envDouble("TPUV7_STUB_D2D_GBPS", c.d2d_gbps);
+    c.load_us = envDouble("TPUV7_STUB_LOAD_US", c.load_us);
+    c.mem_bytes = envDouble("TPUV7_STUB_MEM_MB", 0) * (1 << 20);
+    c.fill_outputs = envDouble("TPUV7_STUB_FILL_OUTPUTS", 1) != 0;
+    if (const char* file = getenv("TPUV7_STUB_OUTPUT")) c.output_file = file;
+    c.objects = envDouble("TPUV7_STUB_OBJECTS", c.objects);
+    c.seed = envDouble("TPUV7_STUB_SEED", c.seed);
+    c.verbose = envDouble("TPUV7_STUB_VERBOSE", 0) != 0;
+    return c;
+  }();
+  return ret;
+}
+
+int64_t nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void sleepUntilNs(int64_t deadline) {
+  int64_t left = deadline - nowNs();
+  if (left > 0) std::this_thread::sleep_for(std::chrono::nanoseconds(left));
+}
+
+int64_t reserve(int device, Engine engine, double us) {
+  Device& d = *devices()[device];
+  std::lock_guard<std::mutex> lock(d.mutex);
+  int64_t start = std::max(nowNs(), d.free_ns[engine]);
+  d.free_ns[engine] = start + (int64_t)(us * 1e3);
+  return d.free_ns[engine];
+}
+
+int currentDevice() { return t_device; }
+
+int streamDevice(tpuRtStream_t stream) {
+  return static_cast<Stream*>(stream)->device;
+}
+
+int allocationDevice(const void* ptr) {
+  std::lock_guard<std::mutex> lock(g_alloc_mutex);
+  auto it = g_allocs.upper_bound(const_cast<void*>(ptr));
+  if (it == g_allocs.begin()) return -1;
+  --it;
+  const char* begin = static_cast<const char*>(it->first);
+  if (static_cast<const char*>(ptr) >= begin + it->second.second) return -1;
+  return it->second.first;
+}
+
+void enqueue(tpuRtStream_t stream, std::function<void()> task) {
+  if (stream) {
+    static_cast<Stream*>(stream)->push(std::move(task));
+  } else {
+    task();
+  }
+}
+
+}  // namespace tpuv7_stub
+
+using namespace tpuv7_stub;
+
+extern "C" {
+
+tpuRtStatus_t tpuRtInit(void) {
+  if (config().verbose) {
+    std::cerr << "[tpuv7 stub] " << config().devices << " device(s), launch "
+              << config().launch_us << "us + " << config().launch_per_frame_us
+              << "us/frame, h2d " << config().h2d_gbps << "GB/s, d2h "
+              << config().d2h_gbps << "GB/s" << std::endl;
+  }
+  return tpuRtSuccess;
+}
+
+tpuRtStatus_t tpuRtGetDeviceCount(int* count) {
+  if (!count) return tpuRtErrParam;
+  *count = config().devices;
+  return tpuRtSuccess;
+}
+
+tpuRtStatus_t tpuRtSetDevice(int device) {
+  if (device < 0 || device >= config().devices) return tpuRtErrParam;
+  t_device = device;
+  return tpuRtSuccess;
+}
+
+tpuRtStatus_t tpuRtGetDevice(int* device) {
+  if (!device) return tpuRtErrParam;
+  *device = t_device;
+  return tpuRtSuccess;
+}
+
+tpuRtStatus_t tpuRtMalloc(void** devPtr, unsigned long long size,
+                          int parallel_num) {
+  (void)parallel_num;
+  if (!devPtr) return tpuRtErrParam;
+  int device = currentDevice();
+  unsigned long long limit = config().mem_bytes;
+  {
+    std::lock_guard<std::mutex> lock(g_alloc_mutex);
+    Device& d = *devices()[device];
+    if (limit && d.allocated + size > limit) return tpuRtErrNomem;
+    d.allocated += size;
+  }
+  void* ptr = nullptr;
+  if (posix_memalign(&ptr, 64, std::max(size, 1ull))) {
+    std::lock_guard<std::mutex> lock(g_alloc_mutex);
+    devices()[device]->allocated -= size;
+    return tpuRtErrNomem;
+  }
+  std::lock_guard<std::mutex> lock(g_alloc_mutex);
+  g_allocs[ptr] = std::make_pair(device, size);
+  *devPtr = ptr;
+  return tpuRtSuccess;
+}
+
+tpuRtStatus_t tpuRtFree(void** devPtr, int parallel_num) {
+  (void)parallel_num;
+  if (!devPtr || !*devPtr) return tpuRtErrParam;
+  {
+    std::lock_guard<std::mutex> lock(g_alloc_mutex);
+    auto it = g_allocs.find(*devPtr);
+    if (it == g_allocs.end()) return tpuRtErrParam;
+    devices()[it->second.first]->allocated -= it->second.second;
+    g_allocs.erase(it);
+  }
+  free(*devPtr);
+  *devPtr = nullptr;
+  return tpuRtSuccess;
+}
+
+tpuRtStatus_t tpuRtMallocHost(void** ptr, unsigned long long size) {
+  if (!ptr) return tpuRtErrParam;
+  return posix_memalign(ptr, 64, std::max(size, 1ull)) ? tpuRtErrNomem
+                                                        : tpuRtSuccess;
+}
+
+tpuRtStatus_t tpuRtFreeHost(void* ptr) {
+  free(ptr);
+  return tpuRtSuccess;
+}
+
+tpuRtStatus_t tpuRtMemcpyS2D(void* devPtr, const void* hostPtr,
+                             unsigned long long size) {
+  return copyAsync(devPtr, hostPtr, size, config().h2d_gbps, nullptr);
+}
+
+tpuRtStatus_t tpuRtMemcpyD2S(void* hostPtr, const void* devPtr,
+                             unsigned long long size) {
+  return copyAsync(hostPtr, devPtr, size, config().d2h_gbps, nullptr);
+}
+
+tpuRtStatus_t tpuRtMemcpyD2D(void* dstDevPtr, const void* srcDevPtr,
+                             unsigned long long size) {
+  return copyAsync(dstDevPtr, srcDevPtr, size, config().d2d_gbps, nullptr);
+}
+
+tpuRtStatus_t tpuRtMemcpyS2DAsync(void* devPtr, const void* hostPtr,
+                                  unsigned long long size,
+                                  tpuRtStream_t stream) {
+  return copyAsync(devPtr, hostPtr, size, config().h2d_gbps, stream);
+}
+
+tpuRtStatus_t tpuRtMemcpyD2SAsync(void* hostPtr, const void* devPtr,
+                                  unsigned long long size,
+                                  tpuRtStream_t stream) {
+  return copyAsync(hostPtr, devPtr, size, config().d2h_gbps, stream);
+}
+
+tpuRtStatus_t tpuRtMemcpyD2DAsync(void* dstDevPtr, const void* srcDevPtr,
+                                  unsigned long long size,
+                                  tpuRtStream_t stream) {
+  return copyAsync(dstDevPtr, srcDevPtr, size, config().d2d_gbps, stream);
+}
+
+tpuRtStatus_t tpuRtStreamCreate(tpuRtStream_t* pStream) {
+  if (!pStream) return tpuRtErrParam;
+  *pStream = new Stream(currentDevice());
+  return tpuRtSuccess;
+}
+
+tpuRtStatus_t tpuRtStreamDestroy(tpuRtStream_t stream) {
+  if (!stream) return tpuRtErrParam;
+  delete static_cast<Stream*>(stream);
+  return tpuRtSuccess;
+}
+
+tpuRtStatus_t tpuRtStreamSynchronize(tpuRtStream_t stream) {
+  if (stream) static_cast<Stream*>(stream)->synchronize();
+  return tpuRtSuccess;
+}
+
+tpuRtStatus_t tpuRtEventCreate(tpuRtEvent_t* pEvent) {
+  if (!pEvent) return tpuRtErrParam;
+  *pEvent = new EventHandle(std::make_shared<Event>());
+  return tpuRtSuccess;
+}
+
+tpuRtStatus_t tpuRtEventFree(tpuRtEvent_t pEvent, tpuRtStream_t stream) {
+  (void)stream;
+  if (!pEvent) return tpuRtErrParam;
+  delete static_cast<EventHandle*>(pEvent);
+  return tpuRtSuccess;
+}
+
+tpuRtStatus_t tpuRtEventRecord(tpuRtEvent_t event, tpuRtStream_t stream) {
+  if (!event) return tpuRtErrParam;
+  EventHandle e = *static_cast<EventHandle*>(event);
+  uint64_t mark;
+  {
+    std::lock_guard<std::mutex> lock(e->mutex);
+    mark = ++e->recorded;
+  }
+  enqueue(stream, [e, mark] {
+    {
+      std::lock_guard<std::mutex> lock(e->mutex);
+      e->completed = std::max(e->completed, mark);
+    }
+    e->cv.notify_all();
+  });
+  return tpuRtSuccess;
+}
+
+tpuRtStatus_t tpuRtEventQuery(tpuRtEvent_t event) {
+  if (!event) return tpuRtErrParam;
+  Event& e = **static_cast<EventHandle*>(event);
+  std::lock_guard<std::mutex> lock(e.mutex);
+  return e.completed >= e.recorded ? tpuRtSuccess : tpuRtDevnotready;
+}
+
+tpuRtStatus_t tpuRtEventSynchronize(tpuRtEvent_t event) {
+  if (!event) return tpuRtErrParam;
+  (*static_cast<EventHandle*>(event))->wait();
+  return tpuRtSuccess;
+}
+
+tpuRtStatus_t tpuRtStreamWaitEvent(tpuRtStream_t stream, tpuRtEvent_t event) {
+  if (!event) return tpuRtErrParam;
+  EventHandle e = *static_cast<EventHandle*>(event);
+  uint64_t target;
+  {
+    std::lock_guard<std::mutex> lock(e->mutex);
+    target = e->recorded;
+  }
+  enqueue(stream, [e, target] {
+    std::unique_lock<std::mutex> lock(e->mutex);
+    e->cv.wait(lock, [&] { return e->completed >= target; });
+  });
+  return tpuRtSuccess;
+}
+
+}  // extern "C"
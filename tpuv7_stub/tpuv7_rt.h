@@ -0,0 +1,70 @@
+#ifndef TPUV7_RT_H_
+#define TPUV7_RT_H_
+
+/*
+ * Stand-in declarations of the tpuv7 runtime calls used by this repo, see
+ * tpuv7_stub/README.md. Built only with -DTPUV7_USE_STUB=ON.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+  tpuRtSuccess = 0,
+  tpuRtDevnotready = 600,
+  tpuRtErrFailure,
+  tpuRtErrTimeout,
+  tpuRtErrParam,
+  tpuRtErrNomem,
+  tpuRtErrData,
+  tpuRtErrBusy,
+  tpuRtErrNotSupported
+} tpuRtStatus_t;
+
+typedef void* tpuRtStream_t;
+typedef void* tpuRtEvent_t;
+
+tpuRtStatus_t tpuRtInit(void);
+tpuRtStatus_t tpuRtGetDeviceCount(int* count);
+tpuRtStatus_t tpuRtSetDevice(int device);
+tpuRtStatus_t tpuRtGetDevice(int* device);
+
+tpuRtStatus_t tpuRtMalloc(void** devPtr, unsigned long long size,
+                          int parallel_num);
+tpuRtStatus_t tpuRtFree(void** devPtr, int parallel_num);
+tpuRtStatus_t tpuRtMallocHost(void** ptr, unsigned long long size);
+tpuRtStatus_t tpuRtFreeHost(void* ptr);
+
+tpuRtStatus_t tpuRtMemcpyS2D(void* devPtr, const void* hostPtr,
+                             unsigned long long size);
+tpuRtStatus_t tpuRtMemcpyD2S(void* hostPtr, const void* devPtr,
+                             unsigned long long size);
+tpuRtStatus_t tpuRtMemcpyD2D(void* dstDevPtr, const void* srcDevPtr,
+                             unsigned long long size);
+tpuRtStatus_t tpuRtMemcpyS2DAsync(void* devPtr, const void* hostPtr,
+                                  unsigned long long size,
+                                  tpuRtStream_t stream);
+tpuRtStatus_t tpuRtMemcpyD2SAsync(void* hostPtr, const void* devPtr,
+                                  unsigned long long size,
+                                  tpuRtStream_t stream);
+tpuRtStatus_t tpuRtMemcpyD2DAsync(void* dstDevPtr, const void* srcDevPtr,
+                                  unsigned long long size,
+                                  tpuRtStream_t stream);
+
+tpuRtStatus_t tpuRtStreamCreate(tpuRtStream_t* pStream);
+tpuRtStatus_t tpuRtStreamDestroy(tpuRtStream_t stream);
+tpuRtStatus_t tpuRtStreamSynchronize(tpuRtStream_t stream);
+
+tpuRtStatus_t tpuRtEventCreate(tpuRtEvent_t* pEvent);
+tpuRtStatus_t tpuRtEventFree(tpuRtEvent_t pEvent, tpuRtStream_t stream);
+tpuRtStatus_t tpuRtEventRecord(tpuRtEvent_t event, tpuRtStream_t stream);
+tpuRtStatus_t tpuRtEventQuery(tpuRtEvent_t event);
+tpuRtStatus_t tpuRtEventSynchronize(tpuRtEvent_t event);
+tpuRtStatus_t tpuRtStreamWaitEvent(tpuRtStream_t stream, tpuRtEvent_t event);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
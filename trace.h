@@ -0,0 +1,179 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+/*
+ * Scoped trace spans, compiled in with -DTPUV7_ENABLE_TRACE (cmake
+ * -DTPUV7_ENABLE_TRACE=ON) and expanding to nothing otherwise.
+ *
+ *   TPUV7_TRACE_SCOPE("decode");          // span until the end of the scope
+ *   TPUV7_TRACE_THREAD_NAME("post");      // label of the calling thread
+ *   TPUV7_TRACE_EXPORT("trace.json");     // Chrome trace / Perfetto JSON
+ *
+ * Names must be string literals or otherwise outlive the export. Every thread
+ * writes its spans to its own ring, so recording takes no lock: two clock
+ * reads and one store. A ring keeps the last kTraceRingSize spans of its
+ * thread and outlives the thread; export while the traced threads are quiet.
+ */
+
+#ifdef TPUV7_ENABLE_TRACE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+static const size_t kTraceRingSize = 1 << 16;
+
+struct TraceSpan {
+  const char* name;
+  int64_t begin_ns;
+  int64_t end_ns;
+};
+
+/*
+ * Single writer ring of the spans of one thread.
+ */
+class TraceRing {
+ public:
+  explicit TraceRing(int tid) : m_tid(tid), m_spans(kTraceRingSize) {}
+
+  void push(const char* name, int64_t begin_ns, int64_t end_ns) {
+    uint64_t n = m_count.load(std::memory_order_relaxed);
+    m_spans[n & (kTraceRingSize - 1)] = TraceSpan{name, begin_ns, end_ns};
+    m_count.store(n + 1, std::memory_order_release);
+  }
+
+  int tid() const { return m_tid; }
+  std::string name;
+
+  // Spans still in the ring, oldest first.
+  std::vector<TraceSpan> snapshot() const {
+    uint64_t n = m_count.load(std::memory_order_acquire);
+    uint64_t first = n > kTraceRingSize ? n - kTraceRingSize : 0;
+    std::vector<TraceSpan> ret;
+    ret.reserve(n - first);
+    for (uint64_t i = first; i < n; ++i) {
+      ret.push_back(m_spans[i & (kTraceRingSize - 1)]);
+    }
+    return ret;
+  }
+
+ private:
+  int m_tid;
+  std::vector<TraceSpan> m_spans;
+  std::atomic<uint64_t> m_count{0};
+};
+
+class Tracer {
+ public:
+  static Tracer& instance() {
+    static Tracer tracer;
+    return tracer;
+  }
+
+  static int64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // Ring of the calling thread, registered on first use.
+  TraceRing& threadRing() {
+    static thread_local TraceRing* ring = nullptr;
+    if (!ring) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_rings.emplace_back(new TraceRing((int)m_rings.size() + 1));
+      ring = m_rings.back().get();
+    }
+    return *ring;
+  }
+
+  bool exportChromeTrace(const std::string& path) {
+    std::ofstream os(path);
+    if (!os) return false;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    int pid = getpid();
+    os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    auto sep = [&] {
+      if (!first) os << ",";
+      first = false;
+      os << "\n";
+    };
+    for (auto& ring : m_rings) {
+      if (!ring->name.empty()) {
+        sep();
+        os << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+           << ",\"tid\":" << ring->tid() << ",\"args\":{\"name\":\""
+           << ring->name << "\"}}";
+      }
+      for (const TraceSpan& span : ring->snapshot()) {
+        sep();
+        // microseconds, with the ns kept as decimals
+        os << "{\"name\":\"" << span.name << "\",\"ph\":\"X\",\"pid\":" << pid
+           << ",\"tid\":" << ring->tid() << ",\"ts\":" << span.begin_ns / 1000
+           << "." << fraction(span.begin_ns)
+           << ",\"dur\":" << (span.end_ns - span.begin_ns) / 1000 << "."
+           << fraction(span.end_ns - span.begin_ns) << "}";
+      }
+    }
+    os << "\n]}\n";
+    return true;
+  }
+
+ private:
+  Tracer() = default;
+
+  static std::string fraction(int64_t ns) {
+    char buf[8];
+    snprintf(buf, sizeof(buf), "%03d", (int)(ns % 1000));
+    return buf;
+  }
+
+  std::mutex m_mutex;
+  std::vector<std::unique_ptr<TraceRing>> m_rings;
+};
+
+class TraceScope {
+ public:
+  explicit TraceScope(const char* name)
+      : m_name(name), m_begin(Tracer::nowNs()) {}
+  ~TraceScope() {
+    Tracer::instance().threadRing().push(m_name, m_begin, Tracer::nowNs());
+  }
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+
+ private:
+  const char* m_name;
+  int64_t m_begin;
+};
+
+#define TPUV7_TRACE_CONCAT_(a, b) a##b
+#define TPUV7_TRACE_CONCAT(a, b) TPUV7_TRACE_CONCAT_(a, b)
+#define TPUV7_TRACE_SCOPE(name) \
+  TraceScope TPUV7_TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TPUV7_TRACE_THREAD_NAME(thread_name) \
+  (Tracer::instance().threadRing().name = (thread_name))
+#define TPUV7_TRACE_EXPORT(path) Tracer::instance().exportChromeTrace(path)
+
+#else
+
+#define TPUV7_TRACE_SCOPE(name) \
+  do {                          \
+  } while (false)
+#define TPUV7_TRACE_THREAD_NAME(thread_name) \
+  do {                                       \
+  } while (false)
+#define TPUV7_TRACE_EXPORT(path) false
+
+#endif
+
+#endif
@@ -0,0 +1,497 @@
+#ifndef TRACKER_H_
+#define TRACKER_H_
+
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "detection_batch.h"
+#include "thread_pool.h"
+
+enum class TrackerMode {
+  kIoU,   // a track is where its last detection was
+  kSORT,  // a constant velocity Kalman filter predicts every track
+};
+
+struct TrackerParams {
+  TrackerMode mode = TrackerMode::kIoU;
+  // a detection joins a track when their IoU reaches it, a per detection
+  // threshold given to update() overrides it
+  float iou_threshold = 0.3f;
+  // frames a track survives without a detection
+  int max_age = 30;
+  // detections a track needs before update() reports its id
+  int min_hits = 1;
+  // only match detections and tracks of the same class
+  bool per_class = true;
+  // with fewer tracks every pair is checked, without the grid
+  int grid_min_tracks = 32;
+};
+
+namespace tracker_detail {
+
+const int kState = 7;  // cx, cy, area, aspect, vcx, vcy, varea
+const int kMeasure = 4;
+
+inline float iou(float ax1, float ay1, float ax2, float ay2, float bx1,
+                 float by1, float bx2, float by2) {
+  float w = std::max(0.f, std::min(ax2, bx2) - std::max(ax1, bx1));
+  float h = std::max(0.f, std::min(ay2, by2) - std::max(ay1, by1));
+  float overlap = w * h;
+  float uni = (ax2 - ax1) * (ay2 - ay1) + (bx2 - bx1) * (by2 - by1) - overlap;
+  return uni > 0 ? overlap / uni : 0.f;
+}
+
+// Measurement of a box, as in SORT: center, area and aspect ratio.
+inline void measure(float x1, float y1, float x2, float y2, float* z) {
+  float w = x2 - x1, h = y2 - y1;
+  z[0] = x1 + w / 2;
+  z[1] = y1 + h / 2;
+  z[2] = w * h;
+  z[3] = h > 0 ? w / h : 0.f;
+}
+
+inline void stateBox(const float* x, float* x1, float* y1, float* x2,
+                     float* y2) {
+  float w = x[2] > 0 && x[3] > 0 ? sqrtf(x[2] * x[3]) : 0.f;
+  float h = w > 0 ? x[2] / w : 0.f;
+  *x1 = x[0] - w / 2;
+  *y1 = x[1] - h / 2;
+  *x2 = x[0] + w / 2;
+  *y2 = x[1] + h / 2;
+}
+
+inline void kalmanInit(const float* z, float* x, float* p) {
+  for (int i = 0; i < kState; ++i) x[i] = i < kMeasure ? z[i] : 0.f;
+  std::fill(p, p + kState * kState, 0.f);
+  for (int i = 0; i < kState; ++i) {
+    p[i * kState + i] = i < kMeasure ? 10.f : 10000.f;
+  }
+}
+
+// x = F x, P = F P F' + Q, F adding each velocity to its position.
+inline void kalmanPredict(float* x, float* p) {
+  static const float q[kState] = {1, 1, 1, 1, 0.01f, 0.01f, 0.0001f};
+  if (x[2] + x[6] <= 0) x[6] = 0;
+  for (int i = 0; i < 3; ++i) x[i] += x[i + 4];
+  // rows then columns of F
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < kState; ++j) {
+      p[i * kState + j] += p[(i + 4) * kState + j];
+    }
+  }
+  for (int i = 0; i < kState; ++i) {
+    for (int j = 0; j < 3; ++j) p[i * kState + j] += p[i * kState + j + 4];
+  }
+  for (int i = 0; i < kState; ++i) p[i * kState + i] += q[i];
+}
+
+// Correct x and P with measurement z, H taking the first 4 state entries.
+inline void kalmanUpdate(const float* z, float* x, float* p) {
+  static const float r[kMeasure] = {1, 1, 10, 10};
+  // S = H P H' + R, inverted by Gauss-Jordan, it is small and well
+  // conditioned
+  double s[kMeasure][2 * kMeasure];
+  for (int i = 0; i < kMeasure; ++i) {
+    for (int j = 0; j < kMeasure; ++j) {
+      s[i][j] = p[i * kState + j] + (i == j ? r[i] : 0.f);
+      s[i][j + kMeasure] = i == j;
+    }
+  }
+  for (int c = 0; c < kMeasure; ++c) {
+    int pivot = c;
+    for (int i = c + 1; i < kMeasure; ++i) {
+      if (fabs(s[i][c]) > fabs(s[pivot][c])) pivot = i;
+    }
+    if (s[pivot][c] == 0) return;
+    for (int j = 0; j < 2 * kMeasure; ++j) std::swap(s[c][j], s[pivot][j]);
+    double inv = 1 / s[c][c];
+    for (int j = 0; j < 2 * kMeasure; ++j) s[c][j] *= inv;
+    for (int i = 0; i < kMeasure; ++i) {
+      if (i == c) continue;
+      double f = s[i][c];
+      for (int j = 0; j < 2 * kMeasure; ++j) s[i][j] -= f * s[c][j];
+    }
+  }
+  // K = P H' S^-1
+  float k[kState][kMeasure];
+  for (int i = 0; i < kState; ++i) {
+    for (int j = 0; j < kMeasure; ++j) {
+      double sum = 0;
+      for (int m = 0; m < kMeasure; ++m) {
+        sum += p[i * kState + m] * s[m][j + kMeasure];
+      }
+      k[i][j] = sum;
+    }
+  }
+  float y[kMeasure];
+  for (int m = 0; m < kMeasure; ++m) y[m] = z[m] - x[m];
+  for (int i = 0; i < kState; ++i) {
+    for (int m = 0; m < kMeasure; ++m) x[i] += k[i][m] * y[m];
+  }
+  // P -= K H P, H P being the first 4 rows of P
+  float hp[kMeasure * kState];
+  std::copy(p, p + kMeasure * kState, hp);
+  for (int i = 0; i < kState; ++i) {
+    for (int j = 0; j < kState; ++j) {
+      float sum = 0;
+      for (int m = 0; m < kMeasure; ++m) sum += k[i][m] * hp[m * kState + j];
+      p[i * kState + j] -= sum;
+    }
+  }
+}
+
+}  // namespace tracker_detail
+
+/*
+ * Multi-object tracker of one stream. Every frame, the tracks are predicted
+ * (kept in place, or moved by their Kalman filter) and matched to the
+ * detections greedily by decreasing IoU. Candidate pairs come from a grid of
+ * the predicted boxes, with cells about the size of a box, so a detection is
+ * only compared with the tracks around it. Unmatched detections start new
+ * tracks, tracks unmatched for more than max_age frames are dropped. Track
+ * state lives in flat arrays, one entry per track, and every buffer is
+ * reused from frame to frame.
+ */
+class ObjectTracker {
+ public:
+  explicit ObjectTracker(const TrackerParams& params = TrackerParams())
+      : m_params(params) {}
+
+  const TrackerParams& params() const { return m_params; }
+
+  // Track the detections of the next frame. track_ids[i] gets the id of the
+  // track of detection i, -1 while that track has fewer than min_hits
+  // detections. iou_thresholds, when given, holds one threshold per
+  // detection, those not above 0 falling back to params().iou_threshold.
+  void update(const DetectionView& dets, int* track_ids,
+              const float* iou_thresholds = nullptr) {
+    predict();
+    buildGrid();
+    findPairs(dets, iou_thresholds);
+    assign(dets, track_ids);
+    prune();
+  }
+
+  // Drop every track, ids start again from 1.
+  void reset() {
+    resizeTracks(0);
+    m_next_id = 1;
+  }
+
+  // live tracks
+  size_t size() const { return m_id.size(); }
+  int id(size_t t) const { return m_id[t]; }
+  int hits(size_t t) const { return m_hits[t]; }
+  // frames since the last detection of the track, 0 when matched this frame
+  int misses(size_t t) const { return m_misses[t]; }
+  // box of the last detection, or the filtered one in SORT mode
+  Detection box(size_t t) const {
+    return Detection{(int)m_x1[t], (int)m_y1[t], (int)(m_x2[t] - m_x1[t]),
+                     (int)(m_y2[t] - m_y1[t]), m_score[t], m_class[t]};
+  }
+
+ private:
+  struct Pair {
+    float iou;
+    int det;
+    int track;
+  };
+
+  // tracks stop spanning cells beyond this and are checked against all
+  static const int kMaxSpan = 4;
+  static const int kMaxCells = 1 << 16;
+
+  bool kalman() const { return m_params.mode == TrackerMode::kSORT; }
+
+  void predict() {
+    for (size_t t = 0; t < size(); ++t) {
+      m_misses[t]++;
+      if (!kalman()) continue;
+      float* x = &m_state[t * tracker_detail::kState];
+      tracker_detail::kalmanPredict(
+          x, &m_cov[t * tracker_detail::kState * tracker_detail::kState]);
+      tracker_detail::stateBox(x, &m_x1[t], &m_y1[t], &m_x2[t], &m_y2[t]);
+    }
+  }
+
+  // Bucket the tracks by the cells their predicted box overlaps, as CSR
+  // arrays: the tracks of cell c are m_cell_items[m_cell_start[c]...].
+  void buildGrid() {
+    int n = size();
+    m_wide.clear();
+    m_cols = m_rows = 0;
+    if (n < m_params.grid_min_tracks || n == 0) return;
+    float sum = 0;
+    m_grid_x = m_x1[0];
+    m_grid_y = m_y1[0];
+    float max_x = m_x2[0], max_y = m_y2[0];
+    for (int t = 0; t < n; ++t) {
+      sum += std::max(m_x2[t] - m_x1[t], m_y2[t] - m_y1[t]);
+      m_grid_x = std::min(m_grid_x, m_x1[t]);
+      m_grid_y = std::min(m_grid_y, m_y1[t]);
+      max_x = std::max(max_x, m_x2[t]);
+      max_y = std::max(max_y, m_y2[t]);
+    }
+    m_cell = std::max(sum / n, 1.f);
+    m_cols = std::min((int)((max_x - m_grid_x) / m_cell) + 1, 256);
+    m_rows = std::min((int)((max_y - m_grid_y) / m_cell) + 1, kMaxCells / 256);
+    m_cell = std::max({m_cell, (max_x - m_grid_x) / m_cols,
+                       (max_y - m_grid_y) / m_rows});
+
+    m_cell_start.assign(m_cols * m_rows + 1, 0);
+    for (int pass = 0; pass < 2; ++pass) {
+      for (int t = 0; t < n; ++t) {
+        int c0, c1, r0, r1;
+        cellRange(m_x1[t], m_y1[t], m_x2[t], m_y2[t], &c0, &c1, &r0, &r1);
+        if ((c1 - c0 + 1) * (r1 - r0 + 1) > kMaxSpan * kMaxSpan) {
+          if (pass == 0) m_wide.push_back(t);
+          continue;
+        }
+        for (int r = r0; r <= r1; ++r) {
+          for (int c = c0; c <= c1; ++c) {
+            if (pass == 0) {
+              m_cell_start[r * m_cols + c + 1]++;
+            } else {
+              m_cell_items[m_cell_cursor[r * m_cols + c]++] = t;
+            }
+          }
+        }
+      }
+      if (pass == 0) {
+        for (int c = 0; c < m_cols * m_rows; ++c) {
+          m_cell_start[c + 1] += m_cell_start[c];
+        }
+        m_cell_items.resize(m_cell_start.back());
+        m_cell_cursor.assign(m_cell_start.begin(), m_cell_start.end() - 1);
+      }
+    }
+  }
+
+  void cellRange(float x1, float y1, float x2, float y2, int* c0, int* c1,
+                 int* r0, int* r1) const {
+    auto cell = [&](float v, float origin, int num) {
+      return std::min(std::max((int)((v - origin) / m_cell), 0), num - 1);
+    };
+    *c0 = cell(x1, m_grid_x, m_cols);
+    *c1 = cell(x2, m_grid_x, m_cols);
+    *r0 = cell(y1, m_grid_y, m_rows);
+    *r1 = cell(y2, m_grid_y, m_rows);
+  }
+
+  void tryPair(const DetectionView& dets, int d, int t, float thresh) {
+    if (m_params.per_class && dets.classId()[d] != m_class[t]) return;
+    float x1 = dets.x()[d], y1 = dets.y()[d];
+    float x2 = x1 + dets.width()[d], y2 = y1 + dets.height()[d];
+    float v = tracker_detail::iou(x1, y1, x2, y2, m_x1[t], m_y1[t], m_x2[t],
+                                  m_y2[t]);
+    if (v > 0 && v >= thresh) m_pairs.push_back(Pair{v, d, t});
+  }
+
+  // Every (detection, track) pair with an IoU above the threshold.
+  void findPairs(const DetectionView& dets, const float* iou_thresholds) {
+    m_pairs.clear();
+    int n = size();
+    if (n == 0) return;
+    m_visit.assign(n, -1);
+    for (int d = 0; d < (int)dets.size(); ++d) {
+      float thresh = iou_thresholds && iou_thresholds[d] > 0
+                         ? iou_thresholds[d]
+                         : m_params.iou_threshold;
+      if (m_cols == 0) {
+        for (int t = 0; t < n; ++t) tryPair(dets, d, t, thresh);
+        continue;
+      }
+      for (int t : m_wide) tryPair(dets, d, t, thresh);
+      float x1 = dets.x()[d], y1 = dets.y()[d];
+      float x2 = x1 + dets.width()[d], y2 = y1 + dets.height()[d];
+      if (x2 < m_grid_x || y2 < m_grid_y) continue;
+      int c0, c1, r0, r1;
+      cellRange(x1, y1, x2, y2, &c0, &c1, &r0, &r1);
+      for (int r = r0; r <= r1; ++r) {
+        for (int c = c0; c <= c1; ++c) {
+          int cell = r * m_cols + c;
+          for (int i = m_cell_start[cell]; i < m_cell_start[cell + 1]; ++i) {
+            int t = m_cell_items[i];
+            if (m_visit[t] == d) continue;
+            m_visit[t] = d;
+            tryPair(dets, d, t, thresh);
+          }
+        }
+      }
+    }
+  }
+
+  void assign(const DetectionView& dets, int* track_ids) {
+    // ties go to the older track, then to the first detection
+    std::sort(m_pairs.begin(), m_pairs.end(), [](const Pair& a, const Pair& b) {
+      if (a.iou != b.iou) return a.iou > b.iou;
+      if (a.track != b.track) return a.track < b.track;
+      return a.det < b.det;
+    });
+    int n = size();
+    m_det_track.assign(dets.size(), -1);
+    m_track_matched.assign(n, 0);
+    for (const Pair& pair : m_pairs) {
+      if (m_det_track[pair.det] >= 0 || m_track_matched[pair.track]) continue;
+      m_det_track[pair.det] = pair.track;
+      m_track_matched[pair.track] = 1;
+    }
+
+    for (int d = 0; d < (int)dets.size(); ++d) {
+      int t = m_det_track[d];
+      if (t < 0) {
+        t = size();
+        resizeTracks(t + 1);
+        m_id[t] = m_next_id++;
+      }
+      float x1 = dets.x()[d], y1 = dets.y()[d];
+      float x2 = x1 + dets.width()[d], y2 = y1 + dets.height()[d];
+      if (kalman()) {
+        float z[tracker_detail::kMeasure];
+        tracker_detail::measure(x1, y1, x2, y2, z);
+        float* x = &m_state[t * tracker_detail::kState];
+        float* p = &m_cov[t * tracker_detail::kState * tracker_detail::kState];
+        if (m_det_track[d] < 0) {
+          tracker_detail::kalmanInit(z, x, p);
+        } else {
+          tracker_detail::kalmanUpdate(z, x, p);
+        }
+        tracker_detail::stateBox(x, &x1, &y1, &x2, &y2);
+      }
+      m_x1[t] = x1;
+      m_y1[t] = y1;
+      m_x2[t] = x2;
+      m_y2[t] = y2;
+      m_score[t] = dets.score()[d];
+      m_class[t] = dets.classId()[d];
+      m_hits[t]++;
+      m_misses[t] = 0;
+      if (track_ids) {
+        track_ids[d] = m_hits[t] >= m_params.min_hits ? m_id[t] : -1;
+      }
+    }
+  }
+
+  // Drop the tracks unmatched for too long, keeping the others in order.
+  void prune() {
+    const int state = tracker_detail::kState;
+    const int cov = state * state;
+    size_t kept = 0;
+    for (size_t t = 0; t < size(); ++t) {
+      if (m_misses[t] > m_params.max_age) continue;
+      if (kept != t) {
+        m_id[kept] = m_id[t];
+        m_class[kept] = m_class[t];
+        m_hits[kept] = m_hits[t];
+        m_misses[kept] = m_misses[t];
+        m_score[kept] = m_score[t];
+        m_x1[kept] = m_x1[t];
+        m_y1[kept] = m_y1[t];
+        m_x2[kept] = m_x2[t];
+        m_y2[kept] = m_y2[t];
+        if (kalman()) {
+          std::copy_n(&m_state[t * state], state, &m_state[kept * state]);
+          std::copy_n(&m_cov[t * cov], cov, &m_cov[kept * cov]);
+        }
+      }
+      kept++;
+    }
+    resizeTracks(kept);
+  }
+
+  void resizeTracks(size_t n) {
+    m_id.resize(n);
+    m_class.resize(n);
+    m_hits.resize(n, 0);
+    m_misses.resize(n, 0);
+    m_score.resize(n);
+    m_x1.resize(n);
+    m_y1.resize(n);
+    m_x2.resize(n);
+    m_y2.resize(n);
+    if (kalman()) {
+      m_state.resize(n * tracker_detail::kState);
+      m_cov.resize(n * tracker_detail::kState * tracker_detail::kState);
+    }
+  }
+
+  TrackerParams m_params;
+  int m_next_id = 1;
+
+  // tracks
+  std::vector<int> m_id, m_class, m_hits, m_misses;
+  std::vector<float> m_score;
+  std::vector<float> m_x1, m_y1, m_x2, m_y2;  // predicted, then updated box
+  std::vector<float> m_state;  // kState per track, SORT mode
+  std::vector<float> m_cov;    // kState x kState per track, SORT mode
+
+  // grid of the predicted boxes
+  float m_grid_x = 0, m_grid_y = 0, m_cell = 1;
+  int m_cols = 0, m_rows = 0;
+  std::vector<int> m_cell_start, m_cell_cursor, m_cell_items;
+  std::vector<int> m_wide;
+
+  // association
+  std::vector<int> m_visit;
+  std::vector<Pair> m_pairs;
+  std::vector<int> m_det_track;
+  std::vector<char> m_track_matched;
+};
+
+// Detections of one frame of a stream, for MultiStreamTracker::update().
+struct TrackerFrame {
+  int stream = 0;
+  DetectionView dets;
+  int* track_ids = nullptr;
+  const float* iou_thresholds = nullptr;
+};
+
+/*
+ * One ObjectTracker per stream. Streams are independent, so the frames of
+ * distinct streams can be tracked on a thread pool at once.
+ */
+class MultiStreamTracker {
+ public:
+  explicit MultiStreamTracker(int stream_num = 0,
+                              const TrackerParams& params = TrackerParams())
+      : m_params(params), m_trackers(stream_num, ObjectTracker(params)) {}
+
+  int streamNum() const { return m_trackers.size(); }
+
+  // The tracker of `stream_idx`, created on first use. Not thread safe.
+  ObjectTracker& stream(int stream_idx) {
+    if (stream_idx >= (int)m_trackers.size()) {
+      m_trackers.resize(stream_idx + 1, ObjectTracker(m_params));
+    }
+    return m_trackers[stream_idx];
+  }
+
+  void update(int stream_idx, const DetectionView& dets, int* track_ids,
+              const float* iou_thresholds = nullptr) {
+    stream(stream_idx).update(dets, track_ids, iou_thresholds);
+  }
+
+  // Track `frames`, at most one per stream, on `pool` when given.
+  void update(const std::vector<TrackerFrame>& frames,
+              ThreadPool* pool = nullptr) {
+    for (const TrackerFrame& frame : frames) stream(frame.stream);
+    auto track = [&](int i) {
+      const TrackerFrame& frame = frames[i];
+      m_trackers[frame.stream].update(frame.dets, frame.track_ids,
+                                      frame.iou_thresholds);
+    };
+    if (pool && frames.size() > 1) {
+      pool->parallelFor(frames.size(), track);
+    } else {
+      for (int i = 0; i < (int)frames.size(); ++i) track(i);
+    }
+  }
+
+ private:
+  TrackerParams m_params;
+  std::vector<ObjectTracker> m_trackers;
+};
+
+#endif
@@ -0,0 +1,220 @@
+#include <limits.h>
+
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <random>
+#include <vector>
+
+#include "post_process.cc"
+#include "tracker.h"
+
+/*
+ * Benchmark of ObjectTracker on synthetic streams: objects of 20 to 80
+ * pixels drift across a 1920x1080 frame, each missed by the detector one
+ * frame in ten. The grid association is timed against checking all pairs,
+ * both must give the same ids, in IoU and SORT mode, for 100 to 1000 objects
+ * per stream. An id switch is a detection whose object got another id than
+ * on its previous detection. The detections are also passed through
+ * postProcessFrame as the pre-decoded output of a one class model and
+ * tracked there: ids must match a tracker fed with its DetectionBatch.
+ */
+
+namespace {
+
+struct Object {
+  float x, y, w, h, vx, vy;
+};
+
+struct Stream {
+  std::vector<Object> objects;
+  std::vector<std::vector<Detection>> frames;
+  // object of each detection
+  std::vector<std::vector<int>> truth;
+};
+
+Stream makeStream(int object_num, int frame_num, unsigned seed) {
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> px(0, 1920), py(0, 1080);
+  std::uniform_real_distribution<float> size(20, 80), speed(-3, 3);
+  std::uniform_real_distribution<float> jitter(-1, 1), coin(0, 1);
+  Stream stream;
+  for (int i = 0; i < object_num; ++i) {
+    stream.objects.push_back(
+        Object{px(rng), py(rng), size(rng), size(rng), speed(rng), speed(rng)});
+  }
+  for (int f = 0; f < frame_num; ++f) {
+    std::vector<Detection> dets;
+    std::vector<int> truth;
+    for (int i = 0; i < object_num; ++i) {
+      Object& o = stream.objects[i];
+      o.x += o.vx;
+      o.y += o.vy;
+      if (o.x < 0 || o.x + o.w > 1920) o.vx = -o.vx;
+      if (o.y < 0 || o.y + o.h > 1080) o.vy = -o.vy;
+      if (coin(rng) < 0.1f) continue;
+      int x = o.x + jitter(rng), y = o.y + jitter(rng);
+      dets.push_back(Detection{x, y, (int)o.w, (int)o.h, 0.9f, 0});
+      truth.push_back(i);
+    }
+    stream.frames.push_back(dets);
+    stream.truth.push_back(truth);
+  }
+  return stream;
+}
+
+struct Result {
+  double us_per_frame = 0;
+  unsigned long long switches = 0;
+  std::vector<int> ids;
+};
+
+Result track(const std::vector<Stream>& streams, const TrackerParams& params) {
+  Result result;
+  MultiStreamTracker tracker(streams.size(), params);
+  std::vector<DetectionBatch> batches(streams.size());
+  std::vector<std::vector<int>> ids(streams.size());
+  std::vector<std::map<int, int>> last_id(streams.size());
+  double us = 0;
+  int frame_num = streams[0].frames.size();
+  for (int f = 0; f < frame_num; ++f) {
+    for (size_t s = 0; s < streams.size(); ++s) {
+      batches[s].reset();
+      for (const Detection& det : streams[s].frames[f]) batches[s].push(det);
+      ids[s].resize(batches[s].size());
+      auto start = std::chrono::steady_clock::now();
+      tracker.update(s, batches[s].view(), ids[s].data());
+      us += std::chrono::duration<double, std::micro>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+      for (size_t i = 0; i < ids[s].size(); ++i) {
+        int object = streams[s].truth[f][i];
+        auto it = last_id[s].find(object);
+        if (it != last_id[s].end() && it->second != ids[s][i]) {
+          result.switches++;
+        }
+        last_id[s][object] = ids[s][i];
+        result.ids.push_back(ids[s][i]);
+      }
+    }
+  }
+  result.us_per_frame = us / (frame_num * streams.size());
+  return result;
+}
+
+// Detections of one frame as a [1, N, 6] output, rows of cx, cy, w, h,
+// objectness and class probability.
+void encodeRows(const std::vector<Detection>& dets, std::vector<float>& rows,
+                tpuRtShape_t& shape) {
+  rows.clear();
+  for (const Detection& det : dets) {
+    rows.insert(rows.end(), {det.x + det.width / 2.f, det.y + det.height / 2.f,
+                             (float)det.width, (float)det.height, 0.9f, 1.f});
+  }
+  shape.num_dims = 3;
+  shape.dims[0] = 1;
+  shape.dims[1] = dets.size();
+  shape.dims[2] = 6;
+}
+
+// track() with the detections decoded, NMSed and tracked by postProcessFrame.
+// `same` tells whether the ids match a tracker fed with the DetectionBatch of
+// postProcessFrame.
+Result trackPostProcessed(const std::vector<Stream>& streams,
+                          const TrackerParams& params, bool& same) {
+  Result result;
+  MultiStreamTracker tracker(streams.size(), params);
+  MultiStreamTracker direct(streams.size(), params);
+  FrameGeometry geometry = letterboxGeometry(1920, 1080, 1920, 1080);
+  std::vector<float> rows;
+  tpuRtShape_t shape;
+  std::vector<const tpuRtShape_t*> shapes{&shape};
+  std::vector<YoloV5Head> heads(1);
+  DetectionBatch batch;
+  std::vector<int> ids;
+  std::vector<std::map<int, int>> last_id(streams.size());
+  same = true;
+  double us = 0;
+  int frame_num = streams[0].frames.size();
+  for (int f = 0; f < frame_num; ++f) {
+    for (size_t s = 0; s < streams.size(); ++s) {
+      encodeRows(streams[s].frames[f], rows, shape);
+      heads[0].data = rows.data();
+      auto start = std::chrono::steady_clock::now();
+      auto objects = postProcessFrame(heads, shapes, 1920, 1080, geometry,
+                                      &tracker, s);
+      us += std::chrono::duration<double, std::micro>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+      postProcessFrame(heads, shapes, 1920, 1080, geometry, batch);
+      ids.resize(batch.size());
+      direct.update(s, batch.view(), ids.data());
+      same = same && ids.size() == objects.size();
+      // boxes come back unchanged, but for those clipped to the frame
+      std::map<std::vector<int>, int> truth;
+      for (size_t i = 0; i < streams[s].frames[f].size(); ++i) {
+        const Detection& det = streams[s].frames[f][i];
+        truth[{det.x, det.y, det.width, det.height}] = streams[s].truth[f][i];
+      }
+      for (size_t i = 0; i < objects.size() && same; ++i) {
+        const Rectangle<int>& box = objects[i]->mBox;
+        same = objects[i]->mTrackId == ids[i];
+        auto found = truth.find({box.mX, box.mY, box.mWidth, box.mHeight});
+        if (found == truth.end()) continue;
+        int object = found->second;
+        auto it = last_id[s].find(object);
+        if (it != last_id[s].end() && it->second != ids[i]) result.switches++;
+        last_id[s][object] = ids[i];
+        result.ids.push_back(ids[i]);
+      }
+    }
+  }
+  result.us_per_frame = us / (frame_num * streams.size());
+  return result;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int stream_num = argc > 1 ? atoi(argv[1]) : 8;
+  const int frame_num = 100;
+  bool ok = true;
+  for (int object_num : {100, 300, 1000}) {
+    std::vector<Stream> streams;
+    for (int s = 0; s < stream_num; ++s) {
+      streams.push_back(makeStream(object_num, frame_num, 7 + s));
+    }
+    for (TrackerMode mode : {TrackerMode::kIoU, TrackerMode::kSORT}) {
+      TrackerParams params;
+      params.mode = mode;
+      params.grid_min_tracks = 0;
+      Result grid = track(streams, params);
+      params.grid_min_tracks = INT_MAX;
+      Result all_pairs = track(streams, params);
+      bool same = grid.ids == all_pairs.ids;
+      ok = ok && same;
+      std::cout << object_num << " objects "
+                << (mode == TrackerMode::kIoU ? "iou " : "sort")
+                << " all_pairs=" << all_pairs.us_per_frame
+                << "us grid=" << grid.us_per_frame << "us speedup="
+                << all_pairs.us_per_frame / grid.us_per_frame
+                << "x switches=" << grid.switches
+                << (same ? "" : " IDS DIFFER") << std::endl;
+    }
+  }
+
+  std::vector<Stream> streams;
+  for (int s = 0; s < stream_num; ++s) {
+    streams.push_back(makeStream(100, frame_num, 7 + s));
+  }
+  bool same = false;
+  Result alone = track(streams, TrackerParams());
+  Result post = trackPostProcessed(streams, TrackerParams(), same);
+  // ids persist: no more switches than 1 in 100 detections
+  ok = ok && same && post.switches * 100 < post.ids.size();
+  std::cout << "100 objects post_process=" << post.us_per_frame
+            << "us switches=" << post.switches << " (tracker alone "
+            << alone.switches << ")" << (same ? "" : " IDS DIFFER")
+            << std::endl;
+  return ok ? 0 : 1;
+}
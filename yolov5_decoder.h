@@ -0,0 +1,989 @@
+#ifndef YOLOV5_DECODER_H_
+#define YOLOV5_DECODER_H_
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#include "float16.h"
+#include "tpuv7_modelrt.h"
+
+struct YoloV5Box {
+  int x, y, width, height;
+  float score;
+  int class_id;
+};
+
+using YoloV5BoxVec = std::vector<YoloV5Box>;
+
+inline float sigmoid(float x) { return 1.0 / (1 + expf(-x)); }
+
+inline float logit(float p) { return std::log(p / (1 - p)); }
+
+/*
+ * Default COCO anchors of yolov5s, indexed by output head (stride 8, 16, 32).
+ */
+static const int kYoloV5Anchors[3][3][2] = {
+    {{10, 13}, {16, 30}, {33, 23}},
+    {{30, 61}, {62, 45}, {59, 119}},
+    {{116, 90}, {156, 198}, {373, 326}}};
+static const int kYoloV5Strides[3] = {8, 16, 32};
+
+/*
+ * COCO anchors of the four head yolov5 P6 models (yolov5s6 ...).
+ */
+static const int kYoloV5P6Anchors[4][3][2] = {
+    {{19, 27}, {44, 40}, {38, 94}},
+    {{96, 68}, {86, 152}, {180, 137}},
+    {{140, 301}, {303, 264}, {238, 542}},
+    {{436, 615}, {739, 380}, {925, 792}}};
+static const int kYoloV5P6Strides[4] = {8, 16, 32, 64};
+
+/*
+ * One output head as the device wrote it. Integer types hold the real value
+ * (x - zero_point) * scale, with scale > 0.
+ */
+struct YoloV5Head {
+  const void* data = nullptr;
+  tpuRtDataType_t dtype = TPU_FLOAT32;
+  float scale = 1.f;
+  int zero_point = 0;
+};
+
+/*
+ * Part of the decode of a set of outputs: cells [begin, end) of anchor
+ * `anchor` of head `output`, or rows [begin, end) of a pre-decoded output.
+ */
+struct YoloV5Tile {
+  int output;
+  int anchor;
+  int begin;
+  int end;
+};
+
+struct YoloV5DecodeParams {
+  // compared against the raw objectness logit, not sigmoid(logit)
+  float obj_logit_threshold = 0.5f;
+  // compared against sigmoid(objectness) * sigmoid(class)
+  float conf_threshold = 0.5f;
+  int net_w = 640;
+  int net_h = 640;
+  // decode with the YoloV5Spec the output shapes match, if any
+  bool specialize = true;
+  // largest tile of YoloV5Decoder::tiles(), in cells or rows
+  int tile_cells = 2048;
+};
+
+/*
+ * Return the indices of the first `count` elements of a strided channel whose
+ * value is greater than `thresh`, in ascending order.
+ */
+inline int scanAboveThreshold(const float* base, int count, int stride,
+                              float thresh, int* out) {
+  int n = 0;
+  int i = 0;
+#if defined(__AVX512F__)
+  const __m512 vthresh = _mm512_set1_ps(thresh);
+  const __m512i vidx = _mm512_mullo_epi32(
+      _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+      _mm512_set1_epi32(stride));
+  for (; i + 16 <= count; i += 16) {
+    __m512 v = _mm512_i32gather_ps(vidx, base + (long)i * stride, 4);
+    unsigned mask = _mm512_cmp_ps_mask(v, vthresh, _CMP_GT_OQ);
+    while (mask) {
+      out[n++] = i + __builtin_ctz(mask);
+      mask &= mask - 1;
+    }
+  }
+#elif defined(__AVX2__)
+  const __m256 vthresh = _mm256_set1_ps(thresh);
+  const __m256i vidx = _mm256_mullo_epi32(
+      _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+  for (; i + 8 <= count; i += 8) {
+    __m256 v = _mm256_i32gather_ps(base + (long)i * stride, vidx, 4);
+    unsigned mask =
+        _mm256_movemask_ps(_mm256_cmp_ps(v, vthresh, _CMP_GT_OQ));
+    while (mask) {
+      out[n++] = i + __builtin_ctz(mask);
+      mask &= mask - 1;
+    }
+  }
+#endif
+  for (; i < count; ++i) {
+    if (base[(long)i * stride] > thresh) out[n++] = i;
+  }
+  return n;
+}
+
+namespace yolov5_detail {
+
+/*
+ * Element types of a head. Every raw element maps to a key whose order is the
+ * order of the real values, so thresholds are compared on the raw data and
+ * only the elements of the cells that pass are dequantized.
+ */
+struct Fp32Codec {
+  using Raw = float;
+  using Key = float;
+  static Key key(Raw v) { return v; }
+  float real(Raw v) const { return v; }
+};
+
+struct Int8Codec {
+  using Raw = int8_t;
+  using Key = int;
+  static const int kMinKey = -128;
+  static const int kMaxKey = 127;
+  float scale;
+  int zero_point;
+  static Key key(Raw v) { return v; }
+  float keyValue(Key k) const { return (k - zero_point) * scale; }
+  float real(Raw v) const { return keyValue(v); }
+#if defined(__AVX512F__)
+  static __m512i keys(__m512i v) {
+    return _mm512_srai_epi32(_mm512_slli_epi32(v, 24), 24);
+  }
+#elif defined(__AVX2__)
+  static __m256i keys(__m256i v) {
+    return _mm256_srai_epi32(_mm256_slli_epi32(v, 24), 24);
+  }
+#endif
+};
+
+struct UInt8Codec {
+  using Raw = uint8_t;
+  using Key = int;
+  static const int kMinKey = 0;
+  static const int kMaxKey = 255;
+  float scale;
+  int zero_point;
+  static Key key(Raw v) { return v; }
+  float keyValue(Key k) const { return (k - zero_point) * scale; }
+  float real(Raw v) const { return keyValue(v); }
+#if defined(__AVX512F__)
+  static __m512i keys(__m512i v) {
+    return _mm512_and_si512(v, _mm512_set1_epi32(0xff));
+  }
+#elif defined(__AVX2__)
+  static __m256i keys(__m256i v) {
+    return _mm256_and_si256(v, _mm256_set1_epi32(0xff));
+  }
+#endif
+};
+
+// fp16 / bf16 bits as a signed int with the magnitude of negatives mirrored,
+// so keys compare like the values. Applying it twice gives the bits back.
+inline int orderedKey16(uint16_t bits) {
+  int b = (int16_t)bits;
+  return b ^ ((b >> 15) & 0x7fff);
+}
+
+template <float (*ToFloat)(uint16_t), int kInfBits>
+struct Float16Codec {
+  using Raw = uint16_t;
+  using Key = int;
+  // -inf and +inf, NaNs lie beyond them
+  static const int kMinKey = -kInfBits - 1;
+  static const int kMaxKey = kInfBits;
+  static Key key(Raw v) { return orderedKey16(v); }
+  float keyValue(Key k) const { return ToFloat(orderedKey16(k)); }
+  float real(Raw v) const { return ToFloat(v); }
+#if defined(__AVX512F__)
+  static __m512i keys(__m512i v) {
+    __m512i b = _mm512_srai_epi32(_mm512_slli_epi32(v, 16), 16);
+    __m512i mirror =
+        _mm512_and_si512(_mm512_srai_epi32(b, 31), _mm512_set1_epi32(0x7fff));
+    return _mm512_xor_si512(b, mirror);
+  }
+#elif defined(__AVX2__)
+  static __m256i keys(__m256i v) {
+    __m256i b = _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+    __m256i mirror =
+        _mm256_and_si256(_mm256_srai_epi32(b, 31), _mm256_set1_epi32(0x7fff));
+    return _mm256_xor_si256(b, mirror);
+  }
+#endif
+};
+
+using Fp16Codec = Float16Codec<halfToFloat, 0x7c00>;
+using Bf16Codec = Float16Codec<bf16ToFloat, 0x7f80>;
+
+inline float keyThreshold(const Fp32Codec&, float thresh) { return thresh; }
+
+// The largest key whose value is <= thresh, so that for any element
+// key(x) > keyThreshold(thresh) exactly when real(x) > thresh. kMinKey - 1
+// when every value is above it.
+template <class Codec>
+int keyThreshold(const Codec& codec, float thresh) {
+  int lo = Codec::kMinKey - 1, hi = Codec::kMaxKey;
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (codec.keyValue(mid) <= thresh) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+inline int scanKeysAbove(const Fp32Codec&, const float* base, int count,
+                         int stride, float thresh, int* out) {
+  return scanAboveThreshold(base, count, stride, thresh, out);
+}
+
+// scanAboveThreshold on keys. The gathers load 4 bytes from each element, so
+// the last element is left to the scalar loop.
+template <class Codec>
+int scanKeysAbove(const Codec&, const typename Codec::Raw* base, int count,
+                  int stride, int thresh, int* out) {
+  int n = 0;
+  int i = 0;
+#if defined(__AVX512F__) || defined(__AVX2__)
+  const char* bytes = reinterpret_cast<const char*>(base);
+  const long row = (long)stride * sizeof(typename Codec::Raw);
+  if (row >= 4) {
+#if defined(__AVX512F__)
+    const __m512i vthresh = _mm512_set1_epi32(thresh);
+    const __m512i vidx = _mm512_mullo_epi32(
+        _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+        _mm512_set1_epi32(row));
+    for (; i + 16 < count; i += 16) {
+      __m512i v = Codec::keys(_mm512_i32gather_epi32(vidx, bytes + i * row, 1));
+      unsigned mask = _mm512_cmpgt_epi32_mask(v, vthresh);
+      while (mask) {
+        out[n++] = i + __builtin_ctz(mask);
+        mask &= mask - 1;
+      }
+    }
+#elif defined(__AVX2__)
+    const __m256i vthresh = _mm256_set1_epi32(thresh);
+    const __m256i vidx = _mm256_mullo_epi32(
+        _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(row));
+    for (; i + 8 < count; i += 8) {
+      __m256i v = Codec::keys(_mm256_i32gather_epi32(
+          reinterpret_cast<const int*>(bytes + i * row), vidx, 1));
+      unsigned mask = _mm256_movemask_ps(
+          _mm256_castsi256_ps(_mm256_cmpgt_epi32(v, vthresh)));
+      while (mask) {
+        out[n++] = i + __builtin_ctz(mask);
+        mask &= mask - 1;
+      }
+    }
+#endif
+  }
+#endif
+  for (; i < count; ++i) {
+    if (Codec::key(base[(long)i * stride]) > thresh) out[n++] = i;
+  }
+  return n;
+}
+
+inline int argmaxKeys(const Fp32Codec&, const float* p, int count) {
+  float best = p[0];
+  int i = 0;
+#if defined(__AVX512F__)
+  if (count >= 16) {
+    __m512 m = _mm512_loadu_ps(p);
+    for (i = 16; i + 16 <= count; i += 16) {
+      m = _mm512_max_ps(m, _mm512_loadu_ps(p + i));
+    }
+    best = _mm512_reduce_max_ps(m);
+  }
+#elif defined(__AVX2__)
+  if (count >= 8) {
+    __m256 m = _mm256_loadu_ps(p);
+    for (i = 8; i + 8 <= count; i += 8) {
+      m = _mm256_max_ps(m, _mm256_loadu_ps(p + i));
+    }
+    __m128 m4 = _mm_max_ps(_mm256_castps256_ps128(m),
+                           _mm256_extractf128_ps(m, 1));
+    m4 = _mm_max_ps(m4, _mm_movehl_ps(m4, m4));
+    m4 = _mm_max_ss(m4, _mm_shuffle_ps(m4, m4, 1));
+    best = _mm_cvtss_f32(m4);
+  }
+#endif
+  for (; i < count; ++i) {
+    if (p[i] > best) best = p[i];
+  }
+  i = 0;
+#if defined(__AVX512F__)
+  const __m512 vbest = _mm512_set1_ps(best);
+  for (; i + 16 <= count; i += 16) {
+    unsigned mask =
+        _mm512_cmp_ps_mask(_mm512_loadu_ps(p + i), vbest, _CMP_EQ_OQ);
+    if (mask) return i + __builtin_ctz(mask);
+  }
+#elif defined(__AVX2__)
+  const __m256 vbest = _mm256_set1_ps(best);
+  for (; i + 8 <= count; i += 8) {
+    unsigned mask = _mm256_movemask_ps(
+        _mm256_cmp_ps(_mm256_loadu_ps(p + i), vbest, _CMP_EQ_OQ));
+    if (mask) return i + __builtin_ctz(mask);
+  }
+#endif
+  for (; i < count; ++i) {
+    if (p[i] == best) return i;
+  }
+  return 0;
+}
+
+// Index of the first largest key of p[0, count), the class argmax. Two
+// passes, max then the first element equal to it, so it vectorizes and
+// still keeps the first of equal classes.
+template <class Codec>
+int argmaxKeys(const Codec&, const typename Codec::Raw* p, int count) {
+  typename Codec::Key best = Codec::key(p[0]);
+  int ret = 0;
+  for (int d = 1; d < count; d++) {
+    typename Codec::Key v = Codec::key(p[d]);
+    if (v > best) {
+      best = v;
+      ret = d;
+    }
+  }
+  return ret;
+}
+
+#if defined(__AVX2__)
+template <class Raw>
+int argmaxBytes(const Raw* p, int count) {
+  const bool is_signed = (Raw)-1 < 0;
+  const char* bytes = reinterpret_cast<const char*>(p);
+  int best = p[0];
+  int i = 0;
+  if (count >= 32) {
+    __m256i m = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bytes));
+    for (i = 32; i + 32 <= count; i += 32) {
+      __m256i v =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bytes + i));
+      m = is_signed ? _mm256_max_epi8(m, v) : _mm256_max_epu8(m, v);
+    }
+    Raw lanes[32];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), m);
+    for (Raw v : lanes) best = std::max<int>(best, v);
+  }
+  for (; i < count; ++i) best = std::max<int>(best, p[i]);
+  const __m256i vbest = _mm256_set1_epi8((char)best);
+  for (i = 0; i + 32 <= count; i += 32) {
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bytes + i)),
+        vbest));
+    if (mask) return i + __builtin_ctz(mask);
+  }
+  for (; i < count; ++i) {
+    if (p[i] == best) return i;
+  }
+  return 0;
+}
+
+inline int argmaxKeys(const Int8Codec&, const int8_t* p, int count) {
+  return argmaxBytes(p, count);
+}
+
+inline int argmaxKeys(const UInt8Codec&, const uint8_t* p, int count) {
+  return argmaxBytes(p, count);
+}
+
+// orderedKey16 of 16 elements, in 16-bit lanes
+inline __m256i orderedKeys16(__m256i v) {
+  return _mm256_xor_si256(
+      v, _mm256_and_si256(_mm256_srai_epi16(v, 15), _mm256_set1_epi16(0x7fff)));
+}
+
+template <float (*ToFloat)(uint16_t), int kInfBits>
+int argmaxKeys(const Float16Codec<ToFloat, kInfBits>&, const uint16_t* p,
+               int count) {
+  int best = orderedKey16(p[0]);
+  int i = 0;
+  if (count >= 16) {
+    __m256i m = orderedKeys16(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)));
+    for (i = 16; i + 16 <= count; i += 16) {
+      m = _mm256_max_epi16(m, orderedKeys16(_mm256_loadu_si256(
+                                  reinterpret_cast<const __m256i*>(p + i))));
+    }
+    int16_t lanes[16];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), m);
+    for (int16_t v : lanes) best = std::max<int>(best, v);
+  }
+  for (; i < count; ++i) best = std::max(best, orderedKey16(p[i]));
+  const __m256i vbest = _mm256_set1_epi16((short)best);
+  for (i = 0; i + 16 <= count; i += 16) {
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(
+        orderedKeys16(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i))),
+        vbest));
+    if (mask) return i + __builtin_ctz(mask) / 2;
+  }
+  for (; i < count; ++i) {
+    if (orderedKey16(p[i]) == best) return i;
+  }
+  return 0;
+}
+#endif
+
+/*
+ * Candidates of one tile of a head, in cell order. Layout gives its shape,
+ * anchors and grid: the ones YoloV5Decoder caches per output shapes, or a
+ * head of a YoloV5Spec, where they are compile-time constants.
+ */
+template <class Codec, class Layout>
+void decodeHeadCells(const typename Codec::Raw* data, const Codec& codec,
+                     const Layout& layout, const YoloV5Tile& tile,
+                     const YoloV5DecodeParams& params, int* cells,
+                     YoloV5BoxVec& boxes) {
+  using Raw = typename Codec::Raw;
+  using Key = typename Codec::Key;
+  // cells at or below logit(conf_threshold) can never reach conf_threshold;
+  // step below it so rounding never rejects a cell the exact test keeps.
+  const float scan_thresh =
+      std::max(params.obj_logit_threshold,
+               std::nextafter(logit(params.conf_threshold), -INFINITY));
+  const Key scan_key = keyThreshold(codec, scan_thresh);
+  const Key obj_key = keyThreshold(codec, params.obj_logit_threshold);
+  const int area = layout.featH() * layout.featW();
+  const int nout = layout.nout();
+  const float class_thresh = params.conf_threshold;
+  const int a = tile.anchor;
+  const Raw* plane = data + (long)a * area * nout;
+  int n = scanKeysAbove(codec, plane + (long)tile.begin * nout + 4,
+                        tile.end - tile.begin, nout, scan_key, cells);
+  for (int k = 0; k < n; ++k) {
+    const int i = tile.begin + cells[k];
+    const Raw* ptr = plane + (long)i * nout;
+    if (!(Codec::key(ptr[4]) > obj_key)) continue;
+
+    // class argmax on the raw keys, only the winner is dequantized
+    float score = sigmoid(codec.real(ptr[4]));
+    int class_id = argmaxKeys(codec, ptr + 5, nout - 5);
+    float confidence = codec.real(ptr[5 + class_id]);
+    if (!(confidence > -std::log(score / class_thresh - 1))) continue;
+
+    float centerX =
+        (sigmoid(codec.real(ptr[0])) * 2 - 0.5 + layout.gridX(i)) /
+        layout.featW() * params.net_w;
+    float centerY =
+        (sigmoid(codec.real(ptr[1])) * 2 - 0.5 + layout.gridY(i)) /
+        layout.featH() * params.net_h;
+    double sw = sigmoid(codec.real(ptr[2])) * 2;
+    double sh = sigmoid(codec.real(ptr[3])) * 2;
+    float width = sw * sw * layout.anchorW(a);
+    float height = sh * sh * layout.anchorH(a);
+
+    YoloV5Box box;
+    box.x = centerX - width / 2;
+    if (box.x < 0) box.x = 0;
+    box.y = centerY - height / 2;
+    if (box.y < 0) box.y = 0;
+    box.width = width;
+    box.height = height;
+    box.class_id = class_id;
+    box.score = sigmoid(confidence) * score;
+    boxes.push_back(box);
+  }
+}
+
+// decodeHeadCells in the element type of `head`.
+template <class Layout>
+void decodeHeadAnyType(const YoloV5Head& head, const Layout& layout,
+                       const YoloV5Tile& tile,
+                       const YoloV5DecodeParams& params, int* cells,
+                       YoloV5BoxVec& boxes) {
+  switch (head.dtype) {
+    case TPU_FLOAT32:
+      decodeHeadCells(static_cast<const float*>(head.data), Fp32Codec(),
+                      layout, tile, params, cells, boxes);
+      break;
+    case TPU_FLOAT16:
+      decodeHeadCells(static_cast<const uint16_t*>(head.data), Fp16Codec(),
+                      layout, tile, params, cells, boxes);
+      break;
+    case TPU_BFLOAT16:
+      decodeHeadCells(static_cast<const uint16_t*>(head.data), Bf16Codec(),
+                      layout, tile, params, cells, boxes);
+      break;
+    case TPU_INT8:
+      decodeHeadCells(static_cast<const int8_t*>(head.data),
+                      Int8Codec{head.scale, head.zero_point}, layout, tile,
+                      params, cells, boxes);
+      break;
+    case TPU_UINT8:
+      decodeHeadCells(static_cast<const uint8_t*>(head.data),
+                      UInt8Codec{head.scale, head.zero_point}, layout, tile,
+                      params, cells, boxes);
+      break;
+    default:
+      break;  // not YoloV5Decoder::supports()
+  }
+}
+
+/*
+ * Candidates of a pre-decoded output, rows of cx, cy, w, h in input pixels,
+ * objectness and class probabilities. The tests of decodeHeadCells are made
+ * on probabilities: objectness above sigmoid(obj_logit_threshold) and
+ * objectness * class above conf_threshold. Classes are at most 1, so rows
+ * at or below conf_threshold are dropped by the objectness scan too.
+ */
+template <class Codec>
+void decodeRowCells(const typename Codec::Raw* data, const Codec& codec,
+                    int nout, const YoloV5Tile& tile,
+                    const YoloV5DecodeParams& params, int* cells,
+                    YoloV5BoxVec& boxes) {
+  using Raw = typename Codec::Raw;
+  using Key = typename Codec::Key;
+  const float obj_thresh = sigmoid(params.obj_logit_threshold);
+  const float scan_thresh = std::max(
+      obj_thresh, std::nextafter(params.conf_threshold, -INFINITY));
+  const Key scan_key = keyThreshold(codec, scan_thresh);
+  int n = scanKeysAbove(codec, data + (long)tile.begin * nout + 4,
+                        tile.end - tile.begin, nout, scan_key, cells);
+  for (int k = 0; k < n; ++k) {
+    const Raw* ptr = data + (long)(tile.begin + cells[k]) * nout;
+    float objectness = codec.real(ptr[4]);
+    if (!(objectness > obj_thresh)) continue;
+
+    int class_id = argmaxKeys(codec, ptr + 5, nout - 5);
+    float score = objectness * codec.real(ptr[5 + class_id]);
+    if (!(score > params.conf_threshold)) continue;
+
+    float centerX = codec.real(ptr[0]);
+    float centerY = codec.real(ptr[1]);
+    float width = codec.real(ptr[2]);
+    float height = codec.real(ptr[3]);
+
+    YoloV5Box box;
+    box.x = centerX - width / 2;
+    if (box.x < 0) box.x = 0;
+    box.y = centerY - height / 2;
+    if (box.y < 0) box.y = 0;
+    box.width = width;
+    box.height = height;
+    box.class_id = class_id;
+    box.score = score;
+    boxes.push_back(box);
+  }
+}
+
+// decodeRowCells in the element type of `head`.
+inline void decodeRowsAnyType(const YoloV5Head& head, int nout,
+                              const YoloV5Tile& tile,
+                              const YoloV5DecodeParams& params, int* cells,
+                              YoloV5BoxVec& boxes) {
+  switch (head.dtype) {
+    case TPU_FLOAT32:
+      decodeRowCells(static_cast<const float*>(head.data), Fp32Codec(), nout,
+                     tile, params, cells, boxes);
+      break;
+    case TPU_FLOAT16:
+      decodeRowCells(static_cast<const uint16_t*>(head.data), Fp16Codec(),
+                     nout, tile, params, cells, boxes);
+      break;
+    case TPU_BFLOAT16:
+      decodeRowCells(static_cast<const uint16_t*>(head.data), Bf16Codec(),
+                     nout, tile, params, cells, boxes);
+      break;
+    case TPU_INT8:
+      decodeRowCells(static_cast<const int8_t*>(head.data),
+                     Int8Codec{head.scale, head.zero_point}, nout, tile,
+                     params, cells, boxes);
+      break;
+    case TPU_UINT8:
+      decodeRowCells(static_cast<const uint8_t*>(head.data),
+                     UInt8Codec{head.scale, head.zero_point}, nout, tile,
+                     params, cells, boxes);
+      break;
+    default:
+      break;  // not YoloV5Decoder::supports()
+  }
+}
+
+}  // namespace yolov5_detail
+
+/*
+ * Compile-time description of a yolov5 model: class count, heads, anchors
+ * per head ({w, h} of anchor a of head h) and head strides. Decoding one of
+ * its heads has the channel count, anchors and loop bounds as constants.
+ */
+template <int ClassNum, int HeadNum, int AnchorNum,
+          const int (&Anchors)[HeadNum][AnchorNum][2],
+          const int (&Strides)[HeadNum]>
+struct YoloV5Spec {
+  enum {
+    kClassNum = ClassNum,
+    kHeadNum = HeadNum,
+    kAnchorNum = AnchorNum,
+    kOut = 5 + ClassNum
+  };
+
+  static int anchor(int h, int a, int i) { return Anchors[h][a][i]; }
+
+  // Whether the outputs of a net with a net_w x net_h input are this model.
+  static bool matches(const std::vector<const tpuRtShape_t*>& shapes,
+                      int net_w, int net_h) {
+    if ((int)shapes.size() != HeadNum) return false;
+    for (int h = 0; h < HeadNum; ++h) {
+      const tpuRtShape_t& shape = *shapes[h];
+      if (shape.num_dims != 5 || shape.dims[1] != AnchorNum ||
+          shape.dims[2] * Strides[h] != net_h ||
+          shape.dims[3] * Strides[h] != net_w || shape.dims[4] != kOut) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+using YoloV5Coco80 = YoloV5Spec<80, 3, 3, kYoloV5Anchors, kYoloV5Strides>;
+using YoloV5P6Coco80 =
+    YoloV5Spec<80, 4, 3, kYoloV5P6Anchors, kYoloV5P6Strides>;
+
+// Decode of a tile of one head, as picked for a set of output shapes.
+typedef void (*YoloV5HeadKernel)(const YoloV5Head& head,
+                                 const YoloV5DecodeParams& params,
+                                 int feat_h, int feat_w,
+                                 const YoloV5Tile& tile, int* cells,
+                                 YoloV5BoxVec& boxes);
+
+namespace yolov5_detail {
+
+template <class Spec, int H>
+struct SpecHeadLayout {
+  int feat_h;
+  int feat_w;
+  int featH() const { return feat_h; }
+  int featW() const { return feat_w; }
+  static int nout() { return Spec::kOut; }
+  static int anchorW(int a) { return Spec::anchor(H, a, 0); }
+  static int anchorH(int a) { return Spec::anchor(H, a, 1); }
+  int gridX(int i) const { return i % feat_w; }
+  int gridY(int i) const { return i / feat_w; }
+};
+
+template <class Spec, int H>
+void specHeadKernel(const YoloV5Head& head, const YoloV5DecodeParams& params,
+                    int feat_h, int feat_w, const YoloV5Tile& tile, int* cells,
+                    YoloV5BoxVec& boxes) {
+  decodeHeadAnyType(head, SpecHeadLayout<Spec, H>{feat_h, feat_w}, tile,
+                    params, cells, boxes);
+}
+
+template <class Spec, int H = 0, bool kEnd = (H == Spec::kHeadNum)>
+struct SpecKernels {
+  static void fill(YoloV5HeadKernel* kernels) {
+    kernels[H] = &specHeadKernel<Spec, H>;
+    SpecKernels<Spec, H + 1>::fill(kernels);
+  }
+};
+
+template <class Spec, int H>
+struct SpecKernels<Spec, H, true> {
+  static void fill(YoloV5HeadKernel*) {}
+};
+
+template <class Spec>
+bool trySpec(const std::vector<const tpuRtShape_t*>& shapes, int net_w,
+             int net_h, std::vector<YoloV5HeadKernel>& kernels) {
+  if (!Spec::matches(shapes, net_w, net_h)) return false;
+  kernels.resize(Spec::kHeadNum);
+  SpecKernels<Spec>::fill(kernels.data());
+  return true;
+}
+
+// Per head kernels of the first spec the shapes match; add new models here.
+inline bool findSpecKernels(const std::vector<const tpuRtShape_t*>& shapes,
+                            int net_w, int net_h,
+                            std::vector<YoloV5HeadKernel>& kernels) {
+  return trySpec<YoloV5Coco80>(shapes, net_w, net_h, kernels) ||
+         trySpec<YoloV5P6Coco80>(shapes, net_w, net_h, kernels);
+}
+
+}  // namespace yolov5_detail
+
+/*
+ * Decoder of the three 5-D heads ([1, anchor, h, w, 5 + class]) of yolov5.
+ * Grid offsets and anchors are built once per set of output shapes, and
+ * thresholds stay in logit space so a cell is rejected by a single compare of
+ * its objectness channel. fp16, bf16, int8 and uint8 heads are read as they
+ * are, with the thresholds moved to their domain. Output shapes of a known
+ * YoloV5Spec are decoded by its compile-time instantiation instead, with the
+ * same results. Models that decode the grid on the device have one
+ * [1, N, 5 + class] output instead, which is read row by row.
+ */
+class YoloV5Decoder {
+ public:
+  explicit YoloV5Decoder(const YoloV5DecodeParams& params = YoloV5DecodeParams())
+      : m_params(params) {}
+
+  const YoloV5DecodeParams& params() const { return m_params; }
+
+  static bool supports(tpuRtDataType_t dtype) {
+    return dtype == TPU_FLOAT32 || dtype == TPU_FLOAT16 ||
+           dtype == TPU_BFLOAT16 || dtype == TPU_INT8 || dtype == TPU_UINT8;
+  }
+
+  // Index of the pre-decoded [1, N, 5 + class] output, -1 if there is none.
+  // When there is one, it is the only output decoded.
+  static int rowOutput(const std::vector<const tpuRtShape_t*>& shapes) {
+    for (size_t i = 0; i < shapes.size(); ++i) {
+      if (shapes[i]->num_dims == 3 && shapes[i]->dims[2] > 5) return i;
+    }
+    return -1;
+  }
+
+  // Whether the outputs of stage `stage_idx` of a net match a YoloV5Spec.
+  static bool specialized(const tpuRtNetInfo_t& info, int stage_idx = 0) {
+    const tpuRtShape_t& input = info.stages[stage_idx].input_shapes[0];
+    if (input.num_dims != 4) return false;
+    std::vector<const tpuRtShape_t*> shapes = stageShapes(info, stage_idx);
+    if (rowOutput(shapes) >= 0) return false;
+    std::vector<YoloV5HeadKernel> kernels;
+    return yolov5_detail::findSpecKernels(shapes, input.dims[3], input.dims[2],
+                                          kernels);
+  }
+
+  // Whether every head of these 5-D outputs has anchors: the outputs match a
+  // YoloV5Spec, or they are at most three heads of at most three anchors,
+  // which the default anchors describe.
+  bool hasAnchors(const std::vector<const tpuRtShape_t*>& shapes) const {
+    std::vector<YoloV5HeadKernel> kernels;
+    if (m_params.specialize &&
+        yolov5_detail::findSpecKernels(shapes, m_params.net_w, m_params.net_h,
+                                       kernels)) {
+      return true;
+    }
+    if (shapes.size() > 3) return false;
+    for (auto shape : shapes) {
+      if (shape->dims[1] > 3) return false;
+    }
+    return true;
+  }
+
+  // Whether stage `stage_idx` of a net has a pre-decoded output.
+  static bool predecoded(const tpuRtNetInfo_t& info, int stage_idx = 0) {
+    return rowOutput(stageShapes(info, stage_idx)) >= 0;
+  }
+
+  // Append the candidates of all heads to `boxes`, in head, anchor and cell
+  // order, or those of the pre-decoded output in row order.
+  void decode(const std::vector<const float*>& heads,
+              const std::vector<const tpuRtShape_t*>& shapes,
+              YoloV5BoxVec& boxes) {
+    int row = rowOutput(shapes);
+    if (row >= 0) return decodeRows(fp32Head(heads[row]), *shapes[row], boxes);
+    const std::vector<HeadLayout>& layouts = getLayouts(shapes);
+    for (size_t h = 0; h < layouts.size(); ++h) {
+      decodeLayout(fp32Head(heads[h]), layouts[h], boxes);
+    }
+  }
+
+  void decode(const std::vector<YoloV5Head>& heads,
+              const std::vector<const tpuRtShape_t*>& shapes,
+              YoloV5BoxVec& boxes) {
+    int row = rowOutput(shapes);
+    if (row >= 0) return decodeRows(heads[row], *shapes[row], boxes);
+    const std::vector<HeadLayout>& layouts = getLayouts(shapes);
+    for (size_t h = 0; h < layouts.size(); ++h) {
+      decodeLayout(heads[h], layouts[h], boxes);
+    }
+  }
+
+  // Append the candidates of head `h` only, so a head can be decoded as soon
+  // as its data is on the host. Calling it for every head in order gives the
+  // same boxes as decode(); outputs beside a pre-decoded one give none.
+  void decodeHead(size_t h, const float* data,
+                  const std::vector<const tpuRtShape_t*>& shapes,
+                  YoloV5BoxVec& boxes) {
+    decodeHead(h, fp32Head(data), shapes, boxes);
+  }
+
+  void decodeHead(size_t h, const YoloV5Head& head,
+                  const std::vector<const tpuRtShape_t*>& shapes,
+                  YoloV5BoxVec& boxes) {
+    int row = rowOutput(shapes);
+    if (row >= 0) {
+      if ((int)h == row) decodeRows(head, *shapes[h], boxes);
+      return;
+    }
+    decodeLayout(head, getLayouts(shapes)[h], boxes);
+  }
+
+  // Split the decode of outputs of these shapes into tiles of at most
+  // params().tile_cells cells, in the order decode() visits them.
+  void tiles(const std::vector<const tpuRtShape_t*>& shapes,
+             std::vector<YoloV5Tile>& out) {
+    out.clear();
+    int row = rowOutput(shapes);
+    if (row >= 0) {
+      m_tile_layouts = nullptr;
+      addTiles(row, 0, shapes[row]->dims[1], out);
+      return;
+    }
+    m_tile_layouts = &getLayouts(shapes);
+    for (size_t h = 0; h < m_tile_layouts->size(); ++h) {
+      const HeadLayout& layout = (*m_tile_layouts)[h];
+      for (int a = 0; a < layout.anchor_num; ++a) {
+        addTiles(h, a, layout.feat_h * layout.feat_w, out);
+      }
+    }
+  }
+
+  // Append the candidates of one tile of the shapes last given to tiles().
+  // Tiles can be decoded on several threads at once, each with its own
+  // `cells` of tile_cells ints and its own `boxes`; appending the boxes of
+  // all tiles in order gives the boxes of decode().
+  void decodeTile(const YoloV5Tile& tile, const std::vector<YoloV5Head>& heads,
+                  const std::vector<const tpuRtShape_t*>& shapes, int* cells,
+                  YoloV5BoxVec& boxes) const {
+    const YoloV5Head& head = heads[tile.output];
+    if (!m_tile_layouts) {
+      yolov5_detail::decodeRowsAnyType(head, shapes[tile.output]->dims[2],
+                                       tile, m_params, cells, boxes);
+    } else {
+      decodeLayoutTile(head, (*m_tile_layouts)[tile.output], tile, cells,
+                       boxes);
+    }
+  }
+
+ private:
+  struct HeadLayout {
+    int anchor_num;
+    int feat_h;
+    int feat_w;
+    int channels;  // 5 + class
+    std::vector<int> anchors;  // w0, h0, w1, h1, ...
+    std::vector<int> grid_x;
+    std::vector<int> grid_y;
+    YoloV5HeadKernel kernel = nullptr;  // of a matching YoloV5Spec
+
+    int featH() const { return feat_h; }
+    int featW() const { return feat_w; }
+    int nout() const { return channels; }
+    int anchorW(int a) const { return anchors[2 * a]; }
+    int anchorH(int a) const { return anchors[2 * a + 1]; }
+    int gridX(int i) const { return grid_x[i]; }
+    int gridY(int i) const { return grid_y[i]; }
+  };
+
+  static YoloV5Head fp32Head(const float* data) {
+    YoloV5Head head;
+    head.data = data;
+    return head;
+  }
+
+  static std::vector<const tpuRtShape_t*> stageShapes(
+      const tpuRtNetInfo_t& info, int stage_idx) {
+    std::vector<const tpuRtShape_t*> shapes;
+    for (int i = 0; i < info.output.num; ++i) {
+      shapes.push_back(&info.stages[stage_idx].output_shapes[i]);
+    }
+    return shapes;
+  }
+
+  void addTiles(int output, int anchor, int count,
+                std::vector<YoloV5Tile>& out) const {
+    int step = std::max(1, m_params.tile_cells);
+    for (int begin = 0; begin < count; begin += step) {
+      out.push_back(
+          YoloV5Tile{output, anchor, begin, std::min(count, begin + step)});
+    }
+  }
+
+  // rows of the first image of a [batch, N, 5 + class] output
+  void decodeRows(const YoloV5Head& head, const tpuRtShape_t& shape,
+                  YoloV5BoxVec& boxes) {
+    int rows = shape.dims[1];
+    if ((int)m_cells.size() < rows) m_cells.resize(rows);
+    yolov5_detail::decodeRowsAnyType(head, shape.dims[2],
+                                     YoloV5Tile{0, 0, 0, rows}, m_params,
+                                     m_cells.data(), boxes);
+  }
+
+  const std::vector<HeadLayout>& getLayouts(
+      const std::vector<const tpuRtShape_t*>& shapes) {
+    m_key.clear();
+    for (auto shape : shapes) {
+      m_key.insert(m_key.end(), shape->dims, shape->dims + shape->num_dims);
+      m_key.push_back(-1);
+    }
+    auto it = m_layouts.find(m_key);
+    if (it != m_layouts.end()) return it->second;
+
+    std::vector<YoloV5HeadKernel> kernels;
+    if (m_params.specialize) {
+      yolov5_detail::findSpecKernels(shapes, m_params.net_w, m_params.net_h,
+                                     kernels);
+    }
+    std::vector<HeadLayout> layouts(shapes.size());
+    for (size_t h = 0; h < shapes.size(); ++h) {
+      HeadLayout& layout = layouts[h];
+      layout.anchor_num = shapes[h]->dims[1];
+      layout.feat_h = shapes[h]->dims[2];
+      layout.feat_w = shapes[h]->dims[3];
+      layout.channels = shapes[h]->dims[4];
+      if (!kernels.empty()) layout.kernel = kernels[h];
+      // the default anchors cover three heads of three anchors, any other
+      // layout takes a spec; check hasAnchors() first
+      if (!layout.kernel && (h >= 3 || layout.anchor_num > 3)) {
+        std::cerr << "yolov5 head " << h << " with " << layout.anchor_num
+                  << " anchors matches no YoloV5Spec and has no default "
+                     "anchors"
+                  << std::endl;
+        abort();
+      }
+      for (int a = 0; !layout.kernel && a < layout.anchor_num; ++a) {
+        layout.anchors.push_back(kYoloV5Anchors[h][a][0]);
+        layout.anchors.push_back(kYoloV5Anchors[h][a][1]);
+      }
+      int area = layout.feat_h * layout.feat_w;
+      layout.grid_x.resize(area);
+      layout.grid_y.resize(area);
+      for (int i = 0; i < area; ++i) {
+        layout.grid_x[i] = i % layout.feat_w;
+        layout.grid_y[i] = i / layout.feat_w;
+      }
+      if ((int)m_cells.size() < area) m_cells.resize(area);
+    }
+    return m_layouts.emplace(m_key, std::move(layouts)).first->second;
+  }
+
+  void decodeLayout(const YoloV5Head& head, const HeadLayout& layout,
+                    YoloV5BoxVec& boxes) {
+    int area = layout.feat_h * layout.feat_w;
+    for (int a = 0; a < layout.anchor_num; ++a) {
+      decodeLayoutTile(head, layout, YoloV5Tile{0, a, 0, area},
+                       m_cells.data(), boxes);
+    }
+  }
+
+  void decodeLayoutTile(const YoloV5Head& head, const HeadLayout& layout,
+                        const YoloV5Tile& tile, int* cells,
+                        YoloV5BoxVec& boxes) const {
+    if (layout.kernel) {
+      layout.kernel(head, m_params, layout.feat_h, layout.feat_w, tile, cells,
+                    boxes);
+    } else {
+      yolov5_detail::decodeHeadAnyType(head, layout, tile, m_params, cells,
+                                       boxes);
+    }
+  }
+
+  YoloV5DecodeParams m_params;
+  std::map<std::vector<int>, std::vector<HeadLayout>> m_layouts;
+  std::vector<int> m_key;
+  std::vector<int> m_cells;
+  // of the shapes of the last tiles(), null for a pre-decoded output
+  const std::vector<HeadLayout>* m_tile_layouts = nullptr;
+};
+
+#endif